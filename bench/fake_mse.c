@@ -0,0 +1,256 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#define _GNU_SOURCE
+#include "fake_mse.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+__thread bool fake_mse_thread = false;
+
+struct fake_mse_conn
+{
+  struct fake_mse *mse;
+  int fd;
+  char *buf;
+  size_t size;
+  size_t len;
+};
+
+static void conn_printf(struct fake_mse_conn *conn,const char *fmt,...) __attribute__((format(printf,2,3)));
+
+static void conn_printf(struct fake_mse_conn *conn,const char *fmt,...)
+{
+  for(;;)
+  {
+    va_list ap;
+    va_start(ap,fmt);
+    const int n = vsnprintf(conn->buf + conn->len,conn->size - conn->len,fmt,ap);
+    va_end(ap);
+
+    if(n >= 0 && (size_t)n < conn->size - conn->len)
+    {
+      conn->len += n;
+      return;
+    }
+
+    conn->size *= 2;
+    conn->buf = realloc(conn->buf,conn->size);
+    if(NULL == conn->buf)
+      abort();
+  }
+}
+
+/* Number of clients of a pass, and the id of its i-th client */
+static size_t fake_mse_pass_clients(const struct fake_mse *mse,bool tracked)
+{
+  const size_t per_block = tracked ? mse->tracked_per_mille : 1000 - mse->tracked_per_mille;
+  const size_t rest = mse->clients % 1000;
+  const size_t rest_tracked = rest < mse->tracked_per_mille ? rest : mse->tracked_per_mille;
+  return (mse->clients/1000)*per_block + (tracked ? rest_tracked : rest - rest_tracked);
+}
+
+static size_t fake_mse_pass_client(const struct fake_mse *mse,bool tracked,size_t i)
+{
+  const size_t per_block = tracked ? mse->tracked_per_mille : 1000 - mse->tracked_per_mille;
+  return (i/per_block)*1000 + (tracked ? 0 : mse->tracked_per_mille) + i%per_block;
+}
+
+static void fake_mse_entry(struct fake_mse_conn *conn,size_t client,bool tracked)
+{
+  const struct fake_mse *mse = conn->mse;
+  const bool moving = client % 1000 < mse->moving_per_mille;
+  const unsigned int floor = (client + (moving ? mse->generation : 0)) % 5;
+  const double x = (client % 1000)*0.5, y = (client / 1000 % 1000)*0.5;
+
+  conn_printf(conn,
+    "{\"macAddress\":\"00:%02x:%02x:%02x:%02x:%02x\",\"currentlyTracked\":%s,"
+    "\"confidenceFactor\":24.0,\"band\":\"IEEE_802_11_B\",\"dot11Status\":\"ASSOCIATED\","
+    "\"MapInfo\":{\"mapHierarchyString\":\"Campus%zu>Building%zu>Floor%u\",\"floorRefId\":%zu,"
+    "\"Dimension\":{\"length\":500.0,\"width\":690.0,\"height\":30.0,\"offsetX\":0.0,"
+    "\"offsetY\":0.0,\"unit\":\"FEET\"},\"Image\":{\"imageName\":\"floor%u.jpg\"}},"
+    "\"MapCoordinate\":{\"x\":%.2f,\"y\":%.2f,\"unit\":\"FEET\"},"
+    "\"Statistics\":{\"currentServerTime\":\"2014-03-01T10:00:00.000+0100\","
+    "\"firstLocatedTime\":\"2014-03-01T09:00:00.000+0100\","
+    "\"lastLocatedTime\":\"2014-03-01T09:%02u:%02zu.000+0100\"},"
+    "\"GeoCoordinate\":{\"lattitude\":%.6f,\"longitude\":%.6f,\"unit\":\"DEGREES\"}}",
+    (unsigned int)(client>>32)&0xff,(unsigned int)(client>>24)&0xff,(unsigned int)(client>>16)&0xff,
+    (unsigned int)(client>>8)&0xff,(unsigned int)client&0xff,tracked ? "true" : "false",
+    client%4,client/4%16,floor,client%64,floor,x,y,mse->generation%60,client%60,
+    40.0 + x*1e-5,-3.0 - y*1e-5);
+}
+
+/* Body of a page. Pages are numbered from 1, like the MSE does */
+static void fake_mse_page(struct fake_mse_conn *conn,bool tracked,size_t page)
+{
+  const struct fake_mse *mse = conn->mse;
+  const size_t pass_clients = fake_mse_pass_clients(mse,tracked);
+  const size_t total_pages = pass_clients ? (pass_clients + mse->page_size - 1)/mse->page_size : 1;
+  size_t i;
+
+  if(page < 1)
+    page = 1;
+
+  conn_printf(conn,"{\"Locations\":{\"totalPages\":%zu,\"currentPage\":%zu,\"pageSize\":%zu,\"entries\":[",
+    total_pages,page,mse->page_size);
+  for(i=(page-1)*mse->page_size;i<page*mse->page_size && i<pass_clients;++i)
+  {
+    if(i != (page-1)*mse->page_size)
+      conn_printf(conn,",");
+    fake_mse_entry(conn,fake_mse_pass_client(mse,tracked,i),tracked);
+  }
+  conn_printf(conn,"]");
+  if(page < total_pages)
+    conn_printf(conn,",\"nextResourceURI\":\"/api/contextaware/v1/location/clients?page=%zu\"",page+1);
+  conn_printf(conn,"}}");
+}
+
+static bool send_all(int fd,const char *data,size_t len)
+{
+  while(len > 0)
+  {
+    const ssize_t n = send(fd,data,len,MSG_NOSIGNAL);
+    if(n <= 0)
+      return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void *fake_mse_conn_main(void *opaque)
+{
+  struct fake_mse_conn *conn = opaque;
+  struct fake_mse *mse = conn->mse;
+  char request[8192];
+  size_t request_len = 0;
+
+  fake_mse_thread = true;
+  conn->size = 1024*1024;
+  conn->buf = malloc(conn->size);
+
+  for(;;)
+  {
+    char *end;
+    while(NULL == (end = memmem(request,request_len,"\r\n\r\n",4)))
+    {
+      if(request_len == sizeof(request))
+        goto close;
+      const ssize_t n = recv(conn->fd,request + request_len,sizeof(request) - request_len,0);
+      if(n <= 0)
+        goto close;
+      request_len += n;
+    }
+
+    const size_t consumed = end + 4 - request;
+    request[consumed - 1] = '\0';
+    const bool tracked = NULL != strstr(request,"currentlyTracked=true");
+    const char *page_arg = strstr(request,"page=");
+    const size_t page = page_arg ? strtoul(page_arg + strlen("page="),NULL,10) : 1;
+    const bool new_refresh = !tracked && page <= 1;
+
+    if(mse->latency_ms)
+      usleep(mse->latency_ms*1000);
+
+    char header[256];
+    conn->len = 0;
+    fake_mse_page(conn,tracked,page);
+    const int header_len = snprintf(header,sizeof(header),
+      "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",conn->len);
+    if(!send_all(conn->fd,header,header_len) || !send_all(conn->fd,conn->buf,conn->len))
+      goto close;
+    if(new_refresh)
+      __atomic_add_fetch(&mse->generation,1,__ATOMIC_RELAXED);
+
+    memmove(request,request + consumed,request_len - consumed);
+    request_len -= consumed;
+  }
+
+close:
+  close(conn->fd);
+  free(conn->buf);
+  free(conn);
+  return NULL;
+}
+
+static void *fake_mse_accept_main(void *opaque)
+{
+  struct fake_mse *mse = opaque;
+  fake_mse_thread = true;
+
+  for(;;)
+  {
+    const int fd = accept(mse->listen_fd,NULL,NULL);
+    if(fd < 0)
+    {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return NULL; /* Listen socket shut down */
+    }
+
+    pthread_t thread;
+    struct fake_mse_conn *conn = calloc(1,sizeof(*conn));
+    conn->mse = mse;
+    conn->fd = fd;
+    if(0 != pthread_create(&thread,NULL,fake_mse_conn_main,conn))
+    {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+int fake_mse_start(struct fake_mse *mse)
+{
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  mse->listen_fd = socket(AF_INET,SOCK_STREAM,0);
+  if(mse->listen_fd < 0
+    || 0 != bind(mse->listen_fd,(struct sockaddr *)&addr,sizeof(addr))
+    || 0 != listen(mse->listen_fd,64)
+    || 0 != getsockname(mse->listen_fd,(struct sockaddr *)&addr,&addr_len))
+    return -1;
+
+  mse->port = ntohs(addr.sin_port);
+  return pthread_create(&mse->accept_thread,NULL,fake_mse_accept_main,mse);
+}
+
+void fake_mse_stop(struct fake_mse *mse)
+{
+  shutdown(mse->listen_fd,SHUT_RDWR);
+  pthread_join(mse->accept_thread,NULL);
+  close(mse->listen_fd);
+}
@@ -0,0 +1,72 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+ * Fake MSE for the benchmarks.
+ *
+ * It serves synthetic location clients pages over plain HTTP/1.1 on the
+ * loopback, like the MSE REST API does: the currentlyTracked pass and the
+ * rest, paged, with nextResourceURI. Client i has MAC address i.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct fake_mse
+{
+  int listen_fd;
+  /// Listening port, set by fake_mse_start()
+  uint16_t port;
+
+  size_t clients;
+  size_t page_size;
+  /// Tracked clients out of every 1000
+  unsigned int tracked_per_mille;
+  /// Clients that move on every refresh out of every 1000
+  unsigned int moving_per_mille;
+  /// Delay before every response
+  unsigned int latency_ms;
+
+  /// Refreshes started. Moving clients change their floor with it.
+  volatile unsigned int generation;
+  pthread_t accept_thread;
+};
+
+/// True in the fake MSE threads
+extern __thread bool fake_mse_thread;
+
+/**
+  Start listening on an ephemeral loopback port and serve the clients in
+  the background.
+  @param mse Fake MSE, with its parameters set
+  @return 0 on success, -1 and errno otherwise
+*/
+int fake_mse_start(struct fake_mse *mse);
+
+/**
+  Stop accepting connections. The connections already open are served
+  until the client closes them.
+  @param mse Fake MSE started with fake_mse_start()
+*/
+void fake_mse_stop(struct fake_mse *mse);
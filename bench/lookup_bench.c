@@ -0,0 +1,461 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+ * Concurrent lookups benchmark.
+ *
+ * Reader threads look MACs up with rb_mse_req_for_mac_i() (or
+ * rb_mse_req_for_mac() with -s) while the updater thread polls the fake MSE
+ * and publishes new generations. Keys are uniform, or Zipf distributed with
+ * -z, over the clients of the MSE, plus a share of MACs it does not know.
+ *
+ * For every number of readers we print the throughput, the lookup latency
+ * percentiles and the lookups slower than the stall threshold, apart for the
+ * ones made while an update was being fetched, swept and published. Latency
+ * includes a clock_gettime() call, some tens of ns.
+ *
+ * usage: lookup_bench [-n clients] [-t threads]... [-d seconds] [-h hit_ratio]
+ *                     [-z zipf_exponent] [-s] [-u update_seconds]
+ *                     [-m moving_share] [-p page_size] [-S stall_us]
+ *                     [-f filter_bits]
+ *
+ * Without -t, it runs 1, 2, 4... up to the number of CPUs.
+ */
+
+#define _GNU_SOURCE
+#include "rb_mse_api.h"
+#include "fake_mse.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Keys looked up by every thread, in a loop
+#define KEYS_PER_THREAD (1<<18)
+/// Latency histogram: 16 buckets per power of two of ns
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct bench
+{
+  struct fake_mse mse;
+  struct rb_mse_api *rb_mse;
+  /// Updates published, counted from the stats callback
+  volatile unsigned int updates;
+  sem_t updated;
+
+  size_t clients;
+  double hit_ratio;
+  double zipf;
+  /// Cumulative probability of every client rank, for Zipf keys
+  double *zipf_cdf;
+  bool strings;
+  uint64_t stall_ns;
+
+  pthread_barrier_t start;
+  volatile int stop;
+};
+
+struct reader
+{
+  struct bench *bench;
+  pthread_t thread;
+  unsigned int seed;
+
+  uint64_t *keys;
+  char (*str_keys)[18];
+
+  uint64_t ops;
+  uint64_t hits;
+  uint64_t elapsed_ns;
+  /// Lookups slower than the stall threshold, when idle and while updating
+  uint64_t stalls[2];
+  uint64_t ops_updating;
+  uint64_t histogram[HISTOGRAM_BUCKETS];
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static unsigned int histogram_bucket(uint64_t ns)
+{
+  if(ns < (1 << HISTOGRAM_SUB_BITS))
+    return ns;
+  const unsigned int exp = 63 - __builtin_clzll(ns);
+  const unsigned int sub = (ns >> (exp - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+  return ((exp - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+/* Lower bound of a bucket */
+static uint64_t histogram_value(unsigned int bucket)
+{
+  if(bucket < (1 << HISTOGRAM_SUB_BITS))
+    return bucket;
+  const unsigned int exp = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+  const uint64_t sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+  return ((1ULL << HISTOGRAM_SUB_BITS) | sub) << (exp - HISTOGRAM_SUB_BITS);
+}
+
+static uint64_t histogram_percentile(const uint64_t *histogram,uint64_t total,double percentile)
+{
+  const uint64_t rank = ceil(total*percentile);
+  uint64_t seen = 0;
+  unsigned int i;
+  for(i=0;i<HISTOGRAM_BUCKETS;++i)
+  {
+    seen += histogram[i];
+    if(seen >= rank && seen > 0)
+      return histogram_value(i);
+  }
+  return 0;
+}
+
+/* ======================================================================= *
+ *                                  Keys
+ * ======================================================================= */
+
+static double random_unit(unsigned int *seed)
+{
+  return (double)rand_r(seed)/((double)RAND_MAX + 1);
+}
+
+static double *zipf_cdf_new(size_t n,double exponent)
+{
+  double *cdf = malloc(n*sizeof(cdf[0]));
+  double sum = 0;
+  size_t i;
+  if(NULL == cdf)
+    return NULL;
+
+  for(i=0;i<n;++i)
+    cdf[i] = (sum += 1/pow(i+1,exponent));
+  for(i=0;i<n;++i)
+    cdf[i] /= sum;
+  return cdf;
+}
+
+static size_t zipf_rank(const double *cdf,size_t n,double u)
+{
+  size_t lo = 0, hi = n - 1;
+  while(lo < hi)
+  {
+    const size_t mid = lo + (hi - lo)/2;
+    if(cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Hot clients are spread over the MACs instead of being the first ones */
+static uint64_t client_mac(size_t rank,size_t clients)
+{
+  return (rank*UINT64_C(0x9E3779B97F4A7C15)) % clients;
+}
+
+static uint64_t reader_key(const struct bench *bench,unsigned int *seed)
+{
+  if(random_unit(seed) >= bench->hit_ratio)
+  {
+    /* Locally administered MACs, the fake MSE never returns them */
+    return UINT64_C(0x020000000000) | (((uint64_t)rand_r(seed) << 16) ^ rand_r(seed));
+  }
+
+  const size_t rank = bench->zipf_cdf ? zipf_rank(bench->zipf_cdf,bench->clients,random_unit(seed))
+                                      : (size_t)(random_unit(seed)*bench->clients);
+  return client_mac(rank,bench->clients);
+}
+
+static bool reader_keys_init(struct reader *reader)
+{
+  size_t i;
+  reader->keys = malloc(KEYS_PER_THREAD*sizeof(reader->keys[0]));
+  if(reader->bench->strings)
+    reader->str_keys = malloc(KEYS_PER_THREAD*sizeof(reader->str_keys[0]));
+  if(NULL == reader->keys || (reader->bench->strings && NULL == reader->str_keys))
+    return false;
+
+  for(i=0;i<KEYS_PER_THREAD;++i)
+  {
+    const uint64_t mac = reader->keys[i] = reader_key(reader->bench,&reader->seed);
+    if(reader->str_keys)
+      snprintf(reader->str_keys[i],sizeof(reader->str_keys[i]),"%02x:%02x:%02x:%02x:%02x:%02x",
+        (unsigned int)(mac>>40)&0xff,(unsigned int)(mac>>32)&0xff,(unsigned int)(mac>>24)&0xff,
+        (unsigned int)(mac>>16)&0xff,(unsigned int)(mac>>8)&0xff,(unsigned int)mac&0xff);
+  }
+  return true;
+}
+
+/* ======================================================================= *
+ *                                Readers
+ * ======================================================================= */
+
+/* An update is in flight from the first request of the fake MSE until the
+   stats callback */
+static bool bench_updating(const struct bench *bench)
+{
+  return __atomic_load_n(&bench->mse.generation,__ATOMIC_RELAXED)
+                                      != __atomic_load_n(&bench->updates,__ATOMIC_RELAXED);
+}
+
+static void *reader_main(void *opaque)
+{
+  struct reader *reader = opaque;
+  struct bench *bench = reader->bench;
+  size_t i = 0;
+
+  pthread_barrier_wait(&bench->start);
+  const uint64_t start = now_ns();
+  while(!bench->stop)
+  {
+    const bool updating = bench_updating(bench);
+    const uint64_t t0 = now_ns();
+    const struct rb_mse_api_pos *pos = reader->str_keys ? rb_mse_req_for_mac(bench->rb_mse,reader->str_keys[i])
+                                                        : rb_mse_req_for_mac_i(bench->rb_mse,reader->keys[i]);
+    const uint64_t ns = now_ns() - t0;
+
+    reader->hits += NULL != pos;
+    reader->histogram[histogram_bucket(ns)]++;
+    reader->ops_updating += updating;
+    if(ns > bench->stall_ns)
+      reader->stalls[updating]++;
+    reader->ops++;
+    i = (i + 1) & (KEYS_PER_THREAD - 1);
+  }
+  reader->elapsed_ns = now_ns() - start;
+  return NULL;
+}
+
+/* ======================================================================= *
+ *                                 Driver
+ * ======================================================================= */
+
+static void updated_cb(struct rb_mse_api *rb_mse,struct rb_mse_stats *stats,void *opaque)
+{
+  struct bench *bench = opaque;
+  (void)rb_mse;
+  (void)stats;
+
+  /* Updates that failed did not reach us, so catch up with the fake MSE */
+  __atomic_store_n(&bench->updates,__atomic_load_n(&bench->mse.generation,__ATOMIC_RELAXED),__ATOMIC_RELAXED);
+  sem_post(&bench->updated);
+}
+
+static int run(struct bench *bench,unsigned int threads,unsigned int seconds)
+{
+  struct reader *readers = calloc(threads,sizeof(readers[0]));
+  uint64_t histogram[HISTOGRAM_BUCKETS];
+  struct rb_mse_update_stats before,after;
+  uint64_t ops = 0, hits = 0, ops_updating = 0, stalls[2] = {0,0};
+  double min_thread_ops = -1, total_ops_s = 0;
+  unsigned int i,j;
+
+  if(NULL == readers)
+    return -1;
+
+  memset(histogram,0,sizeof(histogram));
+  pthread_barrier_init(&bench->start,NULL,threads + 1);
+  bench->stop = 0;
+
+  for(i=0;i<threads;++i)
+  {
+    readers[i].bench = bench;
+    readers[i].seed = i + 1;
+    if(!reader_keys_init(&readers[i]) || 0 != pthread_create(&readers[i].thread,NULL,reader_main,&readers[i]))
+    {
+      fprintf(stderr,"Cannot start reader %u\n",i);
+      exit(1);
+    }
+  }
+
+  rb_mse_get_update_stats(bench->rb_mse,&before);
+  pthread_barrier_wait(&bench->start);
+  sleep(seconds);
+  bench->stop = 1;
+
+  for(i=0;i<threads;++i)
+  {
+    struct reader *reader = &readers[i];
+    pthread_join(reader->thread,NULL);
+
+    const double ops_s = reader->ops*1e9/reader->elapsed_ns;
+    total_ops_s += ops_s;
+    if(min_thread_ops < 0 || ops_s < min_thread_ops)
+      min_thread_ops = ops_s;
+    ops += reader->ops;
+    hits += reader->hits;
+    ops_updating += reader->ops_updating;
+    stalls[0] += reader->stalls[0];
+    stalls[1] += reader->stalls[1];
+    for(j=0;j<HISTOGRAM_BUCKETS;++j)
+      histogram[j] += reader->histogram[j];
+
+    free(reader->keys);
+    free(reader->str_keys);
+  }
+  rb_mse_get_update_stats(bench->rb_mse,&after);
+
+  const struct rb_mse_stage_stats *publish_before = &before.stages[RB_MSE_STAGE_PUBLISH];
+  const struct rb_mse_stage_stats *publish_after = &after.stages[RB_MSE_STAGE_PUBLISH];
+  const uint64_t publishes = publish_after->count - publish_before->count;
+
+  printf("%7u %9.2f %9.1f %9.1f %5.1f %7"PRIu64" %7"PRIu64" %7"PRIu64" %9"PRIu64" %5.1f %9"PRIu64" %9"PRIu64" %6"PRIu64" %9.1f\n",
+    threads,total_ops_s/1e6,total_ops_s/threads/1e3,min_thread_ops/1e3,ops ? 100.0*hits/ops : 0,
+    histogram_percentile(histogram,ops,0.5),histogram_percentile(histogram,ops,0.99),
+    histogram_percentile(histogram,ops,0.999),histogram_percentile(histogram,ops,1),
+    ops ? 100.0*ops_updating/ops : 0,stalls[0],stalls[1],publishes,
+    publishes ? (publish_after->total_us - publish_before->total_us)/(double)publishes : 0);
+  fflush(stdout);
+
+  pthread_barrier_destroy(&bench->start);
+  free(readers);
+  return 0;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,"usage: %s [-n clients] [-t threads]... [-d seconds] [-h hit_ratio] [-z zipf_exponent] [-s]\n"
+                 "          [-u update_seconds] [-m moving_share] [-p page_size] [-S stall_us]\n"
+                 "          [-f filter_bits]\n",argv0);
+}
+
+int main(int argc,char *argv[])
+{
+  unsigned int threads[32];
+  size_t threads_size = 0;
+  unsigned int seconds = 5, update_time = 1, filter_bits = 10;
+  struct bench bench;
+  char addr[64];
+  size_t i;
+  int opt;
+
+  memset(&bench,0,sizeof(bench));
+  bench.clients = 100000;
+  bench.hit_ratio = 0.9;
+  bench.stall_ns = 50000;
+  bench.mse.page_size = 1000;
+  bench.mse.tracked_per_mille = 500;
+  bench.mse.moving_per_mille = 100;
+
+  while(-1 != (opt = getopt(argc,argv,"n:t:d:h:z:su:m:p:S:f:")))
+  {
+    switch(opt)
+    {
+    case 'n': bench.clients = strtoul(optarg,NULL,10); break;
+    case 't':
+      if(threads_size < sizeof(threads)/sizeof(threads[0]))
+        threads[threads_size++] = strtoul(optarg,NULL,10);
+      break;
+    case 'd': seconds = strtoul(optarg,NULL,10); break;
+    case 'h': bench.hit_ratio = atof(optarg); break;
+    case 'z': bench.zipf = atof(optarg); break;
+    case 's': bench.strings = true; break;
+    case 'u': update_time = strtoul(optarg,NULL,10); break;
+    case 'm': bench.mse.moving_per_mille = atof(optarg)*1000; break;
+    case 'p': bench.mse.page_size = strtoul(optarg,NULL,10); break;
+    case 'S': bench.stall_ns = strtoull(optarg,NULL,10)*1000; break;
+    case 'f': filter_bits = strtoul(optarg,NULL,10); break;
+    default:
+      usage(argv[0]);
+      return 1;
+    };
+  }
+
+  if(0 == bench.clients || 0 == bench.mse.page_size || bench.mse.moving_per_mille > 1000)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  for(i=0;i<threads_size;++i)
+  {
+    if(0 == threads[i])
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(0 == threads_size)
+  {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int n;
+    for(n=1;threads_size < sizeof(threads)/sizeof(threads[0]) && (n == 1 || n <= cpus);n*=2)
+      threads[threads_size++] = n;
+  }
+
+  if(bench.zipf > 0 && NULL == (bench.zipf_cdf = zipf_cdf_new(bench.clients,bench.zipf)))
+  {
+    perror("Cannot build Zipf distribution");
+    return 1;
+  }
+
+  bench.mse.clients = bench.clients;
+  if(0 != fake_mse_start(&bench.mse))
+  {
+    perror("Cannot start fake MSE");
+    return 1;
+  }
+
+  sem_init(&bench.updated,0,0);
+  snprintf(addr,sizeof(addr),"http://127.0.0.1:%u",bench.mse.port);
+  bench.rb_mse = rb_mse_api_new(update_time,addr,"bench:bench");
+  if(NULL == bench.rb_mse)
+  {
+    perror("Cannot create rb_mse_api");
+    return 1;
+  }
+  rb_mse_set_filter_bits(bench.rb_mse,filter_bits);
+  rb_mse_set_stats_cb(bench.rb_mse,updated_cb,&bench);
+  sem_wait(&bench.updated);
+
+  printf("%zu clients, %s lookups, %.0f%% hits, %s keys, update every %us, %.1f%% moving, stall > %"PRIu64"us, "
+    "filter %u bits/MAC\n",bench.clients,bench.strings ? "string" : "integer",bench.hit_ratio*100,
+    bench.zipf > 0 ? "Zipf" : "uniform",update_time,bench.mse.moving_per_mille/10.0,bench.stall_ns/1000,filter_bits);
+  printf("%7s %9s %9s %9s %5s %7s %7s %7s %9s %5s %9s %9s %6s %9s\n","threads","Mops/s","kops/s/th",
+    "min_kops","hit%","p50_ns","p99_ns","p999_ns","max_ns","upd%","stall_idl","stall_upd","publ","publ_us");
+
+  for(i=0;i<threads_size;++i)
+    if(0 != run(&bench,threads[i],seconds))
+      return 1;
+
+  struct rb_mse_filter_stats filter;
+  rb_mse_get_filter_stats(bench.rb_mse,&filter);
+  const uint64_t misses = filter.rejected + filter.false_positives;
+  printf("filter: %zu MACs in %zu kB, %"PRIu64" rejected, %"PRIu64" passed, %.2f%% false positives\n",
+    filter.macs,filter.bytes/1024,filter.rejected,filter.passed,misses ? 100.0*filter.false_positives/misses : 0);
+
+  rb_mse_api_destroy(bench.rb_mse);
+  fake_mse_stop(&bench.mse);
+  sem_destroy(&bench.updated);
+  free(bench.zipf_cdf);
+  return 0;
+}
@@ -0,0 +1,128 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+ * MAC parsing microbenchmark: the old sscanf based mac_from_str() against
+ * mse_mac_parse() and mse_mac_parse_batch().
+ *
+ * usage: mac_parse_bench [number_of_macs] [rounds]
+ */
+
+#include "mse_mac.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BATCH 256
+
+static uint64_t sscanf_mac_from_str(const char *mac)
+{
+  uint64_t one=0,two=0,three=0,four=0,five=0,six=0;
+  sscanf(mac,"%lx:%lx:%lx:%lx:%lx:%lx",&one,&two,&three,&four,&five,&six);
+  return (((((((((one<<8)+two)<<8)+three)<<8)+four)<<8)+five)<<8)+six;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void report(const char *name,double elapsed,size_t parsed,uint64_t check)
+{
+  printf("%-12s %8.2f ns/mac (%016lx)\n",name,elapsed*1e9/parsed,(unsigned long)check);
+}
+
+int main(int argc,char *argv[])
+{
+  const size_t n = argc > 1 ? strtoul(argv[1],NULL,10) : 1000000;
+  const unsigned int rounds = argc > 2 ? strtoul(argv[2],NULL,10) : 10;
+  size_t i,r;
+
+  char **macs = malloc(n*sizeof(macs[0]));
+  char *storage = malloc(n*18);
+  uint64_t *parsed = malloc(n*sizeof(parsed[0]));
+  if(!macs || !storage || !parsed)
+  {
+    fprintf(stderr,"Memory error\n");
+    return 1;
+  }
+
+  srand(1);
+  for(i=0;i<n;++i)
+  {
+    const uint64_t mac = (((uint64_t)rand() << 24) ^ (uint64_t)rand()) & UINT64_C(0xffffffffffff);
+    macs[i] = &storage[i*18];
+    snprintf(macs[i],18,i%2 ? "%02lx:%02lx:%02lx:%02lx:%02lx:%02lx" : "%02lX:%02lX:%02lX:%02lX:%02lX:%02lX",
+      (unsigned long)(mac>>40)&0xff,(unsigned long)(mac>>32)&0xff,(unsigned long)(mac>>24)&0xff,
+      (unsigned long)(mac>>16)&0xff,(unsigned long)(mac>>8)&0xff,(unsigned long)mac&0xff);
+  }
+
+  /* All implementations must agree */
+  mse_mac_parse_batch((const char * const *)macs,n,parsed);
+  for(i=0;i<n;++i)
+  {
+    uint64_t scalar;
+    if(mse_mac_parse(macs[i],&scalar) != 0 || scalar != parsed[i]
+                                           || scalar != sscanf_mac_from_str(macs[i]))
+    {
+      fprintf(stderr,"Mismatch parsing %s\n",macs[i]);
+      return 1;
+    }
+  }
+
+  uint64_t check = 0;
+  double start = now();
+  for(r=0;r<rounds;++r)
+    for(i=0;i<n;++i)
+      check ^= sscanf_mac_from_str(macs[i]);
+  report("sscanf",now()-start,n*rounds,check);
+
+  check = 0;
+  start = now();
+  for(r=0;r<rounds;++r)
+    for(i=0;i<n;++i)
+    {
+      uint64_t mac = 0;
+      mse_mac_parse(macs[i],&mac);
+      check ^= mac;
+    }
+  report("scalar",now()-start,n*rounds,check);
+
+  check = 0;
+  start = now();
+  for(r=0;r<rounds;++r)
+    for(i=0;i<n;i+=BATCH)
+    {
+      const size_t batch = n-i < BATCH ? n-i : BATCH;
+      size_t j;
+      mse_mac_parse_batch((const char * const *)&macs[i],batch,&parsed[i]);
+      for(j=0;j<batch;++j)
+        check ^= parsed[i+j];
+    }
+  report("batch",now()-start,n*rounds,check);
+
+  free(parsed);
+  free(storage);
+  free(macs);
+  return 0;
+}
@@ -0,0 +1,303 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+ * End to end refresh benchmark.
+ *
+ * A fake MSE runs in this process, serving synthetic location clients pages
+ * over plain HTTP on the loopback, and an rb_mse_api polls it. For every
+ * refresh we print its time by stage, the allocations made by the library
+ * and the peak RSS of the process.
+ *
+ * usage: refresh_bench [-n clients]... [-p page_size] [-t tracked_share]
+ *                      [-m moving_share] [-l latency_ms] [-c connections]
+ *                      [-w parse_threads] [-r refreshes]
+ *
+ * Without -n, it runs 1k, 10k, 100k and 1M clients.
+ */
+
+#define _GNU_SOURCE
+#include "rb_mse_api.h"
+#include "fake_mse.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/* ======================================================================= *
+ *                          Allocations counting
+ * ======================================================================= */
+
+/* We replace the allocator entry points and forward them to glibc, so the
+   allocations of the library, curl and librd are counted too. The fake MSE
+   threads do not count. */
+static uint64_t allocs = 0;
+static uint64_t alloc_bytes = 0;
+
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb,size_t size);
+extern void *__libc_realloc(void *ptr,size_t size);
+extern void *__libc_memalign(size_t alignment,size_t size);
+extern void __libc_free(void *ptr);
+
+static void count_alloc(size_t size)
+{
+  if(fake_mse_thread)
+    return;
+  __atomic_add_fetch(&allocs,1,__ATOMIC_RELAXED);
+  __atomic_add_fetch(&alloc_bytes,size,__ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+  count_alloc(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb,size_t size)
+{
+  count_alloc(nmemb*size);
+  return __libc_calloc(nmemb,size);
+}
+
+void *realloc(void *ptr,size_t size)
+{
+  count_alloc(size);
+  return __libc_realloc(ptr,size);
+}
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+int posix_memalign(void **memptr,size_t alignment,size_t size)
+{
+  count_alloc(size);
+  void *mem = __libc_memalign(alignment,size);
+  if(NULL == mem)
+    return ENOMEM;
+  *memptr = mem;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment,size_t size)
+{
+  count_alloc(size);
+  return __libc_memalign(alignment,size);
+}
+#else
+#define BENCH_COUNT_ALLOCS 0
+#endif
+
+/* ======================================================================= *
+ *                                 Driver
+ * ======================================================================= */
+
+/// Taken at the end of every refresh, from the stats callback
+struct refresh_sample
+{
+  sem_t done;
+  uint64_t allocs;
+  uint64_t alloc_bytes;
+  /// Peak RSS since the last refresh, in kB
+  long peak_rss_kb;
+};
+
+/* Peak RSS since the last call, in kB. Falls back to the process peak if
+   the kernel does not let us reset it */
+static long peak_rss_kb(void)
+{
+  long peak = -1;
+  char line[256];
+
+  FILE *status = fopen("/proc/self/status","r");
+  if(status)
+  {
+    while(fgets(line,sizeof(line),status))
+      if(0 == strncmp(line,"VmHWM:",strlen("VmHWM:")))
+        peak = strtol(line + strlen("VmHWM:"),NULL,10);
+    fclose(status);
+  }
+
+  FILE *clear_refs = fopen("/proc/self/clear_refs","w");
+  if(clear_refs)
+  {
+    fputs("5",clear_refs); /* Reset the peak RSS */
+    fclose(clear_refs);
+  }
+
+  if(peak < 0)
+  {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    peak = usage.ru_maxrss;
+  }
+  return peak;
+}
+
+static void refresh_done_cb(struct rb_mse_api *rb_mse,struct rb_mse_stats *stats,void *opaque)
+{
+  struct refresh_sample *sample = opaque;
+  (void)rb_mse;
+  (void)stats;
+
+  sample->allocs = __atomic_load_n(&allocs,__ATOMIC_RELAXED);
+  sample->alloc_bytes = __atomic_load_n(&alloc_bytes,__ATOMIC_RELAXED);
+  sample->peak_rss_kb = peak_rss_kb();
+  sem_post(&sample->done);
+}
+
+static double stage_ms(const struct rb_mse_update_stats *stats,enum rb_mse_stage stage)
+{
+  return stats->stages[stage].last_us/1000.0;
+}
+
+static int run(size_t clients,const struct fake_mse *params,unsigned int connections,unsigned int parse_threads,
+  unsigned int refreshes)
+{
+  struct fake_mse mse = *params;
+  struct refresh_sample sample;
+  char addr[64];
+  unsigned int i;
+
+  mse.clients = clients;
+  mse.generation = 0;
+  if(0 != fake_mse_start(&mse))
+  {
+    perror("Cannot start fake MSE");
+    return -1;
+  }
+
+  memset(&sample,0,sizeof(sample));
+  sem_init(&sample.done,0,0);
+  peak_rss_kb();
+
+  snprintf(addr,sizeof(addr),"http://127.0.0.1:%u",mse.port);
+  const uint64_t allocs_start = __atomic_load_n(&allocs,__ATOMIC_RELAXED);
+  const uint64_t alloc_bytes_start = __atomic_load_n(&alloc_bytes,__ATOMIC_RELAXED);
+  struct rb_mse_api *rb_mse = rb_mse_api_new(1,addr,"bench:bench");
+  if(NULL == rb_mse)
+  {
+    perror("Cannot create rb_mse_api");
+    fake_mse_stop(&mse);
+    return -1;
+  }
+  rb_mse_set_max_connections(rb_mse,connections);
+  rb_mse_set_parse_threads(rb_mse,parse_threads);
+  rb_mse_set_stats_cb(rb_mse,refresh_done_cb,&sample);
+
+  uint64_t last_allocs = allocs_start, last_alloc_bytes = alloc_bytes_start;
+  for(i=0;i<refreshes;++i)
+  {
+    struct rb_mse_update_stats stats;
+    sem_wait(&sample.done);
+    rb_mse_get_update_stats(rb_mse,&stats);
+
+    printf("%9zu %7u %5"PRIu64" %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %10"PRIu64" %9.1f %9.1f\n",
+      clients,i+1,stats.last_pages,stage_ms(&stats,RB_MSE_STAGE_UPDATE),stage_ms(&stats,RB_MSE_STAGE_FETCH),
+      stage_ms(&stats,RB_MSE_STAGE_PARSE),stage_ms(&stats,RB_MSE_STAGE_INSERT),
+      stage_ms(&stats,RB_MSE_STAGE_SWEEP),stage_ms(&stats,RB_MSE_STAGE_PUBLISH) + stage_ms(&stats,RB_MSE_STAGE_FREE),
+      sample.allocs - last_allocs,(sample.alloc_bytes - last_alloc_bytes)/1048576.0,sample.peak_rss_kb/1024.0);
+    fflush(stdout);
+    last_allocs = sample.allocs;
+    last_alloc_bytes = sample.alloc_bytes;
+  }
+
+  rb_mse_api_destroy(rb_mse);
+  fake_mse_stop(&mse);
+  sem_destroy(&sample.done);
+  return 0;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,"usage: %s [-n clients]... [-p page_size] [-t tracked_share] [-m moving_share]\n"
+                 "          [-l latency_ms] [-c connections] [-w parse_threads] [-r refreshes]\n",argv0);
+}
+
+int main(int argc,char *argv[])
+{
+  static const size_t default_clients[] = {1000,10000,100000,1000000};
+  size_t clients[32];
+  size_t clients_size = 0;
+  unsigned int connections = 4, parse_threads = 0, refreshes = 5;
+  struct fake_mse params;
+  size_t i;
+  int opt;
+
+  memset(&params,0,sizeof(params));
+  params.page_size = 1000;
+  params.tracked_per_mille = 500;
+  params.moving_per_mille = 100;
+
+  while(-1 != (opt = getopt(argc,argv,"n:p:t:m:l:c:w:r:h")))
+  {
+    switch(opt)
+    {
+    case 'n':
+      if(clients_size < sizeof(clients)/sizeof(clients[0]))
+        clients[clients_size++] = strtoul(optarg,NULL,10);
+      break;
+    case 'p': params.page_size = strtoul(optarg,NULL,10); break;
+    case 't': params.tracked_per_mille = atof(optarg)*1000; break;
+    case 'm': params.moving_per_mille = atof(optarg)*1000; break;
+    case 'l': params.latency_ms = strtoul(optarg,NULL,10); break;
+    case 'c': connections = strtoul(optarg,NULL,10); break;
+    case 'w': parse_threads = strtoul(optarg,NULL,10); break;
+    case 'r': refreshes = strtoul(optarg,NULL,10); break;
+    default:
+      usage(argv[0]);
+      return 1;
+    };
+  }
+
+  if(0 == params.page_size || params.tracked_per_mille > 1000 || params.moving_per_mille > 1000)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if(0 == clients_size)
+  {
+    memcpy(clients,default_clients,sizeof(default_clients));
+    clients_size = sizeof(default_clients)/sizeof(default_clients[0]);
+  }
+
+  printf("page size %zu, tracked %.1f%%, moving %.1f%%, latency %ums, %u connections, %u parse threads%s\n",
+    params.page_size,params.tracked_per_mille/10.0,params.moving_per_mille/10.0,params.latency_ms,connections,
+    parse_threads,BENCH_COUNT_ALLOCS ? "" : ", allocations not counted");
+  printf("%9s %7s %5s %9s %9s %9s %9s %9s %9s %10s %9s %9s\n","clients","refresh","pages","total_ms",
+    "fetch_ms","parse_ms","insert_ms","sweep_ms","publ_ms","allocs","alloc_MB","peak_MB");
+
+  for(i=0;i<clients_size;++i)
+    if(0 != run(clients[i],&params,connections,parse_threads,refreshes))
+      return 1;
+
+  return 0;
+}
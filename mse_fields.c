@@ -0,0 +1,117 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_fields.h"
+#include "mse_records.h"
+
+#include <stdint.h>
+#include <string.h>
+
+struct mse_fields_header
+{
+  /// RB_MSE_FIELD_* fields laid out after the header
+  uint8_t fields;
+  /// Fields the MSE sent
+  uint8_t present;
+} __attribute__((aligned(8)));
+
+/* Bytes of every field, in the order of their flags. All of them are a
+   multiple of 8, so every field is aligned */
+static const size_t mse_field_sizes[] = {
+  sizeof(struct mse_fields_map_coordinate), /* RB_MSE_FIELD_MAP_COORDINATE */
+  sizeof(double),                           /* RB_MSE_FIELD_CONFIDENCE */
+  sizeof(const char *),                     /* RB_MSE_FIELD_BAND */
+  sizeof(const char *),                     /* RB_MSE_FIELD_DOT11_STATUS */
+  MSE_FIELDS_IP_ADDRESS_SIZE,               /* RB_MSE_FIELD_IP_ADDRESS */
+};
+
+/* Offset of a field from the header, in a record with the fields of the mask */
+static size_t mse_field_offset(unsigned int fields,unsigned int field)
+{
+  size_t offset = sizeof(struct mse_fields_header);
+  unsigned int i;
+
+  for(i=0;(1u << i) < field;++i)
+    if(fields & (1u << i))
+      offset += mse_field_sizes[i];
+  return offset;
+}
+
+static struct mse_fields_header *mse_fields_header(const struct rb_mse_api_pos *position)
+{
+  return (struct mse_fields_header *)(position + 1);
+}
+
+size_t mse_fields_size(unsigned int fields)
+{
+  fields &= RB_MSE_FIELD_ALL;
+  return fields ? mse_field_offset(fields,RB_MSE_FIELD_ALL + 1) : 0;
+}
+
+void mse_fields_write(struct rb_mse_api_pos *position,unsigned int fields,
+  const struct mse_parser_entry *entry,struct mse_location_dict *dict)
+{
+  if(0 == fields)
+    return;
+
+  struct mse_fields_header *header = mse_fields_header(position);
+  unsigned char *data = (unsigned char *)header;
+  header->fields = fields;
+  header->present = entry->fields & fields;
+  position->flags |= MSE_POS_F_FIELDS;
+
+  if(header->present & RB_MSE_FIELD_MAP_COORDINATE)
+  {
+    struct mse_fields_map_coordinate *map = (void *)(data + mse_field_offset(fields,RB_MSE_FIELD_MAP_COORDINATE));
+    map->x = entry->map_x;
+    map->y = entry->map_y;
+    map->unit = entry->map_unit ? mse_location_dict_intern(dict,entry->map_unit) : NULL;
+  }
+  if(header->present & RB_MSE_FIELD_CONFIDENCE)
+    *(double *)(data + mse_field_offset(fields,RB_MSE_FIELD_CONFIDENCE)) = entry->confidence;
+  /* Bands and statuses are a handful of values, so they are interned */
+  if(header->present & RB_MSE_FIELD_BAND)
+    *(const char **)(data + mse_field_offset(fields,RB_MSE_FIELD_BAND))
+      = mse_location_dict_intern(dict,entry->band);
+  if(header->present & RB_MSE_FIELD_DOT11_STATUS)
+    *(const char **)(data + mse_field_offset(fields,RB_MSE_FIELD_DOT11_STATUS))
+      = mse_location_dict_intern(dict,entry->dot11_status);
+  /* But addresses change all the time, and the dictionary never forgets */
+  if(header->present & RB_MSE_FIELD_IP_ADDRESS)
+  {
+    char *ip_address = (char *)(data + mse_field_offset(fields,RB_MSE_FIELD_IP_ADDRESS));
+    strncpy(ip_address,entry->ip_address,MSE_FIELDS_IP_ADDRESS_SIZE - 1);
+    ip_address[MSE_FIELDS_IP_ADDRESS_SIZE - 1] = '\0';
+  }
+}
+
+unsigned int mse_fields_present(const struct rb_mse_api_pos *position)
+{
+  return position->flags & MSE_POS_F_FIELDS ? mse_fields_header(position)->present : 0;
+}
+
+const void *mse_fields_get(const struct rb_mse_api_pos *position,unsigned int field)
+{
+  if(!(mse_fields_present(position) & field))
+    return NULL;
+
+  const struct mse_fields_header *header = mse_fields_header(position);
+  return (const unsigned char *)header + mse_field_offset(header->fields,field);
+}
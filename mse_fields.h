@@ -0,0 +1,72 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Optional fields of the positions.
+ *
+ * The user chooses the RB_MSE_FIELD_* fields it wants when it creates the
+ * rb_mse_api, and only these are parsed and stored. They are stored in the
+ * extra bytes that follow every record (see mse_records.h), packed in the
+ * order of their flags, so a record only grows by the fields of the set:
+ *
+ *   [struct rb_mse_api_pos][header][field][field]...
+ *
+ * The header says which fields are laid out and which of them the MSE sent.
+ * Records that carry it have the MSE_POS_F_FIELDS flag.
+ */
+
+#include "mse_location.h"
+#include "mse_parser.h"
+#include "rb_mse_api.h"
+
+#include <stddef.h>
+
+/// Longest IPv6 text address, with its NUL
+#define MSE_FIELDS_IP_ADDRESS_SIZE 48
+
+/// RB_MSE_FIELD_MAP_COORDINATE field
+struct mse_fields_map_coordinate
+{
+  double x;
+  double y;
+  /// Interned
+  const char *unit;
+};
+
+/* Extra bytes every record needs for the fields of the mask. 0 if none */
+size_t mse_fields_size(unsigned int fields);
+
+/**
+  Store the fields of an entry after its record
+  @param position Record, allocated with mse_fields_size(fields) extra bytes
+  @param fields   RB_MSE_FIELD_* fields of the records
+  @param entry    Entry the position comes from
+  @param dict     Strings of the fields are interned in it
+*/
+void mse_fields_write(struct rb_mse_api_pos *position,unsigned int fields,
+  const struct mse_parser_entry *entry,struct mse_location_dict *dict);
+
+/* RB_MSE_FIELD_* fields the MSE sent for the position */
+unsigned int mse_fields_present(const struct rb_mse_api_pos *position);
+
+/* A field of the position, or NULL if the MSE did not send it */
+const void *mse_fields_get(const struct rb_mse_api_pos *position,unsigned int field);
@@ -0,0 +1,88 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void mse_filter_init(struct mse_filter *filter)
+{
+  memset(filter,0,sizeof(*filter));
+}
+
+void mse_filter_close(struct mse_filter *filter)
+{
+  free(filter->blocks);
+  mse_filter_init(filter);
+}
+
+static void mse_filter_add(struct mse_filter *filter,uint64_t key)
+{
+  const uint64_t hash = mse_filter_hash(key);
+  struct mse_filter_block *block = &filter->blocks[mse_filter_block_of(filter,hash)];
+  const unsigned int step = ((hash >> 9) & (MSE_FILTER_BLOCK_BITS - 1)) | 1;
+  unsigned int bit = hash & (MSE_FILTER_BLOCK_BITS - 1);
+  unsigned int i;
+
+  for(i=0;i<filter->hashes;++i)
+  {
+    block->words[bit/64] |= UINT64_C(1) << (bit%64);
+    bit = (bit + step) & (MSE_FILTER_BLOCK_BITS - 1);
+  }
+  filter->keys++;
+}
+
+int mse_filter_build(struct mse_filter *filter,const struct mse_records *records,unsigned int bits_per_key)
+{
+  const struct mse_records_chunk *chunk;
+  size_t i,keys = 0;
+
+  mse_records_foreach(records,chunk,i)
+    if(!(mse_records_at(chunk,i)->flags & MSE_POS_F_REMOVED))
+      keys++;
+  if(0 == keys || 0 == bits_per_key)
+    return 0;
+
+  /* Blocks are chosen with a 32 bits multiply */
+  if(keys > (size_t)UINT32_MAX*MSE_FILTER_BLOCK_BITS/bits_per_key)
+    keys = (size_t)UINT32_MAX*MSE_FILTER_BLOCK_BITS/bits_per_key;
+  const size_t count = (keys*bits_per_key + MSE_FILTER_BLOCK_BITS - 1)/MSE_FILTER_BLOCK_BITS;
+
+  void *mem = NULL;
+  if(0 != posix_memalign(&mem,64,count*sizeof(struct mse_filter_block)))
+    return -1;
+  memset(mem,0,count*sizeof(struct mse_filter_block));
+
+  /* Optimal number of hashes is bits_per_key*ln(2) */
+  unsigned int hashes = (bits_per_key*693 + 500)/1000;
+  if(hashes < 1)
+    hashes = 1;
+  if(hashes > MSE_FILTER_MAX_HASHES)
+    hashes = MSE_FILTER_MAX_HASHES;
+
+  filter->blocks = mem;
+  filter->count = count;
+  filter->hashes = hashes;
+  mse_records_foreach(records,chunk,i)
+    if(!(mse_records_at(chunk,i)->flags & MSE_POS_F_REMOVED))
+      mse_filter_add(filter,mse_records_at(chunk,i)->mac);
+  return 0;
+}
@@ -0,0 +1,135 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Negative lookup filter of the MACs of one update.
+ *
+ * A blocked Bloom filter: every MAC sets a few bits of a single cache line,
+ * so asking for a MAC touches one line whatever the answer is. The filter is
+ * more than ten times smaller than the index, so it stays in the cache, and
+ * lookups of MACs the MSE has never seen (wired hosts, routers, spoofed
+ * addresses) are answered without touching the index.
+ *
+ * It is built once, after the update has all its positions, and it is
+ * read-only afterwards. An empty filter lets every MAC pass.
+ */
+
+#include "mse_records.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Filter bits per MAC if the user does not set another number
+#define MSE_FILTER_DEFAULT_BITS 10
+/// Bits set per MAC, at most
+#define MSE_FILTER_MAX_HASHES 16
+/// Bits of a block
+#define MSE_FILTER_BLOCK_BITS 512
+
+struct mse_filter_block
+{
+  uint64_t words[MSE_FILTER_BLOCK_BITS/64];
+} __attribute__((aligned(64)));
+
+struct mse_filter
+{
+  struct mse_filter_block *blocks;
+  /// Number of blocks
+  size_t count;
+  /// Bits set per MAC
+  unsigned int hashes;
+  /// MACs added
+  size_t keys;
+};
+
+/// Lookups that went through a filter
+struct mse_filter_counters
+{
+  /// Answered by the filter alone
+  uint64_t rejected;
+  /// Looked up in the index afterwards
+  uint64_t passed;
+  /// Passed, but not in the index either
+  uint64_t false_positives;
+};
+
+/* Empty filter */
+void mse_filter_init(struct mse_filter *filter);
+void mse_filter_close(struct mse_filter *filter);
+
+/**
+  Add the MACs of the records that are not removed. filter must be empty.
+  @param filter       Filter
+  @param records      Records
+  @param bits_per_key Filter bits per MAC. 0 leaves the filter empty
+  @return 0 on success, -1 on memory error. The filter is empty then.
+*/
+int mse_filter_build(struct mse_filter *filter,const struct mse_records *records,unsigned int bits_per_key);
+
+/* Filter memory, in bytes */
+#define mse_filter_size(filter) ((filter)->count*sizeof(struct mse_filter_block))
+
+static inline uint64_t mse_filter_hash(uint64_t key)
+{
+  /* Not the index hash, so keys that collide there spread here */
+  key ^= key >> 33;
+  key *= UINT64_C(0xff51afd7ed558ccd);
+  key ^= key >> 33;
+  key *= UINT64_C(0xc4ceb9fe1a85ec53);
+  key ^= key >> 33;
+  return key;
+}
+
+/* Block of a hash. High bits choose the block, low bits the bits in it */
+static inline size_t mse_filter_block_of(const struct mse_filter *filter,uint64_t hash)
+{
+  return (size_t)(((hash >> 32) * filter->count) >> 32);
+}
+
+/* Bring the block of key to the cache, so a later check does not stall */
+static inline void mse_filter_prefetch(const struct mse_filter *filter,uint64_t key)
+{
+  if(filter->blocks)
+    __builtin_prefetch(&filter->blocks[mse_filter_block_of(filter,mse_filter_hash(key))],0,1);
+}
+
+/* False if key is surely not in the filter */
+static inline bool mse_filter_may_contain(const struct mse_filter *filter,uint64_t key)
+{
+  if(filter->blocks == NULL)
+    return true;
+
+  const uint64_t hash = mse_filter_hash(key);
+  const struct mse_filter_block *block = &filter->blocks[mse_filter_block_of(filter,hash)];
+  const unsigned int step = ((hash >> 9) & (MSE_FILTER_BLOCK_BITS - 1)) | 1;
+  unsigned int bit = hash & (MSE_FILTER_BLOCK_BITS - 1);
+  unsigned int i;
+
+  for(i=0;i<filter->hashes;++i)
+  {
+    if(!(block->words[bit/64] & (UINT64_C(1) << (bit%64))))
+      return false;
+    bit = (bit + step) & (MSE_FILTER_BLOCK_BITS - 1);
+  }
+  return true;
+}
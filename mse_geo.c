@@ -0,0 +1,330 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_geo.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Mean Earth radius, in metres
+#define MSE_GEO_EARTH_RADIUS_M 6371008.8
+#define MSE_GEO_RAD(degrees) ((degrees)*(M_PI/180))
+/// Metres of a degree of lattitude
+#define MSE_GEO_M_PER_DEG MSE_GEO_RAD(MSE_GEO_EARTH_RADIUS_M)
+
+void mse_geo_index_init(struct mse_geo_index *geo)
+{
+  memset(geo,0,sizeof(*geo));
+}
+
+void mse_geo_index_close(struct mse_geo_index *geo)
+{
+  free(geo->cells);
+  free(geo->points);
+  mse_geo_index_init(geo);
+}
+
+static bool mse_geo_indexable(const struct rb_mse_api_pos *position)
+{
+  /* Comparisons are false for NaN too */
+  return !(position->flags & MSE_POS_F_REMOVED) && (position->flags & RB_MSE_POS_F_GEO_VALID)
+    && position->lattitude >= -90 && position->lattitude <= 90
+    && position->longitude >= -180 && position->longitude <= 180;
+}
+
+static uint32_t mse_geo_cell_coord(double value,double min,double cell,uint32_t cells)
+{
+  const double coord = floor((value - min)/cell);
+  if(!(coord > 0))
+    return 0;
+  return coord < cells ? (uint32_t)coord : cells - 1;
+}
+
+static uint32_t mse_geo_row(const struct mse_geo_index *geo,double lattitude)
+{
+  return mse_geo_cell_coord(lattitude,geo->min_lattitude,geo->cell_lattitude,geo->rows);
+}
+
+static uint32_t mse_geo_col(const struct mse_geo_index *geo,double longitude)
+{
+  return mse_geo_cell_coord(longitude,geo->min_longitude,geo->cell_longitude,geo->cols);
+}
+
+/* Grid of about MSE_GEO_CELL_POSITIONS positions per cell, if they were
+   evenly spread over their bounding box */
+static void mse_geo_index_size(struct mse_geo_index *geo,size_t count,double max_lattitude,double max_longitude)
+{
+  const double middle = (geo->min_lattitude + max_lattitude)/2;
+  double m_per_deg_lon = MSE_GEO_M_PER_DEG*cos(MSE_GEO_RAD(middle));
+  if(m_per_deg_lon < 1)
+    m_per_deg_lon = 1; /* Poles */
+
+  const double height_m = (max_lattitude - geo->min_lattitude)*MSE_GEO_M_PER_DEG;
+  const double width_m = (max_longitude - geo->min_longitude)*m_per_deg_lon;
+  const double max_cells = (double)count*MSE_GEO_MAX_CELLS_RATIO + 1;
+  double cell_m = sqrt(width_m*height_m*MSE_GEO_CELL_POSITIONS/count);
+  if(!(cell_m > MSE_GEO_MIN_CELL_M))
+    cell_m = MSE_GEO_MIN_CELL_M;
+
+  /* Points in a line have no area, so bound the cells too */
+  while((floor(height_m/cell_m) + 1)*(floor(width_m/cell_m) + 1) > max_cells)
+    cell_m *= 2;
+
+  geo->rows = floor(height_m/cell_m) + 1;
+  geo->cols = floor(width_m/cell_m) + 1;
+  geo->cell_lattitude = cell_m/MSE_GEO_M_PER_DEG;
+  geo->cell_longitude = cell_m/m_per_deg_lon;
+}
+
+int mse_geo_index_build(struct mse_geo_index *geo,const struct mse_records *records)
+{
+  const struct mse_records_chunk *chunk;
+  double max_lattitude = -90, max_longitude = -180;
+  size_t i,count = 0;
+
+  geo->min_lattitude = 90;
+  geo->min_longitude = 180;
+  mse_records_foreach(records,chunk,i)
+  {
+    const struct rb_mse_api_pos *position = mse_records_at(chunk,i);
+    if(!mse_geo_indexable(position))
+      continue;
+
+    count++;
+    geo->min_lattitude = fmin(geo->min_lattitude,position->lattitude);
+    geo->min_longitude = fmin(geo->min_longitude,position->longitude);
+    max_lattitude = fmax(max_lattitude,position->lattitude);
+    max_longitude = fmax(max_longitude,position->longitude);
+  }
+
+  if(0 == count)
+  {
+    mse_geo_index_init(geo);
+    return 0;
+  }
+  if(count >= UINT32_MAX)
+  {
+    mse_geo_index_init(geo);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  mse_geo_index_size(geo,count,max_lattitude,max_longitude);
+  const size_t cells = (size_t)geo->rows*geo->cols;
+  geo->cells = calloc(cells + 1,sizeof(geo->cells[0]));
+  geo->points = malloc(count*sizeof(geo->points[0]));
+  if(NULL == geo->cells || NULL == geo->points)
+  {
+    mse_geo_index_close(geo);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  /* Counting sort: cells[c] ends as the end of cell c, and every point is
+     placed by moving it down, so it ends as the start of the cell */
+  mse_records_foreach(records,chunk,i)
+    if(mse_geo_indexable(mse_records_at(chunk,i)))
+      geo->cells[(size_t)mse_geo_row(geo,mse_records_at(chunk,i)->lattitude)*geo->cols
+                                      + mse_geo_col(geo,mse_records_at(chunk,i)->longitude)]++;
+  for(i=1;i<=cells;++i)
+    geo->cells[i] += geo->cells[i-1];
+
+  mse_records_foreach(records,chunk,i)
+  {
+    const struct rb_mse_api_pos *position = mse_records_at(chunk,i);
+    if(!mse_geo_indexable(position))
+      continue;
+
+    const size_t cell = (size_t)mse_geo_row(geo,position->lattitude)*geo->cols
+                                                     + mse_geo_col(geo,position->longitude);
+    struct mse_geo_point *point = &geo->points[--geo->cells[cell]];
+    point->lattitude = position->lattitude;
+    point->longitude = position->longitude;
+    point->position = position;
+  }
+
+  geo->count = count;
+  return 0;
+}
+
+double mse_geo_distance_m(double lattitude1,double longitude1,double lattitude2,double longitude2)
+{
+  const double sin_dlat = sin(MSE_GEO_RAD(lattitude2 - lattitude1)/2);
+  const double sin_dlon = sin(MSE_GEO_RAD(longitude2 - longitude1)/2);
+  const double haversine = sin_dlat*sin_dlat
+                  + cos(MSE_GEO_RAD(lattitude1))*cos(MSE_GEO_RAD(lattitude2))*sin_dlon*sin_dlon;
+  return 2*MSE_GEO_EARTH_RADIUS_M*asin(sqrt(fmin(haversine,1)));
+}
+
+struct mse_geo_query
+{
+  /// Bounding box. Longitudes of the part being scanned.
+  double min_lattitude,max_lattitude;
+  double min_longitude,max_longitude;
+
+  /// Radius queries: center, its lattitude cosine, and the haversine of the
+  /// radius central angle. Points farther away are filtered out.
+  bool radius;
+  double lattitude,longitude,cos_lattitude;
+  double max_haversine;
+
+  rb_mse_pos_cb_fn *cb;
+  void *opaque;
+  size_t count;
+  bool stop;
+};
+
+static bool mse_geo_query_match(const struct mse_geo_query *query,const struct mse_geo_point *point)
+{
+  if(point->lattitude < query->min_lattitude || point->lattitude > query->max_lattitude
+    || point->longitude < query->min_longitude || point->longitude > query->max_longitude)
+    return false;
+  if(!query->radius)
+    return true;
+
+  const double sin_dlat = sin(MSE_GEO_RAD(point->lattitude - query->lattitude)/2);
+  const double sin_dlon = sin(MSE_GEO_RAD(point->longitude - query->longitude)/2);
+  const double haversine = sin_dlat*sin_dlat
+                  + query->cos_lattitude*cos(MSE_GEO_RAD(point->lattitude))*sin_dlon*sin_dlon;
+  return haversine <= query->max_haversine;
+}
+
+/* Scan the cells of query box, that must not cross the antimeridian */
+static void mse_geo_scan(const struct mse_geo_index *geo,struct mse_geo_query *query,
+  double min_longitude,double max_longitude)
+{
+  uint32_t row;
+
+  query->min_longitude = min_longitude;
+  query->max_longitude = max_longitude;
+  if(query->stop || 0 == geo->count
+    || query->max_lattitude < geo->min_lattitude
+    || query->min_lattitude > geo->min_lattitude + geo->rows*geo->cell_lattitude
+    || max_longitude < geo->min_longitude
+    || min_longitude > geo->min_longitude + geo->cols*geo->cell_longitude)
+    return;
+
+  const uint32_t last_row = mse_geo_row(geo,query->max_lattitude);
+  const uint32_t first_col = mse_geo_col(geo,min_longitude);
+  const uint32_t last_col = mse_geo_col(geo,max_longitude);
+  for(row=mse_geo_row(geo,query->min_lattitude);row<=last_row;++row)
+  {
+    /* Cells of a row are contiguous */
+    const size_t first_cell = (size_t)row*geo->cols + first_col;
+    const size_t end_cell = (size_t)row*geo->cols + last_col + 1;
+    size_t i;
+
+    for(i=geo->cells[first_cell];i<geo->cells[end_cell];++i)
+    {
+      if(!mse_geo_query_match(query,&geo->points[i]))
+        continue;
+
+      query->count++;
+      if(0 != query->cb(geo->points[i].position,query->opaque))
+      {
+        query->stop = true;
+        return;
+      }
+    }
+  }
+}
+
+/* Scan a longitude range that can go past +-180 */
+static void mse_geo_scan_wrap(const struct mse_geo_index *geo,struct mse_geo_query *query,
+  double min_longitude,double max_longitude)
+{
+  if(min_longitude < -180)
+  {
+    mse_geo_scan(geo,query,min_longitude + 360,180);
+    mse_geo_scan(geo,query,-180,max_longitude);
+  }
+  else if(max_longitude > 180)
+  {
+    mse_geo_scan(geo,query,min_longitude,180);
+    mse_geo_scan(geo,query,-180,max_longitude - 360);
+  }
+  else
+  {
+    mse_geo_scan(geo,query,min_longitude,max_longitude);
+  }
+}
+
+size_t mse_geo_index_box(const struct mse_geo_index *geo,double min_lattitude,double min_longitude,
+  double max_lattitude,double max_longitude,rb_mse_pos_cb_fn *cb,void *opaque)
+{
+  struct mse_geo_query query = {
+    .min_lattitude = min_lattitude,
+    .max_lattitude = max_lattitude,
+    .cb = cb,
+    .opaque = opaque,
+  };
+
+  if(!(min_lattitude <= max_lattitude))
+    return 0;
+
+  if(min_longitude <= max_longitude)
+  {
+    mse_geo_scan(geo,&query,min_longitude,max_longitude);
+  }
+  else
+  {
+    mse_geo_scan(geo,&query,min_longitude,180);
+    mse_geo_scan(geo,&query,-180,max_longitude);
+  }
+  return query.count;
+}
+
+size_t mse_geo_index_radius(const struct mse_geo_index *geo,double lattitude,double longitude,
+  double radius_m,rb_mse_pos_cb_fn *cb,void *opaque)
+{
+  const double angle = radius_m/MSE_GEO_EARTH_RADIUS_M;
+  const double dlat = radius_m/MSE_GEO_M_PER_DEG;
+  struct mse_geo_query query = {
+    .min_lattitude = lattitude - dlat,
+    .max_lattitude = lattitude + dlat,
+    .radius = true,
+    .lattitude = lattitude,
+    .longitude = longitude,
+    .cos_lattitude = cos(MSE_GEO_RAD(lattitude)),
+    .max_haversine = angle < M_PI ? sin(angle/2)*sin(angle/2) : 1,
+    .cb = cb,
+    .opaque = opaque,
+  };
+
+  if(!(radius_m >= 0) || !(lattitude >= -90 && lattitude <= 90) || !(longitude >= -180 && longitude <= 180))
+    return 0;
+
+  /* Circles around a pole span all the longitudes. Else, the longitudes of
+     their tangent meridians are the bounds */
+  if(query.min_lattitude <= -90 || query.max_lattitude >= 90)
+  {
+    mse_geo_scan(geo,&query,-180,180);
+  }
+  else
+  {
+    const double dlon = asin(sin(angle)/query.cos_lattitude)*(180/M_PI);
+    mse_geo_scan_wrap(geo,&query,longitude - dlon,longitude + dlon);
+  }
+
+  return query.count;
+}
@@ -0,0 +1,101 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Geo coordinates index of the positions of one update.
+ *
+ * A uniform grid over the bounding box of the positions, with cells of about
+ * the same side in metres, sized so a cell holds a few positions. Positions
+ * are sorted by cell, row after row, so the cells of a row that a query
+ * overlaps are contiguous in memory. It is built once, after the update has
+ * all its positions, and it is read-only afterwards.
+ *
+ * Coordinates are degrees, like the MSE GeoCoordinate.
+ */
+
+#include "mse_records.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Positions per cell we aim for
+#define MSE_GEO_CELL_POSITIONS 4
+/// Smallest cell side, in metres. MSE positions are not more accurate.
+#define MSE_GEO_MIN_CELL_M 10.0
+/// Cells per position, at most
+#define MSE_GEO_MAX_CELLS_RATIO 2
+
+struct mse_geo_point
+{
+  double lattitude;
+  double longitude;
+  const struct rb_mse_api_pos *position;
+};
+
+struct mse_geo_index
+{
+  /// South west corner of the grid
+  double min_lattitude;
+  double min_longitude;
+  /// Cell side, in degrees
+  double cell_lattitude;
+  double cell_longitude;
+  uint32_t rows;
+  uint32_t cols;
+  /// First point of every cell, plus the end of the last one
+  uint32_t *cells;
+  /// Points, sorted by cell
+  struct mse_geo_point *points;
+  size_t count;
+};
+
+/* Empty index */
+void mse_geo_index_init(struct mse_geo_index *geo);
+void mse_geo_index_close(struct mse_geo_index *geo);
+
+/**
+  Index the geo localized records. geo must be empty.
+  @param geo     Index
+  @param records Records, that must outlive the index
+  @return 0 on success, -1 on memory error. The index is empty then.
+*/
+int mse_geo_index_build(struct mse_geo_index *geo,const struct mse_records *records);
+
+/**
+  Positions inside a box. If min_longitude > max_longitude, the box crosses
+  the antimeridian.
+  @param cb     Called for every position. Return non-zero to stop.
+  @param opaque cb opaque
+  @return Number of positions cb was called for
+*/
+size_t mse_geo_index_box(const struct mse_geo_index *geo,double min_lattitude,double min_longitude,
+  double max_lattitude,double max_longitude,rb_mse_pos_cb_fn *cb,void *opaque);
+
+/* Great circle distance between two points, in metres */
+double mse_geo_distance_m(double lattitude1,double longitude1,double lattitude2,double longitude2);
+
+/**
+  Positions within radius_m metres (great circle distance) of a point
+  @see mse_geo_index_box
+*/
+size_t mse_geo_index_radius(const struct mse_geo_index *geo,double lattitude,double longitude,
+  double radius_m,rb_mse_pos_cb_fn *cb,void *opaque);
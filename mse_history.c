@@ -0,0 +1,191 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_history.h"
+#include "mse_records.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+int mse_history_init(struct mse_history *history,size_t macs,uint32_t ring)
+{
+  size_t buckets = 1;
+  unsigned int shift = 64;
+
+  memset(history,0,sizeof(*history));
+  /* Buckets 3/4 full at most, so few MACs are evicted before the table is full */
+  while(buckets*MSE_HISTORY_WAYS*3/4 < macs && buckets < SIZE_MAX/MSE_HISTORY_WAYS/2)
+  {
+    buckets *= 2;
+    shift--;
+  }
+
+  if(buckets > SIZE_MAX/MSE_HISTORY_WAYS/sizeof(history->points[0])/ring)
+    return -1;
+
+  history->buckets = calloc(buckets,sizeof(history->buckets[0]));
+  history->points = calloc(buckets*MSE_HISTORY_WAYS*ring,sizeof(history->points[0]));
+  if(NULL == history->buckets || NULL == history->points)
+  {
+    mse_history_close(history);
+    return -1;
+  }
+
+  history->shift = shift;
+  history->ring = ring;
+  return 0;
+}
+
+void mse_history_close(struct mse_history *history)
+{
+  free(history->buckets);
+  free(history->points);
+  memset(history,0,sizeof(*history));
+}
+
+void mse_history_begin_update(struct mse_history *history)
+{
+  history->update++;
+}
+
+static struct mse_history_bucket *mse_history_bucket(const struct mse_history *history,uint64_t mac)
+{
+  /* A shift of 64 is undefined, so the single bucket case goes apart */
+  return &history->buckets[history->shift < 64 ? (mac * UINT64_C(0x9E3779B97F4A7C15)) >> history->shift : 0];
+}
+
+static struct rb_mse_history_point *mse_history_ring(const struct mse_history *history,
+  const struct mse_history_way *way)
+{
+  return &history->points[(way - history->buckets[0].ways)*history->ring];
+}
+
+/* Way of a MAC. If it has none, the free way or the one updated the longest ago */
+static struct mse_history_way *mse_history_way_for(struct mse_history *history,uint64_t key)
+{
+  struct mse_history_bucket *bucket = mse_history_bucket(history,key & ~MSE_HISTORY_KEY_USED);
+  struct mse_history_way *victim = &bucket->ways[0];
+  unsigned int i;
+
+  for(i=0;i<MSE_HISTORY_WAYS;++i)
+  {
+    struct mse_history_way *way = &bucket->ways[i];
+    if(way->key == key)
+      return way;
+    if(victim->key && (0 == way->key || way->last_update < victim->last_update))
+      victim = way;
+  }
+  return victim;
+}
+
+static bool mse_history_point_equal(const struct rb_mse_history_point *point,const struct rb_mse_api_pos *position)
+{
+  return point->location == position->location
+    && (point->flags & RB_MSE_POS_F_GEO_VALID) == (position->flags & RB_MSE_POS_F_GEO_VALID)
+    && point->lattitude == position->lattitude && point->longitude == position->longitude;
+}
+
+void mse_history_add(struct mse_history *history,const struct rb_mse_api_pos *position,uint32_t now)
+{
+  const uint64_t key = rb_mse_pos_mac(position) | MSE_HISTORY_KEY_USED;
+  struct mse_history_way *way = mse_history_way_for(history,key);
+  struct rb_mse_history_point *ring = mse_history_ring(history,way);
+  const bool same_mac = way->key == key;
+
+  if(same_mac && way->count > 0
+    && mse_history_point_equal(&ring[(way->head + history->ring - 1) % history->ring],position))
+  {
+    way->last_update = history->update;
+    return;
+  }
+
+  /* Readers that see an odd sequence, or a different one after they copied
+     the way, copy it again */
+  const uint32_t seq = way->seq;
+  __atomic_store_n(&way->seq,seq + 1,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if(!same_mac)
+  {
+    way->key = key;
+    way->head = way->count = 0;
+  }
+
+  struct rb_mse_history_point *point = &ring[way->head];
+  point->location = position->location;
+  point->lattitude = position->lattitude;
+  point->longitude = position->longitude;
+  point->time = position->last_located ? position->last_located : now;
+  point->flags = position->flags & MSE_POS_F_PUBLIC;
+  way->head = (way->head + 1) % history->ring;
+  if(way->count < history->ring)
+    way->count++;
+  way->last_update = history->update;
+
+  __atomic_store_n(&way->seq,seq + 2,__ATOMIC_RELEASE);
+}
+
+/* Copy the points of a way, if it is the MAC one. Return false if the
+   updater wrote it meanwhile */
+static bool mse_history_read_way(const struct mse_history *history,const struct mse_history_way *way,
+  uint64_t key,struct rb_mse_history_point *points,size_t max,size_t *copied)
+{
+  const uint32_t seq = __atomic_load_n(&way->seq,__ATOMIC_ACQUIRE);
+  size_t i;
+
+  *copied = 0;
+  if(seq & 1)
+    return false;
+
+  if(way->key == key)
+  {
+    const uint32_t head = way->head, count = way->count;
+    const size_t n = count < max ? count : max;
+    const struct rb_mse_history_point *ring = mse_history_ring(history,way);
+    if(head < history->ring && count <= history->ring)
+    {
+      for(i=0;i<n;++i)
+        points[i] = ring[(head + history->ring - n + i) % history->ring];
+      *copied = n;
+    }
+  }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&way->seq,__ATOMIC_RELAXED) == seq;
+}
+
+size_t mse_history_get(const struct mse_history *history,uint64_t mac,struct rb_mse_history_point *points,
+  size_t max)
+{
+  const uint64_t key = mac | MSE_HISTORY_KEY_USED;
+  const struct mse_history_bucket *bucket = mse_history_bucket(history,mac);
+  unsigned int i;
+
+  for(i=0;i<MSE_HISTORY_WAYS;++i)
+  {
+    size_t copied;
+    while(!mse_history_read_way(history,&bucket->ways[i],key,points,max,&copied))
+      ; /* Updater is writing this way */
+    if(copied > 0)
+      return copied;
+  }
+  return 0;
+}
@@ -0,0 +1,107 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Last positions of every MAC.
+ *
+ * A fixed size, set associative table: a MAC can only be in one bucket of
+ * MSE_HISTORY_WAYS ways, and every way holds the ring of the last positions
+ * of a MAC. When a bucket is full, the MAC updated the longest ago loses its
+ * way, so memory never grows. Everything is allocated up front.
+ *
+ * Only the updater thread writes. Every way is protected by a sequence lock,
+ * so readers never block it: they copy the ring, and copy it again if the
+ * updater wrote the way meanwhile.
+ */
+
+#include "rb_mse_api.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MSE_HISTORY_WAYS 8
+/// Marks a way as used, so MAC 00:00:00:00:00:00 can be stored too
+#define MSE_HISTORY_KEY_USED (UINT64_C(1)<<63)
+
+struct mse_history_way
+{
+  /// MAC | MSE_HISTORY_KEY_USED, 0 if the way is free
+  volatile uint64_t key;
+  /// Odd while the updater writes the way
+  volatile uint32_t seq;
+  /// Next point to write, and points written, up to the ring size
+  uint32_t head;
+  uint32_t count;
+  /// Update that wrote the way last, to choose the way to evict
+  uint32_t last_update;
+};
+
+struct mse_history_bucket
+{
+  struct mse_history_way ways[MSE_HISTORY_WAYS];
+};
+
+struct mse_history
+{
+  struct mse_history_bucket *buckets;
+  /// 64 - log2(number of buckets)
+  unsigned int shift;
+  /// Points of every ring
+  uint32_t ring;
+  /// Rings, one per way
+  struct rb_mse_history_point *points;
+  /// Updates seen
+  uint32_t update;
+};
+
+/**
+  Allocate a history
+  @param history History to initialize
+  @param macs    MACs it must be able to hold
+  @param ring    Positions of every MAC
+  @return 0 on success, -1 on memory error
+*/
+int mse_history_init(struct mse_history *history,size_t macs,uint32_t ring);
+void mse_history_close(struct mse_history *history);
+
+/* Start a new update. Updater thread only */
+void mse_history_begin_update(struct mse_history *history);
+
+/**
+  Add a position to the history of its MAC, if it is not where the last one
+  was. Updater thread only.
+  @param history  History
+  @param position Position received in the update
+  @param now      Time of the update, for positions without lastLocatedTime
+*/
+void mse_history_add(struct mse_history *history,const struct rb_mse_api_pos *position,uint32_t now);
+
+/**
+  Copy the last positions of a MAC, the oldest first. Any thread.
+  @param history History
+  @param mac     MAC
+  @param points  Where to copy them
+  @param max     Size of points
+  @return Number of positions copied
+*/
+size_t mse_history_get(const struct mse_history *history,uint64_t mac,struct rb_mse_history_point *points,
+  size_t max);
@@ -0,0 +1,172 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_index.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MSE_INDEX_MIN_BUCKETS 16
+/* Grow when the table is more than 3/4 full */
+#define mse_index_full(buckets,count) ((count)*4 >= (buckets)*MSE_INDEX_BUCKET_SLOTS*3)
+
+static int mse_index_alloc(struct mse_index *index,size_t buckets)
+{
+  unsigned int bits = 0;
+  void *mem = NULL;
+
+  while((((size_t)1) << bits) < buckets)
+    bits++;
+  buckets = ((size_t)1) << bits;
+
+  if(0 != posix_memalign(&mem,sizeof(struct mse_index_bucket),buckets*sizeof(struct mse_index_bucket)))
+    return -1;
+
+  memset(mem,0,buckets*sizeof(struct mse_index_bucket));
+  index->buckets = mem;
+  index->mask = buckets - 1;
+  index->shift = 64 - bits;
+  index->count = 0;
+  return 0;
+}
+
+int mse_index_init(struct mse_index *index,size_t expected)
+{
+  size_t buckets = MSE_INDEX_MIN_BUCKETS;
+  while(mse_index_full(buckets,expected))
+    buckets *= 2;
+
+  return mse_index_alloc(index,buckets);
+}
+
+void mse_index_close(struct mse_index *index)
+{
+  free(index->buckets);
+  memset(index,0,sizeof(*index));
+}
+
+/* Slot of key, or the first free slot of its probe sequence */
+static void mse_index_slot(const struct mse_index *index,uint64_t k,struct mse_index_bucket **bucket,int *slot)
+{
+  size_t b = mse_index_bucket_of(index,k & ~MSE_INDEX_KEY_USED);
+  for(;;)
+  {
+    struct mse_index_bucket *candidate = &index->buckets[b];
+    unsigned int match = mse_index_bucket_match(candidate,k);
+    if(0 == match)
+      match = mse_index_bucket_match(candidate,0);
+    if(match)
+    {
+      *bucket = candidate;
+      *slot = __builtin_ctz(match);
+      return;
+    }
+    b = (b + 1) & index->mask;
+  }
+}
+
+static int mse_index_grow(struct mse_index *index)
+{
+  struct mse_index old_index = *index;
+  size_t b;
+  int i;
+
+  if(0 != mse_index_alloc(index,(old_index.mask + 1)*2))
+  {
+    *index = old_index;
+    return -1;
+  }
+
+  for(b=0;b<=old_index.mask;++b)
+  {
+    const struct mse_index_bucket *old_bucket = &old_index.buckets[b];
+    for(i=0;i<MSE_INDEX_BUCKET_SLOTS;++i)
+    {
+      struct mse_index_bucket *bucket;
+      int slot;
+
+      if(0 == old_bucket->keys[i])
+        continue;
+      mse_index_slot(index,old_bucket->keys[i],&bucket,&slot);
+      bucket->keys[slot] = old_bucket->keys[i];
+      bucket->values[slot] = old_bucket->values[i];
+      index->count++;
+    }
+  }
+
+  free(old_index.buckets);
+  return 0;
+}
+
+void **mse_index_upsert(struct mse_index *index,uint64_t key,bool *found)
+{
+  const uint64_t k = key | MSE_INDEX_KEY_USED;
+  struct mse_index_bucket *bucket;
+  int slot;
+
+  assert(0 == (key & MSE_INDEX_KEY_USED));
+  if(NULL == index->buckets)
+    return NULL;
+
+  mse_index_slot(index,k,&bucket,&slot);
+  *found = bucket->keys[slot] == k;
+  if(*found)
+    return &bucket->values[slot];
+
+  if(mse_index_full(index->mask + 1,index->count + 1))
+  {
+    if(0 != mse_index_grow(index))
+      return NULL;
+    mse_index_slot(index,k,&bucket,&slot);
+  }
+
+  bucket->keys[slot] = k;
+  bucket->values[slot] = NULL;
+  index->count++;
+  return &bucket->values[slot];
+}
+
+int mse_index_copy(struct mse_index *dst,const struct mse_index *src)
+{
+  if(0 != mse_index_alloc(dst,src->mask + 1))
+    return -1;
+
+  memcpy(dst->buckets,src->buckets,(src->mask + 1)*sizeof(src->buckets[0]));
+  dst->count = src->count;
+  return 0;
+}
+
+void mse_index_map_values(struct mse_index *index,void *(*map)(void *value,void *opaque),void *opaque)
+{
+  size_t b;
+  int i;
+
+  if(NULL == index->buckets)
+    return;
+
+  for(b=0;b<=index->mask;++b)
+  {
+    struct mse_index_bucket *bucket = &index->buckets[b];
+    for(i=0;i<MSE_INDEX_BUCKET_SLOTS;++i)
+      if(bucket->keys[i])
+        bucket->values[i] = map(bucket->values[i],opaque);
+  }
+}
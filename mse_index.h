@@ -0,0 +1,135 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * MAC -> pointer open addressing hash table.
+ *
+ * Every bucket is exactly one cache line: 4 keys followed by their 4 values,
+ * and buckets are probed linearly. The table is filled by one thread while an
+ * update is being built and it is read-only after it is published, so a
+ * lookup needs no locks and, with the table at most 75% full, usually touches
+ * only one cache line.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define MSE_INDEX_BUCKET_SLOTS 4
+/// Marks a slot as used, so MAC 00:00:00:00:00:00 can be stored too
+#define MSE_INDEX_KEY_USED (UINT64_C(1)<<63)
+
+struct mse_index_bucket
+{
+  uint64_t keys[MSE_INDEX_BUCKET_SLOTS];
+  void *values[MSE_INDEX_BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
+struct mse_index
+{
+  struct mse_index_bucket *buckets;
+  /// Number of buckets - 1
+  size_t mask;
+  /// 64 - log2(number of buckets)
+  unsigned int shift;
+  /// Number of keys stored
+  size_t count;
+};
+
+/* Allocate a table able to hold expected keys without growing. Return 0 on success */
+int mse_index_init(struct mse_index *index,size_t expected);
+void mse_index_close(struct mse_index *index);
+
+/**
+  Look for key, inserting it with a NULL value if it was not in the table.
+  @param index  Table
+  @param key    Key to look for. Must be lower than MSE_INDEX_KEY_USED.
+  @param found  Will be true if the key was already in the table
+  @return Pointer to the value slot, valid until the next insertion, or NULL
+          if the table needed to grow and there was no memory for it
+*/
+void **mse_index_upsert(struct mse_index *index,uint64_t key,bool *found);
+
+/* Make dst a copy of src. Return 0 on success */
+int mse_index_copy(struct mse_index *dst,const struct mse_index *src);
+
+/* Replace every value v of the table with map(v,opaque) */
+void mse_index_map_values(struct mse_index *index,void *(*map)(void *value,void *opaque),void *opaque);
+
+static inline size_t mse_index_bucket_of(const struct mse_index *index,uint64_t key)
+{
+  return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> index->shift);
+}
+
+/* Bitmask of the bucket slots whose key is equal to k */
+static inline unsigned int mse_index_bucket_match(const struct mse_index_bucket *bucket,uint64_t k)
+{
+#if defined(__AVX2__)
+  const __m256i keys = _mm256_load_si256((const __m256i *)bucket->keys);
+  const __m256i eq = _mm256_cmpeq_epi64(keys,_mm256_set1_epi64x((long long)k));
+  return _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+#elif defined(__SSE2__)
+  /* No 64 bits compare in SSE2: compare 32 bits halves and AND them */
+  const __m128i needle = _mm_set1_epi64x((long long)k);
+  const __m128i eq32_lo = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)&bucket->keys[0]),needle);
+  const __m128i eq32_hi = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)&bucket->keys[2]),needle);
+  const __m128i eq_lo = _mm_and_si128(eq32_lo,_mm_shuffle_epi32(eq32_lo,_MM_SHUFFLE(2,3,0,1)));
+  const __m128i eq_hi = _mm_and_si128(eq32_hi,_mm_shuffle_epi32(eq32_hi,_MM_SHUFFLE(2,3,0,1)));
+  return _mm_movemask_pd(_mm_castsi128_pd(eq_lo)) | (_mm_movemask_pd(_mm_castsi128_pd(eq_hi)) << 2);
+#else
+  unsigned int i,mask = 0;
+  for(i=0;i<MSE_INDEX_BUCKET_SLOTS;++i)
+    mask |= (bucket->keys[i] == k) << i;
+  return mask;
+#endif
+}
+
+/* Bring the first bucket of key to the cache, so a later find does not stall */
+static inline void mse_index_prefetch(const struct mse_index *index,uint64_t key)
+{
+  if(index->buckets)
+    __builtin_prefetch(&index->buckets[mse_index_bucket_of(index,key)],0,1);
+}
+
+/* Value of key, or NULL if it is not in the table */
+static inline void *mse_index_find(const struct mse_index *index,uint64_t key)
+{
+  if(index->buckets == NULL)
+    return NULL;
+
+  const uint64_t k = key | MSE_INDEX_KEY_USED;
+  size_t b = mse_index_bucket_of(index,key);
+  for(;;)
+  {
+    const struct mse_index_bucket *bucket = &index->buckets[b];
+    const unsigned int match = mse_index_bucket_match(bucket,k);
+    if(match)
+      return bucket->values[__builtin_ctz(match)];
+    if(mse_index_bucket_match(bucket,0))
+      return NULL; /* Free slot: the key would have been stored here */
+    b = (b + 1) & index->mask;
+  }
+}
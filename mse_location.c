@@ -0,0 +1,234 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_location.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MSE_LOCATION_HIERARCHY_SEP ">"
+
+const struct rb_mse_api_location mse_location_none;
+
+/*
+ * All the tables are keyed by a string hash. Entries with the same hash are
+ * chained, so equal hashes of different strings are handled.
+ */
+
+struct mse_location_level_node
+{
+  struct mse_location_level level;
+  struct mse_location_level_node *next;
+};
+
+struct mse_location_node
+{
+  struct rb_mse_api_location location;
+  const char *hierarchy;
+  struct mse_location_node *next;
+};
+
+struct mse_location_string_node
+{
+  const char *str;
+  struct mse_location_string_node *next;
+};
+
+/* FNV-1a of the first len bytes of str, in 63 bits as mse_index wants */
+static uint64_t mse_location_hash(const char *str,size_t len)
+{
+  uint64_t hash = UINT64_C(0xcbf29ce484222325);
+  size_t i;
+  for(i=0;i<len;++i)
+  {
+    hash ^= (unsigned char)str[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+  return hash & ~MSE_INDEX_KEY_USED;
+}
+
+static char *mse_location_strndup(rd_memctx_t *memctx,const char *str,size_t len)
+{
+  char *ret = rd_memctx_malloc(memctx,len+1);
+  if(ret)
+  {
+    memcpy(ret,str,len);
+    ret[len] = '\0';
+  }
+  return ret;
+}
+
+/* Level of path, creating it if it did not exist */
+static const struct mse_location_level *mse_location_level_get(struct mse_location_dict *dict,
+  const char *path,size_t path_len,size_t name_offset,int level)
+{
+  bool found;
+  void **slot = mse_index_upsert(&dict->levels,mse_location_hash(path,path_len),&found);
+  if(NULL == slot)
+    return NULL;
+
+  struct mse_location_level_node *node;
+  for(node=*slot;node;node=node->next)
+    if(0 == strncmp(node->level.path,path,path_len) && '\0' == node->level.path[path_len])
+      return &node->level;
+
+  node = rd_memctx_calloc(dict->memctx,1,sizeof(*node));
+  char *path_copy = mse_location_strndup(dict->memctx,path,path_len);
+  if(NULL == node || NULL == path_copy)
+    return NULL;
+
+  node->level.path = path_copy;
+  node->level.name = path_copy + name_offset;
+  node->level.id = dict->next_id[level]++;
+  node->level.level = level;
+  node->next = *slot;
+  *slot = node;
+  return &node->level;
+}
+
+int mse_location_dict_init(struct mse_location_dict *dict,rd_memctx_t *memctx)
+{
+  size_t i;
+
+  memset(dict,0,sizeof(*dict));
+  dict->memctx = memctx;
+  for(i=0;i<MSE_LOCATION_LEVELS;++i)
+    dict->next_id[i] = 1;
+
+  if(0 != mse_index_init(&dict->levels,0)
+    || 0 != mse_index_init(&dict->locations,0)
+    || 0 != mse_index_init(&dict->strings,0)
+    || 0 != strbuffer_init(&dict->path))
+  {
+    mse_location_dict_close(dict);
+    return -1;
+  }
+
+  return 0;
+}
+
+void mse_location_dict_close(struct mse_location_dict *dict)
+{
+  mse_index_close(&dict->levels);
+  mse_index_close(&dict->locations);
+  mse_index_close(&dict->strings);
+  strbuffer_close(&dict->path);
+}
+
+/* Resolve hierarchy levels. Empty levels are skipped, and levels under the
+   floor are ignored */
+static int mse_location_resolve(struct mse_location_dict *dict,struct rb_mse_api_location *location,
+  const char *hierarchy)
+{
+  const char *cursor = hierarchy;
+  int level;
+
+  strbuffer_clear(&dict->path);
+  for(level=0;level<MSE_LOCATION_LEVELS;++level)
+  {
+    while(*cursor == MSE_LOCATION_HIERARCHY_SEP[0])
+      cursor++;
+    if(*cursor == '\0')
+      break;
+
+    const char *end = cursor + strcspn(cursor,MSE_LOCATION_HIERARCHY_SEP);
+    if(level > 0 && 0 != strbuffer_append_byte(&dict->path,MSE_LOCATION_HIERARCHY_SEP[0]))
+      return -1;
+    const size_t name_offset = dict->path.length;
+    if(0 != strbuffer_append_bytes(&dict->path,cursor,end-cursor))
+      return -1;
+    cursor = end;
+
+    const struct mse_location_level *l = mse_location_level_get(dict,
+      strbuffer_value(&dict->path),dict->path.length,name_offset,level);
+    if(NULL == l)
+      return -1;
+
+    switch(level)
+    {
+    case MSE_LOCATION_ZONE:
+      location->zone = l->name;
+      location->zone_id = l->id;
+      break;
+    case MSE_LOCATION_BUILD:
+      location->build = l->name;
+      location->build_id = l->id;
+      break;
+    case MSE_LOCATION_FLOOR:
+      location->floor = l->name;
+      location->floor_id = l->id;
+      break;
+    };
+  }
+
+  return 0;
+}
+
+const struct rb_mse_api_location *mse_location_dict_get(struct mse_location_dict *dict,
+  const char *hierarchy)
+{
+  bool found;
+  const size_t len = strlen(hierarchy);
+  void **slot = mse_index_upsert(&dict->locations,mse_location_hash(hierarchy,len),&found);
+  if(NULL == slot)
+    return NULL;
+
+  struct mse_location_node *node;
+  for(node=*slot;node;node=node->next)
+    if(0 == strcmp(node->hierarchy,hierarchy))
+      return &node->location;
+
+  node = rd_memctx_calloc(dict->memctx,1,sizeof(*node));
+  if(NULL == node)
+    return NULL;
+  node->hierarchy = mse_location_strndup(dict->memctx,hierarchy,len);
+  if(NULL == node->hierarchy || 0 != mse_location_resolve(dict,&node->location,hierarchy))
+    return NULL;
+
+  /* Resolving may have inserted in other tables, but not in this one */
+  node->next = *slot;
+  *slot = node;
+  return &node->location;
+}
+
+const char *mse_location_dict_intern(struct mse_location_dict *dict,const char *str)
+{
+  bool found;
+  const size_t len = strlen(str);
+  void **slot = mse_index_upsert(&dict->strings,mse_location_hash(str,len),&found);
+  if(NULL == slot)
+    return NULL;
+
+  struct mse_location_string_node *node;
+  for(node=*slot;node;node=node->next)
+    if(0 == strcmp(node->str,str))
+      return node->str;
+
+  node = rd_memctx_calloc(dict->memctx,1,sizeof(*node));
+  if(NULL == node)
+    return NULL;
+  node->str = mse_location_strndup(dict->memctx,str,len);
+  if(NULL == node->str)
+    return NULL;
+
+  node->next = *slot;
+  *slot = node;
+  return node->str;
+}
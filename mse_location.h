@@ -0,0 +1,95 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Dictionary of the locations seen by an rb_mse_api.
+ *
+ * Every distinct zone, building and floor is stored once, with a small ID
+ * that is unique in its level. Levels are identified by their full path, so
+ * "Floor 1" of two buildings are two different floors. IDs start at 1, so 0
+ * means "no such level".
+ *
+ * Entries are never removed, so locations and their IDs stay the same for the
+ * life of the dictionary and positions of different updates can share them.
+ * Only the updater thread adds entries, and added entries are never modified.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "librd/rdmem.h"
+
+#include "rb_mse_api.h"
+#include "mse_index.h"
+#include "strbuffer.h"
+
+#define MSE_LOCATION_ZONE  0
+#define MSE_LOCATION_BUILD 1
+#define MSE_LOCATION_FLOOR 2
+#define MSE_LOCATION_LEVELS 3
+
+/// Location of the positions without MapInfo
+extern const struct rb_mse_api_location mse_location_none;
+
+struct mse_location_level
+{
+  /// Levels from the zone to this one, joined by '>'
+  const char *path;
+  /// Last level of path
+  const char *name;
+  uint32_t id;
+  int level;
+};
+
+struct mse_location_dict
+{
+  rd_memctx_t *memctx;
+
+  /// Level path hash -> struct mse_location_level
+  struct mse_index levels;
+  /// mapHierarchyString hash -> struct rb_mse_api_location
+  struct mse_index locations;
+  /// String hash -> interned string
+  struct mse_index strings;
+
+  uint32_t next_id[MSE_LOCATION_LEVELS];
+
+  strbuffer_t path;
+};
+
+/**
+  Create a dictionary
+  @param dict     Dictionary to initialize
+  @param memctx   Memory context of the strings and locations
+  @return 0 on success, -1 on memory error
+*/
+int mse_location_dict_init(struct mse_location_dict *dict,rd_memctx_t *memctx);
+
+/* Free the dictionary tables. Strings and locations live in its memctx */
+void mse_location_dict_close(struct mse_location_dict *dict);
+
+/* Location of a mapHierarchyString. NULL on memory error */
+const struct rb_mse_api_location *mse_location_dict_get(struct mse_location_dict *dict,
+  const char *hierarchy);
+
+/* Shared copy of str. NULL on memory error */
+const char *mse_location_dict_intern(struct mse_location_dict *dict,const char *str);
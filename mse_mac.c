@@ -0,0 +1,163 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_mac.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MSE_MAC_STR_LEN      17 /* aa:bb:cc:dd:ee:ff */
+#define MSE_MAC_CISCO_LEN    14 /* aabb.ccdd.eeff */
+#define MSE_MAC_BARE_LEN     12 /* aabbccddeeff */
+
+/// Set in hex_values[] for the hex digits
+#define HEX_VALID 0x10
+
+/* Nibble value of every hex digit with HEX_VALID set, 0 for the rest of
+   chars. And-ing all the looked up values tells if any char was invalid */
+static const uint8_t hex_values[256] = {
+  ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+  ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+  ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+  ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+};
+
+#define hex_value(c) hex_values[(unsigned char)(c)]
+
+/* Parse the 12 nibbles found at str[pos[0]], str[pos[1]]... */
+static int parse_nibbles(const char *str,const uint8_t *pos,uint64_t *mac)
+{
+  uint64_t ret = 0;
+  unsigned int valid = HEX_VALID,i;
+
+  for(i=0;i<12;++i)
+  {
+    const uint8_t v = hex_value(str[pos[i]]);
+    valid &= v;
+    ret = (ret << 4) | (v & 0x0f);
+  }
+
+  if(!valid)
+    return -1;
+
+  *mac = ret;
+  return 0;
+}
+
+int mse_mac_parse(const char *str,uint64_t *mac)
+{
+  static const uint8_t separated_pos[] = {0,1,3,4,6,7,9,10,12,13,15,16};
+  static const uint8_t cisco_pos[] = {0,1,2,3,5,6,7,8,10,11,12,13};
+  static const uint8_t bare_pos[] = {0,1,2,3,4,5,6,7,8,9,10,11};
+
+  const size_t len = strnlen(str,MSE_MAC_STR_LEN+1);
+  switch(len)
+  {
+  case MSE_MAC_STR_LEN:
+  {
+    const char sep = str[2];
+    if((sep != ':' && sep != '-') || str[5] != sep || str[8] != sep
+                                  || str[11] != sep || str[14] != sep)
+      return -1;
+    return parse_nibbles(str,separated_pos,mac);
+  }
+  case MSE_MAC_CISCO_LEN:
+    if(str[4] != '.' || str[9] != '.')
+      return -1;
+    return parse_nibbles(str,cisco_pos,mac);
+  case MSE_MAC_BARE_LEN:
+    return parse_nibbles(str,bare_pos,mac);
+  default:
+    return -1;
+  };
+}
+
+#if defined(__SSE2__)
+
+/* Separated notation, validating and converting the first 16 chars at once.
+   str must be MSE_MAC_STR_LEN long */
+static int mse_mac_parse_sse2(const char *str,uint64_t *mac)
+{
+  /* Bits of the hex digits and separators among the first 16 chars */
+  static const unsigned int hex_mask = 0xb6db;
+  static const unsigned int sep_mask = 0x4924;
+
+  const char sep = str[2];
+  if(sep != ':' && sep != '-')
+    return -1;
+
+  const __m128i chars = _mm_loadu_si128((const __m128i *)str);
+
+  /* Digits: c - '0' in [0,9]. Letters: (c|0x20) - 'a' in [0,5] */
+  const __m128i digits = _mm_sub_epi8(chars,_mm_set1_epi8('0'));
+  const __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digits,_mm_set1_epi8(-1)),
+                                         _mm_cmplt_epi8(digits,_mm_set1_epi8(10)));
+  const __m128i letters = _mm_sub_epi8(_mm_or_si128(chars,_mm_set1_epi8(0x20)),_mm_set1_epi8('a'));
+  const __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(letters,_mm_set1_epi8(-1)),
+                                          _mm_cmplt_epi8(letters,_mm_set1_epi8(6)));
+  const __m128i is_sep = _mm_cmpeq_epi8(chars,_mm_set1_epi8(sep));
+
+  const unsigned int hex = _mm_movemask_epi8(_mm_or_si128(is_digit,is_letter));
+  const unsigned int seps = _mm_movemask_epi8(is_sep);
+  const uint8_t last = hex_value(str[16]);
+  if((hex & hex_mask) != hex_mask || (seps & sep_mask) != sep_mask || !(last & HEX_VALID))
+    return -1;
+
+  /* Nibble values, and every nibble merged with the following one. Nibbles
+     are < 16, so shifting 16 bits lanes does not cross bytes */
+  const __m128i nibbles = _mm_or_si128(
+    _mm_and_si128(is_digit,digits),
+    _mm_and_si128(is_letter,_mm_add_epi8(letters,_mm_set1_epi8(10))));
+  const __m128i bytes = _mm_or_si128(_mm_slli_epi16(nibbles,4),_mm_srli_si128(nibbles,1));
+
+  uint8_t b[16];
+  _mm_storeu_si128((__m128i *)b,bytes);
+  *mac = ((uint64_t)b[0] << 40) | ((uint64_t)b[3] << 32) | ((uint64_t)b[6] << 24)
+       | ((uint64_t)b[9] << 16) | ((uint64_t)b[12] << 8) | (uint64_t)(b[15] | (last & 0x0f));
+  return 0;
+}
+
+#endif
+
+size_t mse_mac_parse_batch(const char * const *strs,size_t n,uint64_t *macs)
+{
+  size_t i,valid=0;
+
+  for(i=0;i<n;++i)
+  {
+    int rc;
+#if defined(__SSE2__)
+    if(strnlen(strs[i],MSE_MAC_STR_LEN+1) == MSE_MAC_STR_LEN)
+      rc = mse_mac_parse_sse2(strs[i],&macs[i]);
+    else
+#endif
+      rc = mse_mac_parse(strs[i],&macs[i]);
+
+    if(rc == 0)
+      valid++;
+    else
+      macs[i] = MSE_MAC_INVALID;
+  }
+
+  return valid;
+}
@@ -0,0 +1,41 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * MAC address parsing.
+ *
+ * Accepted notations, with hex digits in any case:
+ *   aa:bb:cc:dd:ee:ff   aa-bb-cc-dd-ee-ff   aabb.ccdd.eeff   aabbccddeeff
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Returned by the batch parser for malformed MACs. It is not a 48 bits MAC.
+#define MSE_MAC_INVALID UINT64_MAX
+
+/* Parse str into *mac. Return 0 on success, -1 if str is not a MAC */
+int mse_mac_parse(const char *str,uint64_t *mac);
+
+/* Parse n MACs. Malformed ones are stored as MSE_MAC_INVALID.
+   Return the number of valid MACs */
+size_t mse_mac_parse_batch(const char * const *strs,size_t n,uint64_t *macs);
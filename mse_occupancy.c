@@ -0,0 +1,178 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_occupancy.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+void mse_occupancy_init(struct mse_occupancy *occupancy)
+{
+  memset(occupancy,0,sizeof(*occupancy));
+}
+
+void mse_occupancy_close(struct mse_occupancy *occupancy)
+{
+  int level;
+  for(level=0;level<RB_MSE_LEVELS;++level)
+  {
+    struct mse_level_index *index = &occupancy->levels[level];
+    free(index->occupancy);
+    free(index->locations);
+    free(index->members);
+    free(index->positions);
+  }
+  mse_occupancy_init(occupancy);
+}
+
+static uint32_t mse_level_id(const struct rb_mse_api_location *location,int level)
+{
+  switch(level)
+  {
+  case RB_MSE_LEVEL_ZONE:
+    return location->zone_id;
+  case RB_MSE_LEVEL_BUILD:
+    return location->build_id;
+  default:
+    return location->floor_id;
+  };
+}
+
+static void mse_occupancy_count(struct rb_mse_occupancy *occupancy,const struct rb_mse_api_pos *position)
+{
+  occupancy->positions++;
+  if(position->flags & RB_MSE_POS_F_CURRENTLY_TRACKED)
+    occupancy->currently_tracked++;
+  if(position->flags & RB_MSE_POS_F_NOT_CURRENTLY_TRACKED)
+    occupancy->not_currently_tracked++;
+  if(position->flags & RB_MSE_POS_F_GEO_VALID)
+    occupancy->geo_valid++;
+}
+
+int mse_occupancy_build(struct mse_occupancy *occupancy,const struct mse_records *records)
+{
+  const struct mse_records_chunk *chunk;
+  size_t i,count = 0;
+  int level;
+
+  mse_records_foreach(records,chunk,i)
+  {
+    const struct rb_mse_api_pos *position = mse_records_at(chunk,i);
+    if(position->flags & MSE_POS_F_REMOVED)
+      continue;
+
+    count++;
+    for(level=0;level<RB_MSE_LEVELS;++level)
+    {
+      const uint32_t id = mse_level_id(position->location,level);
+      if(id >= occupancy->levels[level].ids)
+        occupancy->levels[level].ids = id + 1;
+    }
+  }
+
+  if(0 == count)
+  {
+    mse_occupancy_init(occupancy);
+    return 0;
+  }
+  if(count >= UINT32_MAX)
+  {
+    mse_occupancy_init(occupancy);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for(level=0;level<RB_MSE_LEVELS;++level)
+  {
+    struct mse_level_index *index = &occupancy->levels[level];
+    index->occupancy = calloc(index->ids,sizeof(index->occupancy[0]));
+    index->locations = calloc(index->ids,sizeof(index->locations[0]));
+    index->members = calloc(index->ids + 1,sizeof(index->members[0]));
+    index->positions = malloc(count*sizeof(index->positions[0]));
+    if(NULL == index->occupancy || NULL == index->locations || NULL == index->members
+      || NULL == index->positions)
+    {
+      mse_occupancy_close(occupancy);
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  /* Counting sort, like the geo index */
+  mse_records_foreach(records,chunk,i)
+  {
+    const struct rb_mse_api_pos *position = mse_records_at(chunk,i);
+    if(position->flags & MSE_POS_F_REMOVED)
+      continue;
+
+    for(level=0;level<RB_MSE_LEVELS;++level)
+    {
+      struct mse_level_index *index = &occupancy->levels[level];
+      const uint32_t id = mse_level_id(position->location,level);
+      mse_occupancy_count(&index->occupancy[id],position);
+      index->members[id]++;
+      if(NULL == index->locations[id])
+        index->locations[id] = position->location;
+    }
+  }
+
+  for(level=0;level<RB_MSE_LEVELS;++level)
+  {
+    struct mse_level_index *index = &occupancy->levels[level];
+    for(i=1;i<=index->ids;++i)
+      index->members[i] += index->members[i-1];
+  }
+
+  mse_records_foreach(records,chunk,i)
+  {
+    const struct rb_mse_api_pos *position = mse_records_at(chunk,i);
+    if(position->flags & MSE_POS_F_REMOVED)
+      continue;
+
+    for(level=0;level<RB_MSE_LEVELS;++level)
+    {
+      struct mse_level_index *index = &occupancy->levels[level];
+      index->positions[--index->members[mse_level_id(position->location,level)]] = position;
+    }
+  }
+
+  return 0;
+}
+
+const char *mse_occupancy_name(const struct mse_occupancy *occupancy,enum rb_mse_level level,uint32_t id)
+{
+  if((unsigned int)level >= RB_MSE_LEVELS || id >= occupancy->levels[level].ids)
+    return NULL;
+
+  const struct rb_mse_api_location *location = occupancy->levels[level].locations[id];
+  if(NULL == location)
+    return NULL;
+
+  switch(level)
+  {
+  case RB_MSE_LEVEL_ZONE:
+    return location->zone;
+  case RB_MSE_LEVEL_BUILD:
+    return location->build;
+  default:
+    return location->floor;
+  };
+}
@@ -0,0 +1,68 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Zone, building and floor index of the positions of one update.
+ *
+ * For every level, arrays indexed by the level ID hold the occupancy counts
+ * and the positions of every zone, building or floor, so both are array
+ * reads. ID 0 holds the positions without that level. It is built once, after
+ * the update has all its positions, and it is read-only afterwards.
+ */
+
+#include "mse_records.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mse_level_index
+{
+  /// Highest ID + 1
+  uint32_t ids;
+  struct rb_mse_occupancy *occupancy;
+  /// A location of every ID, to get its name. NULL if the ID has no positions
+  const struct rb_mse_api_location **locations;
+  /// First position of every ID, plus the end of the last one
+  uint32_t *members;
+  /// Positions, sorted by ID
+  const struct rb_mse_api_pos **positions;
+};
+
+struct mse_occupancy
+{
+  struct mse_level_index levels[RB_MSE_LEVELS];
+};
+
+/* Empty index */
+void mse_occupancy_init(struct mse_occupancy *occupancy);
+void mse_occupancy_close(struct mse_occupancy *occupancy);
+
+/**
+  Index the records by zone, building and floor. occupancy must be empty.
+  @param occupancy Index
+  @param records   Records, that must outlive the index
+  @return 0 on success, -1 on memory error. The index is empty then.
+*/
+int mse_occupancy_build(struct mse_occupancy *occupancy,const struct mse_records *records);
+
+/* Name of a level ID. NULL if it has no positions */
+const char *mse_occupancy_name(const struct mse_occupancy *occupancy,enum rb_mse_level level,uint32_t id);
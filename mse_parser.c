@@ -0,0 +1,916 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_parser.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* What the lexer is waiting for */
+enum {
+  EXPECT_VALUE,
+  EXPECT_VALUE_OR_END,  /* just after '[' */
+  EXPECT_KEY_OR_END,    /* just after '{' */
+  EXPECT_KEY,           /* after ',' inside an object */
+  EXPECT_COLON,
+  EXPECT_COMMA_OR_END,
+  EXPECT_NOTHING,       /* root value closed */
+};
+
+enum {
+  TOKEN_NONE,
+  TOKEN_STRING,
+  TOKEN_NUMBER,
+  TOKEN_LITERAL,
+};
+
+/* Meaning of a container, given by its parent and its key */
+enum {
+  CTX_SKIP,
+  CTX_ROOT,
+  CTX_LOCATIONS,
+  CTX_ENTRIES,
+  CTX_ENTRY,
+  CTX_MAP_INFO,
+  CTX_GEO,
+  CTX_STATISTICS,
+  CTX_MAP_COORDINATE,
+  CTX_IP_ADDRESS,
+};
+
+enum {
+  KEY_NONE,
+  KEY_LOCATIONS,
+  KEY_TOTAL_PAGES,
+  KEY_CURRENT_PAGE,
+  KEY_PAGE_SIZE,
+  KEY_NEXT_RESOURCE_URI,
+  KEY_ENTRIES,
+  KEY_MAC_ADDRESS,
+  KEY_CURRENTLY_TRACKED,
+  KEY_MAP_INFO,
+  KEY_GEO_COORDINATE,
+  KEY_MAP_HIERARCHY_STRING,
+  KEY_LATTITUDE,
+  KEY_LONGITUDE,
+  KEY_UNIT,
+  KEY_STATISTICS,
+  KEY_LAST_LOCATED_TIME,
+  KEY_MAP_COORDINATE,
+  KEY_X,
+  KEY_Y,
+  KEY_CONFIDENCE_FACTOR,
+  KEY_BAND,
+  KEY_DOT11_STATUS,
+  KEY_IP_ADDRESS,
+};
+
+struct key_name {
+  int ctx;
+  int key;
+  const char *name;
+  /// RB_MSE_FIELD_* the key belongs to, or 0 if it is always read
+  unsigned int field;
+};
+
+static const struct key_name key_names[] = {
+  {CTX_ROOT,           KEY_LOCATIONS,            "Locations",          0},
+  {CTX_LOCATIONS,      KEY_TOTAL_PAGES,          "totalPages",         0},
+  {CTX_LOCATIONS,      KEY_CURRENT_PAGE,         "currentPage",        0},
+  {CTX_LOCATIONS,      KEY_PAGE_SIZE,            "pageSize",           0},
+  {CTX_LOCATIONS,      KEY_NEXT_RESOURCE_URI,    "nextResourceURI",    0},
+  {CTX_LOCATIONS,      KEY_ENTRIES,              "entries",            0},
+  {CTX_ENTRY,          KEY_MAC_ADDRESS,          "macAddress",         0},
+  {CTX_ENTRY,          KEY_CURRENTLY_TRACKED,    "currentlyTracked",   0},
+  {CTX_ENTRY,          KEY_MAP_INFO,             "MapInfo",            0},
+  {CTX_ENTRY,          KEY_GEO_COORDINATE,       "GeoCoordinate",      0},
+  {CTX_ENTRY,          KEY_STATISTICS,           "Statistics",         0},
+  {CTX_MAP_INFO,       KEY_MAP_HIERARCHY_STRING, "mapHierarchyString", 0},
+  {CTX_GEO,            KEY_LATTITUDE,            "lattitude",          0},
+  {CTX_GEO,            KEY_LONGITUDE,            "longitude",          0},
+  {CTX_GEO,            KEY_UNIT,                 "unit",               0},
+  {CTX_STATISTICS,     KEY_LAST_LOCATED_TIME,    "lastLocatedTime",    0},
+  {CTX_ENTRY,          KEY_MAP_COORDINATE,       "MapCoordinate",      RB_MSE_FIELD_MAP_COORDINATE},
+  {CTX_MAP_COORDINATE, KEY_X,                    "x",                  RB_MSE_FIELD_MAP_COORDINATE},
+  {CTX_MAP_COORDINATE, KEY_Y,                    "y",                  RB_MSE_FIELD_MAP_COORDINATE},
+  {CTX_MAP_COORDINATE, KEY_UNIT,                 "unit",               RB_MSE_FIELD_MAP_COORDINATE},
+  {CTX_ENTRY,          KEY_CONFIDENCE_FACTOR,    "confidenceFactor",   RB_MSE_FIELD_CONFIDENCE},
+  {CTX_ENTRY,          KEY_BAND,                 "band",               RB_MSE_FIELD_BAND},
+  {CTX_ENTRY,          KEY_DOT11_STATUS,         "dot11Status",        RB_MSE_FIELD_DOT11_STATUS},
+  {CTX_ENTRY,          KEY_IP_ADDRESS,           "ipAddress",          RB_MSE_FIELD_IP_ADDRESS},
+};
+
+/* Key of the len bytes of name. name does not need to be NUL terminated.
+   Keys of the fields we were not asked for are unknown, so their values are
+   skipped like the rest of the document */
+static int key_id(int ctx,unsigned int fields,const char *name,size_t len)
+{
+  size_t i;
+  if(ctx == CTX_SKIP)
+    return KEY_NONE;
+
+  for(i=0;i<sizeof(key_names)/sizeof(key_names[0]);++i)
+    if(key_names[i].ctx == ctx && strlen(key_names[i].name)==len && 0==memcmp(key_names[i].name,name,len))
+      return 0 == key_names[i].field || (key_names[i].field & fields) ? key_names[i].key : KEY_NONE;
+  return KEY_NONE;
+}
+
+static inline int current_ctx(const struct mse_parser *parser)
+{
+  return parser->depth > 0 ? parser->stack_ctx[parser->depth-1] : CTX_SKIP;
+}
+
+static void entry_reset(struct mse_parser *parser)
+{
+  memset(&parser->entry,0,sizeof(parser->entry));
+  parser->entry.currently_tracked = -1;
+  strbuffer_clear(&parser->mac_address);
+  strbuffer_clear(&parser->map_hierarchy);
+  strbuffer_clear(&parser->geo_unit);
+  strbuffer_clear(&parser->map_unit);
+  strbuffer_clear(&parser->band);
+  strbuffer_clear(&parser->dot11_status);
+  strbuffer_clear(&parser->ip_address);
+}
+
+int mse_parser_init(struct mse_parser *parser,mse_parser_entry_cb *entry_cb,void *opaque)
+{
+  memset(parser,0,sizeof(*parser));
+  parser->entry_cb = entry_cb;
+  parser->opaque = opaque;
+
+  if(0 != strbuffer_init(&parser->token_buf)
+    || 0 != strbuffer_init(&parser->mac_address)
+    || 0 != strbuffer_init(&parser->map_hierarchy)
+    || 0 != strbuffer_init(&parser->geo_unit)
+    || 0 != strbuffer_init(&parser->map_unit)
+    || 0 != strbuffer_init(&parser->band)
+    || 0 != strbuffer_init(&parser->dot11_status)
+    || 0 != strbuffer_init(&parser->ip_address))
+  {
+    mse_parser_close(parser);
+    return -1;
+  }
+
+  mse_parser_reset(parser);
+  return 0;
+}
+
+void mse_parser_close(struct mse_parser *parser)
+{
+  strbuffer_close(&parser->token_buf);
+  strbuffer_close(&parser->mac_address);
+  strbuffer_close(&parser->map_hierarchy);
+  strbuffer_close(&parser->geo_unit);
+  strbuffer_close(&parser->map_unit);
+  strbuffer_close(&parser->band);
+  strbuffer_close(&parser->dot11_status);
+  strbuffer_close(&parser->ip_address);
+}
+
+void mse_parser_set_fields(struct mse_parser *parser,unsigned int fields)
+{
+  parser->fields = fields;
+}
+
+void mse_parser_reset(struct mse_parser *parser)
+{
+  parser->expect = EXPECT_VALUE;
+  parser->token = TOKEN_NONE;
+  parser->token_is_key = false;
+  parser->escape = 0;
+  parser->high_surrogate = 0;
+  strbuffer_clear(&parser->token_buf);
+  parser->offset = 0;
+  parser->error = false;
+  parser->depth = 0;
+  parser->key = KEY_NONE;
+  entry_reset(parser);
+  parser->total_pages = parser->current_page = parser->page_size = -1;
+  parser->next_resource = false;
+}
+
+/*
+ *                                 Values
+ */
+
+/* Value is done: what comes next depends on the container */
+static void value_done(struct mse_parser *parser)
+{
+  parser->key = KEY_NONE;
+  parser->expect = parser->depth > 0 ? EXPECT_COMMA_OR_END : EXPECT_NOTHING;
+}
+
+static bool copy_string(strbuffer_t *dst,const char *value,size_t len)
+{
+  strbuffer_clear(dst);
+  return 0 == strbuffer_append_bytes(dst,value,len);
+}
+
+/* Read n decimal digits. Return -1 if some of them is not a digit */
+static int parse_digits(const char *text,size_t n)
+{
+  int value = 0;
+  size_t i;
+  for(i=0;i<n;++i)
+  {
+    if(text[i] < '0' || text[i] > '9')
+      return -1;
+    value = value*10 + (text[i] - '0');
+  }
+  return value;
+}
+
+/* Days from 1970-01-01 to a date of the proleptic gregorian calendar */
+static int64_t days_from_civil(int64_t y,int m,int d)
+{
+  y -= m <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const int64_t yoe = y - era * 400;
+  const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+/* MSE timestamp, like 2013-12-11T08:54:04.312-0800, in seconds since the
+   epoch. Fractions of a second are ignored. 0 if it is malformed */
+static int64_t parse_time(const char *text,size_t len)
+{
+  if(len < 19 || text[4] != '-' || text[7] != '-' || text[10] != 'T'
+                                  || text[13] != ':' || text[16] != ':')
+    return 0;
+
+  const int year = parse_digits(text,4), month = parse_digits(text+5,2);
+  const int day = parse_digits(text+8,2), hour = parse_digits(text+11,2);
+  const int min = parse_digits(text+14,2), sec = parse_digits(text+17,2);
+  if(year < 0 || month < 1 || month > 12 || day < 1 || day > 31
+                        || hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+    return 0;
+
+  size_t i = 19;
+  if(i < len && text[i] == '.')
+    for(i++;i < len && text[i] >= '0' && text[i] <= '9';i++);
+
+  int offset = 0;
+  if(i < len && (text[i] == '+' || text[i] == '-'))
+  {
+    /* +hhmm or +hh:mm */
+    const int sign = text[i] == '-' ? -1 : 1;
+    const size_t colon = i+3 < len && text[i+3] == ':';
+    if(len != i + 5 + colon)
+      return 0;
+    const int off_hour = parse_digits(text+i+1,2), off_min = parse_digits(text+i+3+colon,2);
+    if(off_hour < 0 || off_min < 0)
+      return 0;
+    offset = sign * (off_hour*3600 + off_min*60);
+  }
+  else if(i < len && !(text[i] == 'Z' && i + 1 == len))
+  {
+    return 0;
+  }
+
+  return days_from_civil(year,month,day)*86400 + hour*3600 + min*60 + sec - offset;
+}
+
+static bool value_string(struct mse_parser *parser,const char *value,size_t len)
+{
+  switch(current_ctx(parser))
+  {
+  case CTX_LOCATIONS:
+    if(parser->key == KEY_NEXT_RESOURCE_URI)
+      parser->next_resource = true;
+    break;
+  case CTX_ENTRY:
+    if(parser->key == KEY_MAC_ADDRESS)
+    {
+      if(!copy_string(&parser->mac_address,value,len))
+        return false;
+      parser->entry.mac_address = strbuffer_value(&parser->mac_address);
+    }
+    else if(parser->key == KEY_MAP_INFO)
+    {
+      parser->entry.map_info = true;
+    }
+    else if(parser->key == KEY_BAND)
+    {
+      if(!copy_string(&parser->band,value,len))
+        return false;
+      parser->entry.band = strbuffer_value(&parser->band);
+      parser->entry.fields |= RB_MSE_FIELD_BAND;
+    }
+    else if(parser->key == KEY_DOT11_STATUS)
+    {
+      if(!copy_string(&parser->dot11_status,value,len))
+        return false;
+      parser->entry.dot11_status = strbuffer_value(&parser->dot11_status);
+      parser->entry.fields |= RB_MSE_FIELD_DOT11_STATUS;
+    }
+    else if(parser->key == KEY_IP_ADDRESS)
+    {
+      /* Some MSE versions send a single address instead of an array */
+      if(!copy_string(&parser->ip_address,value,len))
+        return false;
+      parser->entry.ip_address = strbuffer_value(&parser->ip_address);
+      parser->entry.fields |= RB_MSE_FIELD_IP_ADDRESS;
+    }
+    break;
+  case CTX_IP_ADDRESS:
+    if(!(parser->entry.fields & RB_MSE_FIELD_IP_ADDRESS))
+    {
+      if(!copy_string(&parser->ip_address,value,len))
+        return false;
+      parser->entry.ip_address = strbuffer_value(&parser->ip_address);
+      parser->entry.fields |= RB_MSE_FIELD_IP_ADDRESS;
+    }
+    break;
+  case CTX_MAP_COORDINATE:
+    if(parser->key == KEY_UNIT)
+    {
+      if(!copy_string(&parser->map_unit,value,len))
+        return false;
+      parser->entry.map_unit = strbuffer_value(&parser->map_unit);
+    }
+    break;
+  case CTX_MAP_INFO:
+    if(parser->key == KEY_MAP_HIERARCHY_STRING)
+    {
+      if(!copy_string(&parser->map_hierarchy,value,len))
+        return false;
+      parser->entry.map_hierarchy = strbuffer_value(&parser->map_hierarchy);
+    }
+    break;
+  case CTX_GEO:
+    if(parser->key == KEY_UNIT)
+    {
+      if(!copy_string(&parser->geo_unit,value,len))
+        return false;
+      parser->entry.geo_unit = strbuffer_value(&parser->geo_unit);
+    }
+    break;
+  case CTX_STATISTICS:
+    if(parser->key == KEY_LAST_LOCATED_TIME)
+      parser->entry.last_located = parse_time(value,len);
+    break;
+  };
+
+  return true;
+}
+
+static bool valid_number(const char *text)
+{
+  const char *p = text;
+  if(*p == '-')
+    p++;
+  if(*p == '0')
+    p++;
+  else if(*p >= '1' && *p <= '9')
+    while(*p >= '0' && *p <= '9') p++;
+  else
+    return false;
+
+  if(*p == '.')
+  {
+    p++;
+    if(!(*p >= '0' && *p <= '9'))
+      return false;
+    while(*p >= '0' && *p <= '9') p++;
+  }
+
+  if(*p == 'e' || *p == 'E')
+  {
+    p++;
+    if(*p == '+' || *p == '-')
+      p++;
+    if(!(*p >= '0' && *p <= '9'))
+      return false;
+    while(*p >= '0' && *p <= '9') p++;
+  }
+
+  return *p == '\0';
+}
+
+static bool value_number(struct mse_parser *parser,const char *text)
+{
+  if(!valid_number(text))
+    return false;
+
+  switch(current_ctx(parser))
+  {
+  case CTX_LOCATIONS:
+    if(parser->key == KEY_TOTAL_PAGES)
+      parser->total_pages = strtoll(text,NULL,10);
+    else if(parser->key == KEY_CURRENT_PAGE)
+      parser->current_page = strtoll(text,NULL,10);
+    else if(parser->key == KEY_PAGE_SIZE)
+      parser->page_size = strtoll(text,NULL,10);
+    else if(parser->key == KEY_NEXT_RESOURCE_URI)
+      parser->next_resource = true;
+    break;
+  case CTX_ENTRY:
+    if(parser->key == KEY_MAP_INFO)
+    {
+      parser->entry.map_info = true;
+    }
+    else if(parser->key == KEY_CONFIDENCE_FACTOR)
+    {
+      parser->entry.confidence = strtod(text,NULL);
+      parser->entry.fields |= RB_MSE_FIELD_CONFIDENCE;
+    }
+    break;
+  case CTX_GEO:
+    if(parser->key == KEY_LATTITUDE)
+      parser->entry.lattitude = strtod(text,NULL);
+    else if(parser->key == KEY_LONGITUDE)
+      parser->entry.longitude = strtod(text,NULL);
+    break;
+  case CTX_MAP_COORDINATE:
+    if(parser->key == KEY_X)
+      parser->entry.map_x = strtod(text,NULL);
+    else if(parser->key == KEY_Y)
+      parser->entry.map_y = strtod(text,NULL);
+    break;
+  };
+
+  return true;
+}
+
+static bool value_literal(struct mse_parser *parser,const char *text)
+{
+  int boolean;
+  if(0==strcmp(text,"true"))
+    boolean = 1;
+  else if(0==strcmp(text,"false"))
+    boolean = 0;
+  else if(0==strcmp(text,"null"))
+    boolean = -1;
+  else
+    return false;
+
+  switch(current_ctx(parser))
+  {
+  case CTX_LOCATIONS:
+    if(parser->key == KEY_NEXT_RESOURCE_URI)
+      parser->next_resource = true;
+    break;
+  case CTX_ENTRY:
+    if(parser->key == KEY_CURRENTLY_TRACKED)
+      parser->entry.currently_tracked = boolean;
+    else if(parser->key == KEY_MAP_INFO)
+      parser->entry.map_info = true;
+    break;
+  };
+
+  return true;
+}
+
+/*
+ *                               Containers
+ */
+
+static int child_ctx(struct mse_parser *parser,char type)
+{
+  if(parser->depth == 0)
+    return type == '{' ? CTX_ROOT : CTX_SKIP;
+
+  switch(current_ctx(parser))
+  {
+  case CTX_ROOT:
+    return type == '{' && parser->key == KEY_LOCATIONS ? CTX_LOCATIONS : CTX_SKIP;
+  case CTX_LOCATIONS:
+    if(parser->key == KEY_NEXT_RESOURCE_URI)
+      parser->next_resource = true;
+    return type == '[' && parser->key == KEY_ENTRIES ? CTX_ENTRIES : CTX_SKIP;
+  case CTX_ENTRIES:
+    return type == '{' ? CTX_ENTRY : CTX_SKIP;
+  case CTX_ENTRY:
+    if(parser->key == KEY_MAP_INFO)
+    {
+      parser->entry.map_info = true;
+      return type == '{' ? CTX_MAP_INFO : CTX_SKIP;
+    }
+    if(parser->key == KEY_GEO_COORDINATE && type == '{')
+    {
+      parser->entry.geo = true;
+      return CTX_GEO;
+    }
+    if(parser->key == KEY_STATISTICS && type == '{')
+      return CTX_STATISTICS;
+    if(parser->key == KEY_MAP_COORDINATE && type == '{')
+    {
+      parser->entry.fields |= RB_MSE_FIELD_MAP_COORDINATE;
+      return CTX_MAP_COORDINATE;
+    }
+    if(parser->key == KEY_IP_ADDRESS && type == '[')
+      return CTX_IP_ADDRESS;
+    return CTX_SKIP;
+  default:
+    return CTX_SKIP;
+  };
+}
+
+static bool container_open(struct mse_parser *parser,char type)
+{
+  if(parser->depth == MSE_PARSER_MAX_DEPTH)
+    return false;
+
+  const int ctx = child_ctx(parser,type);
+  if(ctx == CTX_ENTRY)
+    entry_reset(parser);
+
+  parser->stack_type[parser->depth] = type;
+  parser->stack_ctx[parser->depth] = ctx;
+  parser->depth++;
+  parser->key = KEY_NONE;
+  parser->expect = type == '{' ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+  return true;
+}
+
+static bool container_close(struct mse_parser *parser,char close)
+{
+  const char type = close == '}' ? '{' : '[';
+  if(parser->depth == 0 || parser->stack_type[parser->depth-1] != type)
+    return false;
+
+  const int ctx = current_ctx(parser);
+  parser->depth--;
+  if(ctx == CTX_ENTRY && parser->entry_cb)
+    parser->entry_cb(&parser->entry,parser->opaque);
+
+  value_done(parser);
+  return true;
+}
+
+/*
+ *                                 Tokens
+ */
+
+/* String token done. Its text may point to the data being fed */
+static bool string_done(struct mse_parser *parser,const char *text,size_t len)
+{
+  bool ok = true;
+
+  parser->token = TOKEN_NONE;
+  if(parser->token_is_key)
+  {
+    parser->key = key_id(current_ctx(parser),parser->fields,text,len);
+    parser->expect = EXPECT_COLON;
+  }
+  else
+  {
+    ok = value_string(parser,text,len);
+    value_done(parser);
+  }
+
+  strbuffer_clear(&parser->token_buf);
+  return ok;
+}
+
+static bool token_done(struct mse_parser *parser)
+{
+  const int token = parser->token;
+  const char *text = strbuffer_value(&parser->token_buf);
+  bool ok = true;
+
+  if(token == TOKEN_STRING)
+    return string_done(parser,text,parser->token_buf.length);
+
+  parser->token = TOKEN_NONE;
+  if(token == TOKEN_NUMBER)
+    ok = value_number(parser,text);
+  else
+    ok = value_literal(parser,text);
+  value_done(parser);
+
+  strbuffer_clear(&parser->token_buf);
+  return ok;
+}
+
+static bool append_utf8(strbuffer_t *buf,uint32_t code)
+{
+  char out[4];
+  size_t len;
+
+  if(code < 0x80)
+  {
+    out[0] = code;
+    len = 1;
+  }
+  else if(code < 0x800)
+  {
+    out[0] = 0xC0 | (code >> 6);
+    out[1] = 0x80 | (code & 0x3F);
+    len = 2;
+  }
+  else if(code < 0x10000)
+  {
+    out[0] = 0xE0 | (code >> 12);
+    out[1] = 0x80 | ((code >> 6) & 0x3F);
+    out[2] = 0x80 | (code & 0x3F);
+    len = 3;
+  }
+  else
+  {
+    out[0] = 0xF0 | (code >> 18);
+    out[1] = 0x80 | ((code >> 12) & 0x3F);
+    out[2] = 0x80 | ((code >> 6) & 0x3F);
+    out[3] = 0x80 | (code & 0x3F);
+    len = 4;
+  }
+
+  return 0 == strbuffer_append_bytes(buf,out,len);
+}
+
+#define UTF8_REPLACEMENT_CHAR 0xFFFD
+
+/* A \uXXXX escape has been read */
+static bool string_unicode_escape(struct mse_parser *parser,uint32_t unit)
+{
+  if(parser->high_surrogate)
+  {
+    const uint32_t high = parser->high_surrogate;
+    parser->high_surrogate = 0;
+    if(unit >= 0xDC00 && unit <= 0xDFFF)
+      return append_utf8(&parser->token_buf,0x10000 + ((high - 0xD800) << 10) + (unit - 0xDC00));
+    if(!append_utf8(&parser->token_buf,UTF8_REPLACEMENT_CHAR))
+      return false;
+  }
+
+  if(unit >= 0xD800 && unit <= 0xDBFF)
+  {
+    parser->high_surrogate = unit;
+    return true;
+  }
+  if(unit >= 0xDC00 && unit <= 0xDFFF)
+    unit = UTF8_REPLACEMENT_CHAR;
+  return append_utf8(&parser->token_buf,unit);
+}
+
+/* An unpaired high surrogate is followed by something that is not \uXXXX */
+static bool string_flush_surrogate(struct mse_parser *parser)
+{
+  if(0 == parser->high_surrogate)
+    return true;
+  parser->high_surrogate = 0;
+  return append_utf8(&parser->token_buf,UTF8_REPLACEMENT_CHAR);
+}
+
+static int hex_value(char c)
+{
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/* Escape states: 0 none, 1 after backslash, 2-5 reading \u hex digits */
+static bool string_escape_char(struct mse_parser *parser,char c)
+{
+  if(parser->escape >= 2)
+  {
+    const int nibble = hex_value(c);
+    if(nibble < 0)
+      return false;
+    parser->escape_unit = (parser->escape_unit << 4) | nibble;
+    if(++parser->escape == 6)
+    {
+      parser->escape = 0;
+      return string_unicode_escape(parser,parser->escape_unit);
+    }
+    return true;
+  }
+
+  if(c == 'u')
+  {
+    parser->escape = 2;
+    parser->escape_unit = 0;
+    return true;
+  }
+
+  if(!string_flush_surrogate(parser))
+    return false;
+  parser->escape = 0;
+  switch(c)
+  {
+  case '"':  return 0 == strbuffer_append_byte(&parser->token_buf,'"');
+  case '\\': return 0 == strbuffer_append_byte(&parser->token_buf,'\\');
+  case '/':  return 0 == strbuffer_append_byte(&parser->token_buf,'/');
+  case 'b':  return 0 == strbuffer_append_byte(&parser->token_buf,'\b');
+  case 'f':  return 0 == strbuffer_append_byte(&parser->token_buf,'\f');
+  case 'n':  return 0 == strbuffer_append_byte(&parser->token_buf,'\n');
+  case 'r':  return 0 == strbuffer_append_byte(&parser->token_buf,'\r');
+  case 't':  return 0 == strbuffer_append_byte(&parser->token_buf,'\t');
+  default:   return false;
+  };
+}
+
+/* Consume string bytes. Return the number of bytes consumed, or -1 on error */
+static ssize_t string_feed(struct mse_parser *parser,const char *data,size_t size)
+{
+  size_t i = 0;
+  while(i < size)
+  {
+    if(parser->escape)
+    {
+      if(!string_escape_char(parser,data[i]))
+        return -1;
+      i++;
+      continue;
+    }
+
+    /* Copy the longest run of plain characters at once */
+    const size_t run_start = i;
+    while(i < size && data[i] != '"' && data[i] != '\\' && (unsigned char)data[i] >= 0x20)
+      i++;
+
+    if(i < size && data[i] == '"' && 0 == parser->token_buf.length && 0 == parser->high_surrogate)
+    {
+      /* All the string is in this chunk, so it is used where it is */
+      if(!string_done(parser,data + run_start,i - run_start))
+        return -1;
+      return i + 1;
+    }
+
+    if(i > run_start)
+    {
+      if(!string_flush_surrogate(parser)
+        || 0 != strbuffer_append_bytes(&parser->token_buf,data + run_start,i - run_start))
+        return -1;
+    }
+
+    if(i == size)
+      break;
+
+    if(data[i] == '\\')
+    {
+      parser->escape = 1;
+      i++;
+    }
+    else if(data[i] == '"')
+    {
+      i++;
+      if(!string_flush_surrogate(parser) || !token_done(parser))
+        return -1;
+      break;
+    }
+    else
+    {
+      return -1; /* Control character inside a string */
+    }
+  }
+  return i;
+}
+
+static inline bool is_scalar_char(char c)
+{
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+    || c == '-' || c == '+' || c == '.';
+}
+
+/* Consume number or literal bytes. Return the number of bytes consumed, or -1 on error */
+static ssize_t scalar_feed(struct mse_parser *parser,const char *data,size_t size)
+{
+  size_t i = 0;
+  while(i < size && is_scalar_char(data[i]))
+    i++;
+
+  if(0 != strbuffer_append_bytes(&parser->token_buf,data,i))
+    return -1;
+  if(i < size && !token_done(parser))
+    return -1;
+  return i;
+}
+
+static bool value_start(struct mse_parser *parser,char c)
+{
+  switch(c)
+  {
+  case '{':
+  case '[':
+    return container_open(parser,c);
+  case '"':
+    parser->token = TOKEN_STRING;
+    parser->token_is_key = false;
+    return true;
+  case 't':
+  case 'f':
+  case 'n':
+    parser->token = TOKEN_LITERAL;
+    return 0 == strbuffer_append_byte(&parser->token_buf,c);
+  default:
+    if(c == '-' || (c >= '0' && c <= '9'))
+    {
+      parser->token = TOKEN_NUMBER;
+      return 0 == strbuffer_append_byte(&parser->token_buf,c);
+    }
+    return false;
+  };
+}
+
+/* Structural character outside of any token */
+static bool structural_char(struct mse_parser *parser,char c)
+{
+  switch(parser->expect)
+  {
+  case EXPECT_VALUE:
+    return value_start(parser,c);
+  case EXPECT_VALUE_OR_END:
+    return c == ']' ? container_close(parser,']') : value_start(parser,c);
+  case EXPECT_KEY_OR_END:
+    if(c == '}')
+      return container_close(parser,'}');
+    /* Fallthrough */
+  case EXPECT_KEY:
+    if(c != '"')
+      return false;
+    parser->token = TOKEN_STRING;
+    parser->token_is_key = true;
+    return true;
+  case EXPECT_COLON:
+    if(c != ':')
+      return false;
+    parser->expect = EXPECT_VALUE;
+    return true;
+  case EXPECT_COMMA_OR_END:
+    if(c == ',')
+    {
+      parser->expect = parser->stack_type[parser->depth-1] == '{' ? EXPECT_KEY : EXPECT_VALUE;
+      return true;
+    }
+    if(c == '}' || c == ']')
+      return container_close(parser,c);
+    return false;
+  case EXPECT_NOTHING:
+  default:
+    return false;
+  };
+}
+
+int mse_parser_feed(struct mse_parser *parser,const char *data,size_t size)
+{
+  size_t i = 0;
+  if(parser->error)
+    return -1;
+
+  while(i < size)
+  {
+    if(parser->token != TOKEN_NONE)
+    {
+      const ssize_t consumed = parser->token == TOKEN_STRING ?
+        string_feed(parser,data + i,size - i) : scalar_feed(parser,data + i,size - i);
+      if(consumed < 0)
+        break;
+      i += consumed;
+      continue;
+    }
+
+    const char c = data[i];
+    if(c == ' ' || c == '\t' || c == '\n' || c == '\r')
+    {
+      i++;
+      continue;
+    }
+
+    if(!structural_char(parser,c))
+      break;
+    i++;
+  }
+
+  parser->offset += i;
+  if(i < size)
+  {
+    parser->error = true;
+    return -1;
+  }
+  return 0;
+}
+
+int mse_parser_finish(struct mse_parser *parser)
+{
+  if(!parser->error && (parser->token == TOKEN_NUMBER || parser->token == TOKEN_LITERAL))
+    parser->error = !token_done(parser);
+
+  if(parser->error || parser->token != TOKEN_NONE || parser->expect != EXPECT_NOTHING)
+  {
+    parser->error = true;
+    return -1;
+  }
+  return 0;
+}
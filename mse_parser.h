@@ -0,0 +1,141 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Streaming parser of the MSE location clients response.
+ *
+ * Bytes are fed as they come from the network, and every Locations.entries
+ * element is handed to a callback as soon as its closing brace is read. Only
+ * the fields we use are kept; the rest of the document is validated and
+ * skipped without building any tree.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "rb_mse_api.h"
+#include "strbuffer.h"
+
+#define MSE_PARSER_MAX_DEPTH 64
+
+/// Fields of one Locations.entries element.
+/// Strings are only valid inside the entry callback.
+struct mse_parser_entry
+{
+  /// macAddress. NULL if it was not present or was not a string
+  const char *mac_address;
+  /// currentlyTracked: 1 true, 0 false, -1 absent or not a boolean
+  int currently_tracked;
+
+  /// MapInfo element was present
+  bool map_info;
+  /// MapInfo.mapHierarchyString, NULL if not present
+  const char *map_hierarchy;
+
+  /// GeoCoordinate object was present
+  bool geo;
+  double lattitude;
+  double longitude;
+  /// GeoCoordinate.unit, NULL if not present
+  const char *geo_unit;
+
+  /// Statistics.lastLocatedTime, in seconds since the epoch. 0 if not
+  /// present or malformed
+  int64_t last_located;
+
+  /// RB_MSE_FIELD_* optional fields present in the entry. Only the ones the
+  /// parser was asked for are read
+  unsigned int fields;
+  /// MapCoordinate
+  double map_x;
+  double map_y;
+  const char *map_unit;
+  /// confidenceFactor
+  double confidence;
+  const char *band;
+  const char *dot11_status;
+  /// First ipAddress
+  const char *ip_address;
+};
+
+typedef void mse_parser_entry_cb(const struct mse_parser_entry *entry,void *opaque);
+
+struct mse_parser
+{
+  mse_parser_entry_cb *entry_cb;
+  void *opaque;
+  /// RB_MSE_FIELD_* optional fields to read
+  unsigned int fields;
+
+  /* Lexer state */
+  int expect;
+  int token;
+  bool token_is_key;
+  int escape;
+  uint32_t escape_unit;
+  uint32_t high_surrogate;
+  strbuffer_t token_buf;
+  size_t offset;
+  bool error;
+
+  /* Containers stack */
+  int depth;
+  unsigned char stack_type[MSE_PARSER_MAX_DEPTH];
+  unsigned char stack_ctx[MSE_PARSER_MAX_DEPTH];
+  int key;
+
+  /* Entry being built */
+  struct mse_parser_entry entry;
+  strbuffer_t mac_address;
+  strbuffer_t map_hierarchy;
+  strbuffer_t geo_unit;
+  strbuffer_t map_unit;
+  strbuffer_t band;
+  strbuffer_t dot11_status;
+  strbuffer_t ip_address;
+
+  /* Locations fields. -1 if not present */
+  int64_t total_pages;
+  int64_t current_page;
+  int64_t page_size;
+  /// Locations.nextResourceURI was present
+  bool next_resource;
+};
+
+int mse_parser_init(struct mse_parser *parser,mse_parser_entry_cb *entry_cb,void *opaque);
+void mse_parser_close(struct mse_parser *parser);
+
+/* Read the fields RB_MSE_FIELD_* too. The rest of optional fields are skipped */
+void mse_parser_set_fields(struct mse_parser *parser,unsigned int fields);
+
+/* Prepare the parser for a new document, keeping its buffers */
+void mse_parser_reset(struct mse_parser *parser);
+
+/* Parse a chunk of the document. Return 0 on success, -1 on malformed JSON */
+int mse_parser_feed(struct mse_parser *parser,const char *data,size_t size);
+
+/* Signal the end of the document. Return 0 if it was complete and valid */
+int mse_parser_finish(struct mse_parser *parser);
+
+/* Bytes consumed so far. On error, offset of the offending byte */
+#define mse_parser_offset(parser) ((parser)->offset)
@@ -0,0 +1,138 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_records.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+void mse_records_init(struct mse_records *records,size_t expected,size_t extra)
+{
+  memset(records,0,sizeof(*records));
+  records->expected = expected;
+  /* Keep every record aligned like the first one */
+  records->stride = (sizeof(struct rb_mse_api_pos) + extra + 7) & ~(size_t)7;
+}
+
+void mse_records_close(struct mse_records *records)
+{
+  struct mse_records_chunk *chunk = records->first;
+  while(chunk)
+  {
+    struct mse_records_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  memset(records,0,sizeof(*records));
+}
+
+void mse_records_expect(struct mse_records *records,size_t expected)
+{
+  if(expected > records->expected)
+    records->expected = expected;
+}
+
+static struct mse_records_chunk *mse_records_chunk_new(struct mse_records *records)
+{
+  size_t capacity = records->expected > records->count ? records->expected - records->count : 0;
+  if(capacity < MSE_RECORDS_MIN_CHUNK)
+    capacity = MSE_RECORDS_MIN_CHUNK;
+
+  void *mem = NULL;
+  if(0 != posix_memalign(&mem,64,sizeof(struct mse_records_chunk) + capacity*records->stride))
+    return NULL;
+
+  struct mse_records_chunk *chunk = mem;
+  chunk->next = NULL;
+  chunk->size = 0;
+  chunk->capacity = capacity;
+  chunk->stride = records->stride;
+
+  if(records->last)
+    records->last->next = chunk;
+  else
+    records->first = chunk;
+  records->last = chunk;
+  return chunk;
+}
+
+struct rb_mse_api_pos *mse_records_new(struct mse_records *records)
+{
+  struct mse_records_chunk *chunk = records->last;
+  if(NULL == chunk || chunk->size == chunk->capacity)
+    chunk = mse_records_chunk_new(records);
+  if(NULL == chunk)
+    return NULL;
+
+  struct rb_mse_api_pos *record = mse_records_at(chunk,chunk->size++);
+  records->count++;
+  memset(record,0,chunk->stride);
+  return record;
+}
+
+int mse_records_copy(struct mse_records *dst,const struct mse_records *src)
+{
+  const struct mse_records_chunk *src_chunk;
+
+  assert(NULL == dst->first);
+  mse_records_expect(dst,src->count);
+  struct mse_records_chunk *chunk = mse_records_chunk_new(dst);
+  if(NULL == chunk)
+    return -1;
+
+  for(src_chunk=src->first;src_chunk;src_chunk=src_chunk->next)
+  {
+    if(src_chunk->stride == chunk->stride)
+    {
+      memcpy(mse_records_at(chunk,chunk->size),src_chunk->data,src_chunk->size*src_chunk->stride);
+      chunk->size += src_chunk->size;
+      continue;
+    }
+
+    size_t i;
+    for(i=0;i<src_chunk->size;++i)
+    {
+      struct rb_mse_api_pos *record = mse_records_at(chunk,chunk->size++);
+      memset(record,0,chunk->stride);
+      memcpy(record,mse_records_at(src_chunk,i),sizeof(*record));
+      record->flags &= ~MSE_POS_F_FIELDS;
+    }
+  }
+  dst->count = chunk->size;
+  return 0;
+}
+
+struct rb_mse_api_pos *mse_records_copy_of(const struct mse_records *dst,
+  const struct mse_records *src,const struct rb_mse_api_pos *record)
+{
+  const struct mse_records_chunk *src_chunk;
+  size_t offset = 0;
+
+  for(src_chunk=src->first;src_chunk;src_chunk=src_chunk->next)
+  {
+    const unsigned char *data = (const unsigned char *)record;
+    if(data >= src_chunk->data && data < src_chunk->data + src_chunk->size*src_chunk->stride)
+      return mse_records_at(dst->first,offset + (size_t)(data - src_chunk->data)/src_chunk->stride);
+    offset += src_chunk->size;
+  }
+
+  return NULL;
+}
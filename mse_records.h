@@ -0,0 +1,106 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Storage of the positions of one update.
+ *
+ * Records are fixed size and are allocated in big chunks, so they are
+ * contiguous in memory and never move: the index points to them. The first
+ * chunk is sized from the expected number of clients, so in steady state all
+ * of them are in a single block.
+ *
+ * Every record can be followed by some extra bytes, the same for all of them,
+ * to hold the optional fields the user asked for (see mse_fields.h).
+ */
+
+#include "rb_mse_api.h"
+
+#include <stddef.h>
+
+/* Private rb_mse_api_pos flags. Public ones are in rb_mse_api.h */
+#define MSE_POS_F_PUBLIC       0xff
+/// Entry came from the currentlyTracked=true pages
+#define MSE_POS_F_TRACKED_PASS 0x100
+/// Entry was received in the update in progress
+#define MSE_POS_F_SEEN         0x200
+/// MAC is not in the MSE anymore. The record is a hole until the next compaction
+#define MSE_POS_F_REMOVED      0x400
+/// Entry is different from the position of the previous update
+#define MSE_POS_F_CHANGED      0x800
+/// MAC was not in the generation the update started from
+#define MSE_POS_F_ADDED        0x1000
+/// Record is followed by its optional fields
+#define MSE_POS_F_FIELDS       0x2000
+
+/// Records of the smallest chunk
+#define MSE_RECORDS_MIN_CHUNK 1024
+
+struct mse_records_chunk
+{
+  struct mse_records_chunk *next;
+  size_t size;
+  size_t capacity;
+  /// Bytes of every record, extra ones included
+  size_t stride;
+  unsigned char data[] __attribute__((aligned(8)));
+};
+
+/// i-th record of the chunk
+#define mse_records_at(chunk,i) \
+  ((struct rb_mse_api_pos *)((chunk)->data + (i)*(chunk)->stride))
+
+struct mse_records
+{
+  struct mse_records_chunk *first;
+  struct mse_records_chunk *last;
+  /// Records allocated in all the chunks
+  size_t count;
+  /// Records we expect to hold, to size the next chunk
+  size_t expected;
+  /// Bytes of every record, extra ones included
+  size_t stride;
+};
+
+/* Initialize records, with extra bytes after every one. Memory is not
+   allocated until the first record */
+void mse_records_init(struct mse_records *records,size_t expected,size_t extra);
+void mse_records_close(struct mse_records *records);
+
+/* Raise the number of records we expect to hold */
+void mse_records_expect(struct mse_records *records,size_t expected);
+
+/* New zeroed record, extra bytes included. NULL on memory error */
+struct rb_mse_api_pos *mse_records_new(struct mse_records *records);
+
+/* Copy all the src records to the first chunk of dst, that must be empty.
+   The chunk has room for the records dst expects too. If the records have
+   different extra bytes, they are not copied. Return 0 on success */
+int mse_records_copy(struct mse_records *dst,const struct mse_records *src);
+
+/* Copy in dst of the src record, after mse_records_copy(dst,src) */
+struct rb_mse_api_pos *mse_records_copy_of(const struct mse_records *dst,
+  const struct mse_records *src,const struct rb_mse_api_pos *record);
+
+/* Iterate over all the records, in allocation order */
+#define mse_records_foreach(records,chunk,i) \
+  for((chunk)=(records)->first;(chunk);(chunk)=(chunk)->next) \
+    for((i)=0;(i)<(chunk)->size;++(i))
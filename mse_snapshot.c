@@ -0,0 +1,410 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MSE_SNAPSHOT_HIERARCHY_SEP ">"
+
+/* ============================================================ *
+ *                             Save
+ * ============================================================ */
+
+struct mse_snapshot_writer
+{
+  /// Interned string pointer -> offset in strings
+  struct mse_index string_offsets;
+  /// Location pointer -> index in locations
+  struct mse_index location_indexes;
+
+  strbuffer_t strings;
+  struct mse_snapshot_location *locations;
+  size_t locations_size;
+  size_t locations_capacity;
+};
+
+/* Strings and locations are interned, so the pointer identifies them */
+#define mse_snapshot_ptr_key(ptr) (((uint64_t)(uintptr_t)(ptr)) & ~MSE_INDEX_KEY_USED)
+
+static int mse_snapshot_string_offset(struct mse_snapshot_writer *writer,const char *str,uint32_t *offset)
+{
+  if(NULL == str)
+  {
+    *offset = 0;
+    return 0;
+  }
+
+  bool found = false;
+  void **slot = mse_index_upsert(&writer->string_offsets,mse_snapshot_ptr_key(str),&found);
+  if(NULL == slot)
+    return -1;
+
+  if(!found)
+  {
+    if(writer->strings.length + strlen(str) + 1 > UINT32_MAX)
+      return -1;
+    *slot = (void *)(uintptr_t)writer->strings.length;
+    if(0 != strbuffer_append_bytes(&writer->strings,str,strlen(str)+1))
+      return -1;
+  }
+
+  *offset = (uint32_t)(uintptr_t)*slot;
+  return 0;
+}
+
+static int mse_snapshot_location_index(struct mse_snapshot_writer *writer,
+  const struct rb_mse_api_location *location,uint32_t *index)
+{
+  if(NULL == location || &mse_location_none == location)
+  {
+    *index = MSE_SNAPSHOT_NO_LOCATION;
+    return 0;
+  }
+
+  bool found = false;
+  void **slot = mse_index_upsert(&writer->location_indexes,mse_snapshot_ptr_key(location),&found);
+  if(NULL == slot)
+    return -1;
+
+  if(!found)
+  {
+    if(writer->locations_size == writer->locations_capacity)
+    {
+      const size_t capacity = writer->locations_capacity ? writer->locations_capacity*2 : 256;
+      struct mse_snapshot_location *locations = realloc(writer->locations,capacity*sizeof(locations[0]));
+      if(NULL == locations)
+        return -1;
+      writer->locations = locations;
+      writer->locations_capacity = capacity;
+    }
+
+    struct mse_snapshot_location *l = &writer->locations[writer->locations_size];
+    if(0 != mse_snapshot_string_offset(writer,location->zone,&l->zone)
+      || 0 != mse_snapshot_string_offset(writer,location->build,&l->build)
+      || 0 != mse_snapshot_string_offset(writer,location->floor,&l->floor))
+      return -1;
+
+    *slot = (void *)(uintptr_t)writer->locations_size++;
+  }
+
+  *index = (uint32_t)(uintptr_t)*slot;
+  return 0;
+}
+
+static int mse_snapshot_record(struct mse_snapshot_writer *writer,const struct rb_mse_api_pos *position,
+  struct mse_snapshot_record *record)
+{
+  memset(record,0,sizeof(*record));
+  record->mac = position->mac;
+  record->flags = position->flags & MSE_POS_F_PUBLIC & ~RB_MSE_POS_F_STALE;
+  record->mse = position->mse;
+  record->last_located = position->last_located;
+  record->lattitude = position->lattitude;
+  record->longitude = position->longitude;
+  if(0 != mse_snapshot_location_index(writer,position->location,&record->location))
+    return -1;
+  return mse_snapshot_string_offset(writer,position->unit,&record->unit);
+}
+
+static int mse_snapshot_write(FILE *file,struct mse_snapshot_writer *writer,const struct mse_records *records)
+{
+  struct mse_records_chunk *chunk;
+  struct mse_snapshot_record record;
+  size_t i,live=0;
+
+  /* First pass: strings and locations, that go before the records */
+  mse_records_foreach(records,chunk,i)
+  {
+    if(mse_records_at(chunk,i)->flags & MSE_POS_F_REMOVED)
+      continue;
+    if(0 != mse_snapshot_record(writer,mse_records_at(chunk,i),&record))
+      return -1;
+    live++;
+  }
+
+  struct mse_snapshot_header header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,MSE_SNAPSHOT_MAGIC,sizeof(header.magic));
+  header.version = MSE_SNAPSHOT_VERSION;
+  header.byte_order = MSE_SNAPSHOT_BYTE_ORDER;
+  header.created = time(NULL);
+  header.strings_size = writer->strings.length;
+  header.locations = writer->locations_size;
+  header.records = live;
+
+  if(1 != fwrite(&header,sizeof(header),1,file)
+    || writer->strings.length != fwrite(writer->strings.value,1,writer->strings.length,file)
+    || writer->locations_size != fwrite(writer->locations,sizeof(writer->locations[0]),writer->locations_size,file))
+    return -1;
+
+  mse_records_foreach(records,chunk,i)
+  {
+    if(mse_records_at(chunk,i)->flags & MSE_POS_F_REMOVED)
+      continue;
+    if(0 != mse_snapshot_record(writer,mse_records_at(chunk,i),&record)
+      || 1 != fwrite(&record,sizeof(record),1,file))
+      return -1;
+  }
+
+  return 0;
+}
+
+int mse_snapshot_save(const char *path,const struct mse_records *records)
+{
+  struct mse_snapshot_writer writer;
+  int rc = -1;
+
+  memset(&writer,0,sizeof(writer));
+  char *tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+  if(NULL == tmp_path)
+    return -1;
+  sprintf(tmp_path,"%s.tmp",path);
+
+  if(0 != mse_index_init(&writer.string_offsets,0)
+    || 0 != mse_index_init(&writer.location_indexes,0)
+    || 0 != strbuffer_init(&writer.strings)
+    || 0 != strbuffer_append_byte(&writer.strings,'\0')) /* Offset 0 */
+  {
+    errno = ENOMEM;
+    goto end;
+  }
+
+  FILE *file = fopen(tmp_path,"wb");
+  if(NULL == file)
+    goto end;
+
+  const int write_rc = mse_snapshot_write(file,&writer,records);
+  const int flush_rc = fflush(file);
+  const int sync_rc = fsync(fileno(file));
+  const int close_rc = fclose(file);
+  if(0 != write_rc || 0 != flush_rc || 0 != sync_rc || 0 != close_rc || 0 != rename(tmp_path,path))
+  {
+    const int errno_bak = errno ? errno : ENOMEM;
+    unlink(tmp_path);
+    errno = errno_bak;
+    goto end;
+  }
+
+  rc = 0;
+
+end:
+  mse_index_close(&writer.string_offsets);
+  mse_index_close(&writer.location_indexes);
+  strbuffer_close(&writer.strings);
+  free(writer.locations);
+  free(tmp_path);
+  return rc;
+}
+
+/* ============================================================ *
+ *                             Load
+ * ============================================================ */
+
+/* String at offset, or NULL if it is the empty string or out of the table */
+static const char *mse_snapshot_string(const char *strings,size_t strings_size,uint32_t offset,bool *valid)
+{
+  if(offset >= strings_size)
+  {
+    *valid = false;
+    return NULL;
+  }
+  return strings[offset] ? &strings[offset] : NULL;
+}
+
+static int mse_snapshot_resolve_locations(const struct mse_snapshot_header *header,const char *strings,
+  const struct mse_snapshot_location *file_locations,struct mse_location_dict *locations,
+  const struct rb_mse_api_location **resolved)
+{
+  strbuffer_t hierarchy;
+  size_t i;
+  int rc = 0;
+
+  if(0 != strbuffer_init(&hierarchy))
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for(i=0;0 == rc && i<header->locations;++i)
+  {
+    bool valid = true;
+    const char *levels[] = {
+      mse_snapshot_string(strings,header->strings_size,file_locations[i].zone,&valid),
+      mse_snapshot_string(strings,header->strings_size,file_locations[i].build,&valid),
+      mse_snapshot_string(strings,header->strings_size,file_locations[i].floor,&valid),
+    };
+    size_t l;
+
+    strbuffer_clear(&hierarchy);
+    for(l=0;valid && l<sizeof(levels)/sizeof(levels[0]) && levels[l];++l)
+      if((l > 0 && 0 != strbuffer_append(&hierarchy,MSE_SNAPSHOT_HIERARCHY_SEP))
+        || 0 != strbuffer_append(&hierarchy,levels[l]))
+        valid = false;
+
+    if(!valid)
+    {
+      errno = EINVAL;
+      rc = -1;
+    }
+    else if(NULL == (resolved[i] = mse_location_dict_get(locations,strbuffer_value(&hierarchy))))
+    {
+      errno = ENOMEM;
+      rc = -1;
+    }
+  }
+
+  strbuffer_close(&hierarchy);
+  return rc;
+}
+
+static ssize_t mse_snapshot_read(const char *data,size_t size,struct mse_records *records,
+  struct mse_index *index,struct mse_location_dict *locations)
+{
+  const struct mse_snapshot_header *header = (const struct mse_snapshot_header *)data;
+  size_t i;
+
+  if(size < sizeof(*header) || 0 != memcmp(header->magic,MSE_SNAPSHOT_MAGIC,sizeof(header->magic))
+    || MSE_SNAPSHOT_VERSION != header->version || MSE_SNAPSHOT_BYTE_ORDER != header->byte_order
+    || header->strings_size < 1 || header->strings_size > UINT32_MAX
+    || header->locations >= MSE_SNAPSHOT_NO_LOCATION
+    || header->records > (size - sizeof(*header))/sizeof(struct mse_snapshot_record)
+    || size - sizeof(*header) != header->strings_size
+                            + header->locations*sizeof(struct mse_snapshot_location)
+                            + header->records*sizeof(struct mse_snapshot_record))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  const char *strings = data + sizeof(*header);
+  if('\0' != strings[header->strings_size-1])
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Locations and records may be unaligned after the strings, so they are copied */
+  const char *file_locations = strings + header->strings_size;
+  const char *file_records = file_locations + header->locations*sizeof(struct mse_snapshot_location);
+
+  struct mse_snapshot_location *aligned_locations = malloc((header->locations+1)*sizeof(aligned_locations[0]));
+  const struct rb_mse_api_location **resolved = malloc((header->locations+1)*sizeof(resolved[0]));
+  if(NULL == aligned_locations || NULL == resolved)
+  {
+    free(aligned_locations);
+    free(resolved);
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(aligned_locations,file_locations,header->locations*sizeof(aligned_locations[0]));
+
+  ssize_t ret = 0;
+  if(0 != mse_snapshot_resolve_locations(header,strings,aligned_locations,locations,resolved))
+    ret = -1;
+
+  mse_records_expect(records,header->records);
+  for(i=0;ret >= 0 && i<header->records;++i)
+  {
+    struct mse_snapshot_record record;
+    bool valid = true, found = false;
+
+    memcpy(&record,file_records + i*sizeof(record),sizeof(record));
+    const char *unit = mse_snapshot_string(strings,header->strings_size,record.unit,&valid);
+    if(!valid || record.mac > UINT64_C(0xFFFFFFFFFFFF)
+      || (record.location != MSE_SNAPSHOT_NO_LOCATION && record.location >= header->locations))
+    {
+      errno = EINVAL;
+      ret = -1;
+      break;
+    }
+
+    void **slot = mse_index_upsert(index,record.mac,&found);
+    struct rb_mse_api_pos *position = found ? *slot : mse_records_new(records);
+    if(NULL == slot || NULL == position || (unit && NULL == (unit = mse_location_dict_intern(locations,unit))))
+    {
+      errno = ENOMEM;
+      ret = -1;
+      break;
+    }
+
+    *slot = position;
+    position->mac = record.mac;
+    position->flags = (record.flags & MSE_POS_F_PUBLIC) | RB_MSE_POS_F_STALE;
+    position->location = record.location == MSE_SNAPSHOT_NO_LOCATION ? &mse_location_none
+                                                                     : resolved[record.location];
+    position->lattitude = record.lattitude;
+    position->longitude = record.longitude;
+    position->unit = unit;
+    position->last_located = record.last_located;
+    position->mse = record.mse;
+    if(!found)
+      ret++;
+  }
+
+  free(aligned_locations);
+  free(resolved);
+  return ret;
+}
+
+ssize_t mse_snapshot_load(const char *path,struct mse_records *records,struct mse_index *index,
+  struct mse_location_dict *locations)
+{
+  struct stat st;
+
+  const int fd = open(path,O_RDONLY);
+  if(fd < 0)
+    return -1;
+
+  if(0 != fstat(fd,&st))
+  {
+    const int errno_bak = errno;
+    close(fd);
+    errno = errno_bak;
+    return -1;
+  }
+
+  if((size_t)st.st_size < sizeof(struct mse_snapshot_header))
+  {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  void *data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if(MAP_FAILED == data)
+    return -1;
+
+  madvise(data,st.st_size,MADV_SEQUENTIAL);
+  const ssize_t ret = mse_snapshot_read(data,st.st_size,records,index,locations);
+  const int errno_bak = errno;
+  munmap(data,st.st_size);
+  errno = errno_bak;
+  return ret;
+}
@@ -0,0 +1,101 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Positions file, used to serve the last known positions right after a
+ * restart.
+ *
+ * Layout, in host byte order:
+ *   struct mse_snapshot_header
+ *   strings: NUL terminated strings. Offset 0 is the empty string, read as NULL
+ *   locations: struct mse_snapshot_location[header.locations]
+ *   records: struct mse_snapshot_record[header.records]
+ *
+ * Files with another magic, version or byte order are rejected.
+ */
+
+#include <sys/types.h>
+
+#include "mse_records.h"
+#include "mse_index.h"
+#include "mse_location.h"
+
+#define MSE_SNAPSHOT_MAGIC "RBMSEPOS"
+#define MSE_SNAPSHOT_VERSION 2
+#define MSE_SNAPSHOT_BYTE_ORDER 0x01020304
+
+struct mse_snapshot_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  int64_t created;
+  uint64_t strings_size;
+  uint64_t locations;
+  uint64_t records;
+};
+
+struct mse_snapshot_location
+{
+  /* Offsets in strings */
+  uint32_t zone;
+  uint32_t build;
+  uint32_t floor;
+};
+
+/// No location in mse_snapshot_record.location
+#define MSE_SNAPSHOT_NO_LOCATION UINT32_MAX
+
+struct mse_snapshot_record
+{
+  uint64_t mac;
+  uint16_t flags;
+  /// MSE the position came from
+  uint16_t mse;
+  /// Index in locations
+  uint32_t location;
+  /// Offset in strings
+  uint32_t unit;
+  uint32_t last_located;
+  double lattitude;
+  double longitude;
+};
+
+/**
+  Write the public content of the records that are not removed.
+  @param path    File to write. It is replaced atomically.
+  @param records Records to write
+  @return 0 on success, -1 on error (see errno)
+*/
+int mse_snapshot_save(const char *path,const struct mse_records *records);
+
+/**
+  Read a file written by mse_snapshot_save.
+  @param path      File to read
+  @param records   Empty records to fill
+  @param index     Empty index to fill
+  @param locations Dictionary where locations and units will be interned
+  @return Number of records read, or -1 on error (see errno). EINVAL means
+          that the file is not a valid positions file.
+*/
+ssize_t mse_snapshot_load(const char *path,struct mse_records *records,struct mse_index *index,
+  struct mse_location_dict *locations);
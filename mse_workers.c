@@ -0,0 +1,375 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "mse_workers.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "librd/rdlog.h"
+
+/// Entries of the first allocation of a page
+#define MSE_PAGE_MIN_ENTRIES 256
+
+static uint64_t mse_workers_now_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+/*
+ *                                  Pages
+ */
+
+static struct mse_page *mse_page_new(void)
+{
+  struct mse_page *page = calloc(1,sizeof(*page));
+  if(NULL == page)
+    return NULL;
+
+  if(0 != strbuffer_init(&page->body))
+  {
+    free(page);
+    return NULL;
+  }
+  if(0 != strbuffer_init(&page->strings))
+  {
+    strbuffer_close(&page->body);
+    free(page);
+    return NULL;
+  }
+  return page;
+}
+
+static void mse_page_destroy(struct mse_page *page)
+{
+  strbuffer_close(&page->body);
+  strbuffer_close(&page->strings);
+  free(page->entries);
+  free(page);
+}
+
+static void mse_page_queue_destroy(struct mse_page_queue *queue)
+{
+  struct mse_page *page;
+  while((page = TAILQ_FIRST(queue)))
+  {
+    TAILQ_REMOVE(queue,page,entry);
+    mse_page_destroy(page);
+  }
+}
+
+/* Copy a string in the page strings, and set offset to it. Consecutive
+   entries usually have the same ones, so the last string is reused if it is
+   equal. Return 0 on success */
+static int mse_page_add_string(struct mse_page *page,const char *str,uint32_t last,uint32_t *offset)
+{
+  if(NULL == str)
+  {
+    *offset = MSE_PAGE_NO_STRING;
+    return 0;
+  }
+  if(last != MSE_PAGE_NO_STRING && 0 == strcmp(page->strings.value + last,str))
+  {
+    *offset = last;
+    return 0;
+  }
+
+  if(page->strings.length >= MSE_PAGE_NO_STRING)
+    return -1;
+  *offset = page->strings.length;
+  return strbuffer_append_bytes(&page->strings,str,strlen(str) + 1);
+}
+
+int mse_page_add_entry(struct mse_page *page,uint64_t mac,const struct mse_parser_entry *entry)
+{
+  if(page->entries_count == page->entries_size)
+  {
+    const size_t size = page->entries_size ? 2*page->entries_size : MSE_PAGE_MIN_ENTRIES;
+    struct mse_page_entry *entries = realloc(page->entries,size*sizeof(entries[0]));
+    if(NULL == entries)
+      return -1;
+    page->entries = entries;
+    page->entries_size = size;
+  }
+
+  const struct mse_page_entry *last = page->entries_count ? &page->entries[page->entries_count-1] : NULL;
+  struct mse_page_entry *page_entry = &page->entries[page->entries_count];
+  page_entry->mac = mac;
+  page_entry->lattitude = entry->lattitude;
+  page_entry->longitude = entry->longitude;
+  page_entry->last_located = entry->last_located;
+  page_entry->currently_tracked = entry->currently_tracked;
+  page_entry->map_info = entry->map_info;
+  page_entry->geo = entry->geo;
+  if(0 != mse_page_add_string(page,entry->map_hierarchy,last ? last->map_hierarchy : MSE_PAGE_NO_STRING,
+                              &page_entry->map_hierarchy)
+    || 0 != mse_page_add_string(page,entry->geo_unit,last ? last->geo_unit : MSE_PAGE_NO_STRING,
+                                &page_entry->geo_unit))
+    return -1;
+
+  page_entry->fields = entry->fields;
+  if(entry->fields)
+  {
+    page_entry->map_x = entry->map_x;
+    page_entry->map_y = entry->map_y;
+    page_entry->confidence = entry->confidence;
+    if(0 != mse_page_add_string(page,entry->map_unit,last ? last->map_unit : MSE_PAGE_NO_STRING,
+                                &page_entry->map_unit)
+      || 0 != mse_page_add_string(page,entry->band,last ? last->band : MSE_PAGE_NO_STRING,&page_entry->band)
+      || 0 != mse_page_add_string(page,entry->dot11_status,last ? last->dot11_status : MSE_PAGE_NO_STRING,
+                                  &page_entry->dot11_status)
+      || 0 != mse_page_add_string(page,entry->ip_address,MSE_PAGE_NO_STRING,&page_entry->ip_address))
+      return -1;
+  }
+
+  page->entries_count++;
+  return 0;
+}
+
+/* String of the page at offset, or NULL */
+static const char *mse_page_string(const struct mse_page *page,uint32_t offset)
+{
+  return MSE_PAGE_NO_STRING == offset ? NULL : page->strings.value + offset;
+}
+
+void mse_page_entry_get(const struct mse_page *page,const struct mse_page_entry *page_entry,
+  struct mse_parser_entry *entry)
+{
+  memset(entry,0,sizeof(*entry));
+  entry->currently_tracked = page_entry->currently_tracked;
+  entry->map_info = page_entry->map_info;
+  entry->map_hierarchy = MSE_PAGE_NO_STRING == page_entry->map_hierarchy ? NULL
+                                                : page->strings.value + page_entry->map_hierarchy;
+  entry->geo = page_entry->geo;
+  entry->lattitude = page_entry->lattitude;
+  entry->longitude = page_entry->longitude;
+  entry->geo_unit = MSE_PAGE_NO_STRING == page_entry->geo_unit ? NULL
+                                           : page->strings.value + page_entry->geo_unit;
+  entry->last_located = page_entry->last_located;
+
+  entry->fields = page_entry->fields;
+  if(entry->fields)
+  {
+    entry->map_x = page_entry->map_x;
+    entry->map_y = page_entry->map_y;
+    entry->map_unit = mse_page_string(page,page_entry->map_unit);
+    entry->confidence = page_entry->confidence;
+    entry->band = mse_page_string(page,page_entry->band);
+    entry->dot11_status = mse_page_string(page,page_entry->dot11_status);
+    entry->ip_address = mse_page_string(page,page_entry->ip_address);
+  }
+}
+
+/*
+ *                                 Workers
+ */
+
+static void mse_worker_parse(struct mse_worker *worker,struct mse_page *page)
+{
+  struct mse_parser *parser = &worker->parser;
+  const uint64_t start = mse_workers_now_us();
+
+  page->entries_count = 0;
+  strbuffer_clear(&page->strings);
+  mse_parser_reset(parser);
+  parser->opaque = page;
+
+  page->ok = 0 == mse_parser_feed(parser,page->body.value,page->body.length)
+    && 0 == mse_parser_finish(parser);
+  page->parsed = mse_parser_offset(parser);
+  page->total_pages = parser->total_pages;
+  page->current_page = parser->current_page;
+  page->page_size = parser->page_size;
+  page->next_resource = parser->next_resource;
+  page->parse_us = mse_workers_now_us() - start;
+}
+
+static void *mse_worker_main(void *opaque)
+{
+  struct mse_worker *worker = opaque;
+  struct mse_workers *workers = worker->workers;
+
+  pthread_mutex_lock(&workers->lock);
+  for(;;)
+  {
+    struct mse_page *page;
+    while(!workers->exiting && NULL == (page = TAILQ_FIRST(&workers->queue)))
+      pthread_cond_wait(&workers->cond,&workers->lock);
+    if(workers->exiting)
+      break;
+
+    TAILQ_REMOVE(&workers->queue,page,entry);
+    pthread_mutex_unlock(&workers->lock);
+
+    mse_worker_parse(worker,page);
+
+    pthread_mutex_lock(&workers->lock);
+    TAILQ_INSERT_TAIL(&workers->done,page,entry);
+    pthread_cond_broadcast(&workers->cond);
+    /* If the pipe is full, the updater has wakeups pending anyway */
+    if(write(workers->wakeup[1],"",1) < 0 && errno != EAGAIN)
+      rdbg("Cannot wake the updater up: %s",strerror(errno));
+  }
+  pthread_mutex_unlock(&workers->lock);
+  return NULL;
+}
+
+static int mse_workers_pipe(int fds[2])
+{
+  if(0 != pipe(fds))
+    return -1;
+
+  unsigned int i;
+  for(i=0;i<2;++i)
+  {
+    const int flags = fcntl(fds[i],F_GETFL);
+    if(flags < 0 || 0 != fcntl(fds[i],F_SETFL,flags | O_NONBLOCK) || 0 != fcntl(fds[i],F_SETFD,FD_CLOEXEC))
+    {
+      close(fds[0]);
+      close(fds[1]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int mse_workers_init(struct mse_workers *workers,unsigned int threads,mse_parser_entry_cb *entry_cb,
+  unsigned int fields)
+{
+  unsigned int i;
+
+  memset(workers,0,sizeof(*workers));
+  TAILQ_INIT(&workers->queue);
+  TAILQ_INIT(&workers->done);
+  TAILQ_INIT(&workers->free);
+  workers->workers = calloc(threads,sizeof(workers->workers[0]));
+  if(NULL == workers->workers)
+    return -1;
+  if(0 != mse_workers_pipe(workers->wakeup))
+  {
+    free(workers->workers);
+    return -1;
+  }
+  pthread_mutex_init(&workers->lock,NULL);
+  pthread_cond_init(&workers->cond,NULL);
+
+  for(i=0;i<threads;++i)
+  {
+    struct mse_worker *worker = &workers->workers[i];
+    worker->workers = workers;
+    if(0 != mse_parser_init(&worker->parser,entry_cb,NULL))
+      break;
+    mse_parser_set_fields(&worker->parser,fields);
+    if(0 != pthread_create(&worker->thread,NULL,mse_worker_main,worker))
+    {
+      mse_parser_close(&worker->parser);
+      break;
+    }
+    workers->threads++;
+  }
+
+  if(workers->threads < threads)
+  {
+    mse_workers_close(workers);
+    return -1;
+  }
+  return 0;
+}
+
+void mse_workers_close(struct mse_workers *workers)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&workers->lock);
+  workers->exiting = true;
+  pthread_cond_broadcast(&workers->cond);
+  pthread_mutex_unlock(&workers->lock);
+
+  for(i=0;i<workers->threads;++i)
+  {
+    pthread_join(workers->workers[i].thread,NULL);
+    mse_parser_close(&workers->workers[i].parser);
+  }
+
+  mse_page_queue_destroy(&workers->queue);
+  mse_page_queue_destroy(&workers->done);
+  mse_page_queue_destroy(&workers->free);
+  close(workers->wakeup[0]);
+  close(workers->wakeup[1]);
+  pthread_cond_destroy(&workers->cond);
+  pthread_mutex_destroy(&workers->lock);
+  free(workers->workers);
+  memset(workers,0,sizeof(*workers));
+}
+
+struct mse_page *mse_workers_page_get(struct mse_workers *workers)
+{
+  pthread_mutex_lock(&workers->lock);
+  struct mse_page *page = TAILQ_FIRST(&workers->free);
+  if(page)
+    TAILQ_REMOVE(&workers->free,page,entry);
+  pthread_mutex_unlock(&workers->lock);
+
+  if(NULL == page)
+    return mse_page_new();
+
+  strbuffer_clear(&page->body);
+  page->opaque = NULL;
+  return page;
+}
+
+void mse_workers_page_put(struct mse_workers *workers,struct mse_page *page)
+{
+  pthread_mutex_lock(&workers->lock);
+  TAILQ_INSERT_HEAD(&workers->free,page,entry);
+  pthread_mutex_unlock(&workers->lock);
+}
+
+void mse_workers_submit(struct mse_workers *workers,struct mse_page *page)
+{
+  pthread_mutex_lock(&workers->lock);
+  TAILQ_INSERT_TAIL(&workers->queue,page,entry);
+  pthread_cond_broadcast(&workers->cond);
+  pthread_mutex_unlock(&workers->lock);
+}
+
+struct mse_page *mse_workers_done(struct mse_workers *workers,bool wait)
+{
+  char wakeups[64];
+
+  /* Wakeups are drained before looking at the queue, so a page parsed after
+     this always leaves the descriptor readable */
+  while(read(workers->wakeup[0],wakeups,sizeof(wakeups)) > 0);
+
+  pthread_mutex_lock(&workers->lock);
+  struct mse_page *page;
+  while(NULL == (page = TAILQ_FIRST(&workers->done)) && wait)
+    pthread_cond_wait(&workers->cond,&workers->lock);
+  if(page)
+    TAILQ_REMOVE(&workers->done,page,entry);
+  pthread_mutex_unlock(&workers->lock);
+  return page;
+}
@@ -0,0 +1,166 @@
+/*
+** Copyright (C) 2014 Eneo Tecnologia S.L.
+** Author: Eugenio Perez <eupm90@gmail.com>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation. You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#pragma once
+
+/*
+ * Pool of threads that parse MSE pages.
+ *
+ * The updater thread downloads the pages and submits their bodies. Every
+ * worker decodes whole pages with its own parser into compact entries, with
+ * the MAC already converted and the strings copied, and hands them back. The
+ * updater only has to apply them to the next generation, that stays owned by
+ * a single thread, so the index never needs locks.
+ *
+ * Pages are recycled, so in steady state their buffers are not allocated
+ * again.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "mse_parser.h"
+#include "strbuffer.h"
+
+/// Offset of the strings not present in the entry
+#define MSE_PAGE_NO_STRING UINT32_MAX
+
+/// Fields of one entry of a parsed page
+struct mse_page_entry
+{
+  uint64_t mac;
+  double lattitude;
+  double longitude;
+  int64_t last_located;
+  /// Offsets in the page strings, or MSE_PAGE_NO_STRING
+  uint32_t map_hierarchy;
+  uint32_t geo_unit;
+  /// Like struct mse_parser_entry ones
+  int8_t currently_tracked;
+  bool map_info;
+  bool geo;
+
+  /* Optional fields, if the pool was asked for them */
+  uint8_t fields;
+  double map_x;
+  double map_y;
+  double confidence;
+  uint32_t map_unit;
+  uint32_t band;
+  uint32_t dot11_status;
+  uint32_t ip_address;
+};
+
+struct mse_page
+{
+  TAILQ_ENTRY(mse_page) entry;
+  /// Of the submitter
+  void *opaque;
+  /// Response, as downloaded
+  strbuffer_t body;
+
+  /* Parse result */
+  bool ok;
+  /// Bytes parsed. On error, offset of the offending byte
+  size_t parsed;
+  int64_t total_pages;
+  int64_t current_page;
+  int64_t page_size;
+  bool next_resource;
+  struct mse_page_entry *entries;
+  size_t entries_count;
+  size_t entries_size;
+  /// NUL terminated strings of the entries
+  strbuffer_t strings;
+  uint64_t parse_us;
+};
+
+TAILQ_HEAD(mse_page_queue,mse_page);
+
+struct mse_worker
+{
+  pthread_t thread;
+  struct mse_parser parser;
+  struct mse_workers *workers;
+};
+
+struct mse_workers
+{
+  struct mse_worker *workers;
+  unsigned int threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool exiting;
+  /// Submitted pages, parsed pages, and pages ready to be reused
+  struct mse_page_queue queue;
+  struct mse_page_queue done;
+  struct mse_page_queue free;
+  /// A byte is written in wakeup[1] for every parsed page
+  int wakeup[2];
+};
+
+/**
+  Start a pool
+  @param workers  Pool to initialize
+  @param threads  Worker threads
+  @param entry_cb Called by the workers for every entry, with the page as
+                  opaque. It adds the entries it wants with mse_page_add_entry()
+  @param fields   RB_MSE_FIELD_* optional fields to parse
+  @return 0 on success, -1 on error
+*/
+int mse_workers_init(struct mse_workers *workers,unsigned int threads,mse_parser_entry_cb *entry_cb,
+  unsigned int fields);
+
+/* Stop the workers and free the pages. Pages given to the caller must have
+   been put back */
+void mse_workers_close(struct mse_workers *workers);
+
+/* Empty page, with an empty body. NULL on memory error */
+struct mse_page *mse_workers_page_get(struct mse_workers *workers);
+/* Give a page back to be reused */
+void mse_workers_page_put(struct mse_workers *workers,struct mse_page *page);
+
+/* Parse the page body in a worker */
+void mse_workers_submit(struct mse_workers *workers,struct mse_page *page);
+
+/* A parsed page, or NULL if there is none yet. If wait, it blocks until
+   one is parsed */
+struct mse_page *mse_workers_done(struct mse_workers *workers,bool wait);
+
+/* Descriptor readable when there may be parsed pages, to poll it with the
+   transfers */
+#define mse_workers_fd(workers) ((workers)->wakeup[0])
+
+/**
+  Add an entry to a page. Called from entry_cb
+  @param page  Page being parsed
+  @param mac   MAC of the entry
+  @param entry Entry from the parser
+  @return 0 on success, -1 on memory error
+*/
+int mse_page_add_entry(struct mse_page *page,uint64_t mac,const struct mse_parser_entry *entry);
+
+/* Parser entry of a page entry, with the page strings */
+void mse_page_entry_get(const struct mse_page *page,const struct mse_page_entry *page_entry,
+  struct mse_parser_entry *entry);
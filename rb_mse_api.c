@@ -21,28 +21,101 @@
 #include "rb_mse_api.h"
 
 #include "librd/rdmem.h"
-#include "librd/rdavl.h"
 #include "librd/rdstring.h"
 #include "librd/rdlog.h"
-#include "jansson.h"
-#include "strbuffer.h"
+#include "mse_parser.h"
+#include "mse_index.h"
+#include "mse_mac.h"
+#include "mse_location.h"
+#include "mse_records.h"
+#include "mse_snapshot.h"
+#include "mse_geo.h"
+#include "mse_occupancy.h"
+#include "mse_history.h"
+#include "mse_workers.h"
+#include "mse_fields.h"
+#include "mse_filter.h"
 
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/queue.h>
 
 #define RB_UNUSED __attribute__((unused))
+#define likely(x)   __builtin_expect(!!(x),1)
+#define unlikely(x) __builtin_expect(!!(x),0)
 
 static const char mse_api_call_url[] = "api/contextaware/v1/location/clients";
 
 static pthread_mutex_t curl_global_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static inline uint64_t mac_from_str(const char *mac)
+/* ============================================================ *
+ *                          Curl share
+ * ============================================================ */
+
+/* DNS cache, TLS sessions and connections are shared by all the rb_mse_api
+   of the process, so a new instance or a new update does not have to resolve
+   and handshake again. Protected by curl_global_mutex. */
+static CURLSH *curl_share = NULL;
+static unsigned int curl_share_users = 0;
+static pthread_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
+
+static void curl_share_lock(CURL *hnd RB_UNUSED, curl_lock_data data, curl_lock_access access RB_UNUSED, void *userptr RB_UNUSED)
+{
+  pthread_mutex_lock(&curl_share_locks[data]);
+}
+
+static void curl_share_unlock(CURL *hnd RB_UNUSED, curl_lock_data data, void *userptr RB_UNUSED)
+{
+  pthread_mutex_unlock(&curl_share_locks[data]);
+}
+
+/* Get a reference to the process share. Must be called with curl_global_mutex
+   held. NULL if it could not be created: the instance will work without it */
+static CURLSH *curl_share_get(void)
+{
+  size_t i;
+
+  if(NULL == curl_share)
+  {
+    curl_share = curl_share_init();
+    if(NULL == curl_share)
+      return NULL;
+
+    for(i=0;i<CURL_LOCK_DATA_LAST;++i)
+      pthread_mutex_init(&curl_share_locks[i],NULL);
+
+    curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock);
+    curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900 /* 7.57.0 */
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  }
+
+  curl_share_users++;
+  return curl_share;
+}
+
+/* Release a reference got with curl_share_get. Must be called with
+   curl_global_mutex held, after the easy handles using it are cleaned up */
+static void curl_share_put(CURLSH *share)
 {
-  uint64_t one=0,two=0,three=0,four=0,five=0,six=0;
-  sscanf(mac,"%lx:%lx:%lx:%lx:%lx:%lx",&one,&two,&three,&four,&five,&six);
-  return (((((((((one<<8)+two)<<8)+three)<<8)+four)<<8)+five)<<8)+six;
+  size_t i;
+
+  if(NULL == share || --curl_share_users > 0)
+    return;
+
+  curl_share_cleanup(curl_share);
+  curl_share = NULL;
+  for(i=0;i<CURL_LOCK_DATA_LAST;++i)
+    pthread_mutex_destroy(&curl_share_locks[i]);
 }
 
 
@@ -55,70 +128,389 @@ void rb_mse_pos_destroy(struct rb_mse_api_pos *pos){
 }
 
 /* ====================================================================== *
- *                             Positions nodes
+ *                             Positions records
  * ====================================================================== */
 
-#define MSE_POSITION_LIST_MAGIC 0x12345678
+/// MACs are 48 bits
+#define MSE_MAC_MASK UINT64_C(0xFFFFFFFFFFFF)
 
-struct mse_positions_list_node{
-#ifdef MSE_POSITION_LIST_MAGIC
-  uint64_t magic;
-#endif
-  uint64_t mac;
-  struct rb_mse_api_pos * position;
-  rd_avl_node_t rd_avl_node;
+
+/* ======================================================================= *
+ *                     mse_api structs definitions
+ * ======================================================================= */
+
+/// Positions published by one update. Readers use it without taking locks.
+struct mse_generation
+{
+  /// MAC -> struct rb_mse_api_pos in records. Removed MACs point to NULL.
+  struct mse_index index;
+  struct mse_records records;
+  /// Geo localized records, by coordinates. Built when the records are final.
+  struct mse_geo_index geo;
+  /// Records by zone, building and floor. Built when the records are final.
+  struct mse_occupancy occupancy;
+  /// MACs of the records not removed. Built when the records are final.
+  struct mse_filter filter;
+  /// Records not removed
+  size_t live;
+  struct rb_mse_stats stats;
+  /// Started as a copy of the previous generation
+  bool delta;
+  /// Positions loaded from the positions file. They are not in the
+  /// rb_mse_api dictionary, because it belongs to the updater thread.
+  struct mse_stale_locations *stale;
+  /// References: one of the rb_mse_api while it is current or retired, and
+  /// one per user snapshot
+  volatile long refcnt;
 };
 
-struct rb_mse_api_pos * mse_position(struct mse_positions_list_node *node)
+struct mse_stale_locations
 {
-  return node->position;
-}
+  struct mse_location_dict dict;
+  rd_memctx_t memctx;
+};
+
+/// Generations are rebuilt from scratch when more than 1/MSE_COMPACT_RATIO
+/// of their records are holes
+#define MSE_COMPACT_RATIO 4
 
-int mse_positions_cmp(const void *_node1,const void *_node2)
+#define MSE_CACHE_LINE_SIZE 64
+/// Reader threads are spread over this many counters
+#define MSE_READER_SLOTS 64
+
+/// Readers inside a read section, by epoch parity. Every reader thread only
+/// writes in its own slot, so there is no cache line shared between readers.
+struct mse_reader_slot
 {
-  const struct mse_positions_list_node * node1 = (const struct mse_positions_list_node *)_node1;
-  const struct mse_positions_list_node * node2 = (const struct mse_positions_list_node *)_node2;
-#ifdef MSE_POSITION_LIST_MAGIC
-  assert(_node1!=NULL);
-  assert(_node2!=NULL);
-  assert(MSE_POSITION_LIST_MAGIC == node1->magic);
-  assert(MSE_POSITION_LIST_MAGIC == node2->magic);
-#endif
-  return node2->mac > node1->mac ? 1 : node2->mac < node1->mac ? -1 : 0; // sizeof(mac1-mac2)>sizeof(int)
-}
+  volatile long active[2];
+  struct mse_filter_counters filter;
+} __attribute__((aligned(MSE_CACHE_LINE_SIZE)));
+
+/// Number of simultaneous MSE page requests if the user does not set another.
+#define MSE_DEFAULT_MAX_CONNECTIONS 4
+/// Times a page is requested before giving up the whole update.
+#define MSE_PAGE_MAX_ATTEMPTS 3
+/// Seconds of inactivity before sending TCP keepalive probes, and between them
+#define MSE_TCP_KEEPIDLE 60
+#define MSE_TCP_KEEPINTVL 30
+/// Seconds to connect to the MSE, and to wait for data of a response that
+/// stalled, before the page request fails
+#define MSE_CONNECT_TIMEOUT 10
+#define MSE_LOW_SPEED_TIME 30
+/// Failed pages are retried after MSE_PAGE_RETRY_BASE_MS*2^(attempts-1) ms,
+/// with jitter, up to MSE_PAGE_RETRY_MAX_MS
+#define MSE_PAGE_RETRY_BASE_MS 500
+#define MSE_PAGE_RETRY_MAX_MS 8000
+/// Failed updates are retried after update_time*2^(failures-1) s, with
+/// jitter, up to MSE_UPDATE_MAX_BACKOFF (or update_time, if it is bigger)
+#define MSE_UPDATE_MAX_BACKOFF 300
+/// Updates that changed less than 1/MSE_IDLE_CHANGE_RATIO of the positions
+/// stretch the interval by 3/2, up to the maximum update time
+#define MSE_IDLE_CHANGE_RATIO 1000
+
+/// MSE we poll
+struct mse_server
+{
+  char *url;
+  char *userpwd;
+  /// Passes of the update in progress already accounted in its expected records
+  bool sized[2];
+};
 
+/// Page pending to be requested to a MSE
+struct mse_page_req
+{
+  /// Index in rb_mse_api servers
+  uint16_t server;
+  bool currently_tracked;
+  int page;
+  int attempts;
+  /// Monotonic ms before which the page must not be requested (retry backoff)
+  int64_t not_before;
+  TAILQ_ENTRY(mse_page_req) entry;
+};
 
-/* ======================================================================= *
- *                     mse_api structs definitions
- * ======================================================================= */
+TAILQ_HEAD(mse_page_req_queue,mse_page_req);
+
+/// One in-flight page request. Every transfer owns its curl easy handle.
+struct mse_transfer
+{
+  CURL *hnd;
+  /// Response body is parsed as it arrives
+  struct mse_parser parser;
+  /// Page being downloaded, or NULL if the transfer is idle
+  struct mse_page_req *req;
+  /// Update the page belongs to
+  struct mse_refresh *refresh;
+  /// MSE the page is requested to
+  struct mse_server *server;
+  /// Body of the page, when it is parsed by the workers instead of as it arrives
+  struct mse_page *page;
+  /// Microseconds spent feeding the parser, and inserting its entries
+  uint64_t feed_us;
+  uint64_t insert_us;
+};
+
+/// Timings and counters of one update. They are merged in the rb_mse_api
+/// ones when it ends, so the updater does not take locks for every page.
+struct mse_update_timings
+{
+  struct rb_mse_stage_stats stages[RB_MSE_STAGES];
+  uint64_t pages;
+  uint64_t failed_pages;
+  uint64_t bytes_received;
+  uint64_t bytes_parsed;
+};
+
+/// Updates that make up a window of rb_mse_api timings. Two windows are
+/// kept, so samples are always from the last 1-2 windows.
+#define MSE_TIMINGS_WINDOW 64
+
+struct mse_timings
+{
+  pthread_mutex_t lock;
+  struct rb_mse_stage_stats windows[2][RB_MSE_STAGES];
+  unsigned int current_window;
+  unsigned int window_updates;
+  /// Only last_* and the counters are used
+  struct rb_mse_update_stats totals;
+};
+
+/// State of the update in progress
+struct mse_refresh
+{
+  /// Generation the update is a copy of. NULL if it is built from scratch
+  const struct mse_generation *previous;
+  struct mse_index *index;
+  struct mse_records *records;
+  size_t *live;
+  struct mse_location_dict *locations;
+  /// RB_MSE_FIELD_* fields stored after the records
+  unsigned int fields;
+  struct rb_mse_stats *stats;
+  size_t expected_records;
+
+  struct mse_update_timings *timings;
+
+  /// Pages not requested yet
+  struct mse_page_req_queue pending;
+  /// Pages given to the workers and not applied yet
+  size_t parsing;
+  /// Some page could not be downloaded, so we must not publish this update
+  bool failed;
+};
 
 struct rb_mse_api
 {
   // MSE update thread.
   rd_thread_t * rdt;
-  /// Curl handler.
-  CURL *hnd;
-  char * mse_url;
-  char * userpwd;
+  /// Curl multi handler.
+  CURLM *multi;
+  /// Process curl share. NULL if it could not be created.
+  CURLSH *share;
+  /// Easy handlers, one per simultaneous connection.
+  struct mse_transfer *transfers;
+  size_t transfers_size;
+  /// Connections requested by the user. Applied at the beginning of the next update.
+  volatile unsigned int max_connections;
+  /// Biggest page received so far. Curl receive buffers are sized from it.
+  size_t largest_page;
+  /// Threads that parse the pages, 0 to parse them in the updater thread as
+  /// they arrive. Applied at the beginning of the next update.
+  volatile unsigned int parse_threads;
+  struct mse_workers *workers;
+  /// RB_MSE_FIELD_* optional fields of the positions. Fixed at creation.
+  unsigned int fields;
+  /// Negative lookup filter bits per MAC. Applied to the next update.
+  volatile unsigned int filter_bits;
+
+  /// MSEs whose positions are merged. Fixed at creation.
+  struct mse_server *servers;
+  size_t servers_size;
 
-  /// Message lists queue.
-  strbuffer_t buffer;
   struct curl_slist * slist;
 
-  /// MACs positions avl
-  rd_rwlock_t avl_memctx_rwlock;
   time_t update_time;
-
-  rd_avl_t *avl;
-  rd_memctx_t *memctx;
-  
-  json_error_t error;
-
+  /// Interval can grow up to this if the positions do not change
+  volatile time_t max_update_time;
+  /// Interval between the start of two updates, adapted to the changes seen
+  int64_t interval_ms;
+  /// Consecutive failed updates
+  unsigned int failures;
+  /// Jitter of retries
+  unsigned int rand_seed;
+
+  /// Wakes the updater thread up when the instance is being destroyed
+  pthread_mutex_t wait_lock;
+  pthread_cond_t wait_cond;
+  volatile int exiting;
+
+  /// Zones, buildings, floors and other repeated strings of the positions.
+  /// Shared by all generations.
+  struct mse_location_dict locations;
+  rd_memctx_t locations_memctx;
+  /// Start every update from a copy of the last one
+  volatile int delta_updates;
+
+  /// Positions file. Every update is written to it.
+  char *snapshot_path;
+  pthread_mutex_t snapshot_lock;
+
+  struct mse_timings timings;
+
+  /// Stats of the current generation, for rb_mse_get_stats(). They outlive
+  /// the generations, so users can keep the pointer.
   struct rb_mse_stats stats;
+  /// Guards stats, and the events callback settings
+  pthread_mutex_t stats_lock;
+
+  /// MACs positions of the last update
+  struct mse_generation * volatile generation;
+  /// Previous generation. It is kept one more update so the positions
+  /// returned to the user are still valid for a while.
+  struct mse_generation *retired;
+  /// Publication epoch. Readers count themselves in reader_slots[].active[epoch&1]
+  volatile unsigned int epoch;
+  struct mse_reader_slot *reader_slots;
+
   stats_cb_fn *stats_cb;
   void * stats_cb_opaque;
+
+  /* Set at any time, so they are read and written under stats_lock */
+  rb_mse_events_cb_fn *events_cb;
+  void *events_cb_opaque;
+  /// Metres geo coordinates have to move for an event
+  double events_geo_move_m;
+
+  /// Last positions of every MAC. NULL until rb_mse_set_history()
+  struct mse_history * volatile history;
 };
 
+/* ======================================================================= *
+ *                                Timings
+ * ======================================================================= */
+
+static uint64_t mse_now_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+static void mse_stage_add(struct rb_mse_stage_stats *stage,uint64_t us)
+{
+  unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if(bucket >= RB_MSE_HISTOGRAM_BUCKETS)
+    bucket = RB_MSE_HISTOGRAM_BUCKETS - 1;
+
+  stage->last_us += us;
+  stage->count++;
+  stage->total_us += us;
+  if(us > stage->max_us)
+    stage->max_us = us;
+  stage->histogram[bucket]++;
+}
+
+/* Add the samples of src to dst */
+static void mse_stage_merge(struct rb_mse_stage_stats *dst,const struct rb_mse_stage_stats *src)
+{
+  size_t i;
+  dst->count += src->count;
+  dst->total_us += src->total_us;
+  if(src->max_us > dst->max_us)
+    dst->max_us = src->max_us;
+  for(i=0;i<RB_MSE_HISTOGRAM_BUCKETS;++i)
+    dst->histogram[i] += src->histogram[i];
+}
+
+/* Account an update in the timings readers see */
+static void mse_timings_add_update(struct mse_timings *timings,const struct mse_update_timings *update,bool ok)
+{
+  struct rb_mse_update_stats *totals = &timings->totals;
+  size_t i;
+
+  pthread_mutex_lock(&timings->lock);
+  if(++timings->window_updates > MSE_TIMINGS_WINDOW)
+  {
+    timings->current_window ^= 1;
+    timings->window_updates = 1;
+    memset(timings->windows[timings->current_window],0,sizeof(timings->windows[0]));
+  }
+
+  for(i=0;i<RB_MSE_STAGES;++i)
+  {
+    mse_stage_merge(&timings->windows[timings->current_window][i],&update->stages[i]);
+    totals->stages[i].last_us = update->stages[i].last_us;
+  }
+
+  totals->updates++;
+  totals->failed_updates += !ok;
+  totals->pages += update->pages;
+  totals->failed_pages += update->failed_pages;
+  totals->bytes_received += update->bytes_received;
+  totals->bytes_parsed += update->bytes_parsed;
+  totals->last_pages = update->pages;
+  totals->last_failed_pages = update->failed_pages;
+  totals->last_bytes_received = update->bytes_received;
+  totals->last_bytes_parsed = update->bytes_parsed;
+  pthread_mutex_unlock(&timings->lock);
+}
+
+#if LIBCURL_VERSION_NUM >= 0x073d00 /* 7.61.0 */
+#define mse_curl_getinfo_us(hnd,info,us) do { curl_off_t t_ = 0; \
+    curl_easy_getinfo(hnd,info##_T,&t_); *(us) = t_ > 0 ? t_ : 0; } while(0)
+#else
+#define mse_curl_getinfo_us(hnd,info,us) do { double t_ = 0; \
+    curl_easy_getinfo(hnd,info,&t_); *(us) = t_ > 0 ? t_*1e6 : 0; } while(0)
+#endif
+
+/* Account the download of a page */
+static void mse_timings_add_page(struct mse_update_timings *timings,const struct mse_transfer *transfer)
+{
+  CURL *hnd = transfer->hnd;
+  uint64_t namelookup,connect,appconnect,pretransfer,starttransfer,total;
+  long new_connections = 0;
+
+  mse_curl_getinfo_us(hnd,CURLINFO_NAMELOOKUP_TIME,&namelookup);
+  mse_curl_getinfo_us(hnd,CURLINFO_CONNECT_TIME,&connect);
+  mse_curl_getinfo_us(hnd,CURLINFO_APPCONNECT_TIME,&appconnect);
+  mse_curl_getinfo_us(hnd,CURLINFO_PRETRANSFER_TIME,&pretransfer);
+  mse_curl_getinfo_us(hnd,CURLINFO_STARTTRANSFER_TIME,&starttransfer);
+  mse_curl_getinfo_us(hnd,CURLINFO_TOTAL_TIME,&total);
+  curl_easy_getinfo(hnd,CURLINFO_NUM_CONNECTS,&new_connections);
+
+  /* Times are since the start of the transfer */
+  if(new_connections > 0)
+  {
+    mse_stage_add(&timings->stages[RB_MSE_STAGE_DNS],namelookup);
+    mse_stage_add(&timings->stages[RB_MSE_STAGE_CONNECT],connect > namelookup ? connect - namelookup : 0);
+    if(appconnect > 0)
+      mse_stage_add(&timings->stages[RB_MSE_STAGE_TLS],appconnect > connect ? appconnect - connect : 0);
+  }
+  mse_stage_add(&timings->stages[RB_MSE_STAGE_FIRST_BYTE],
+    starttransfer > pretransfer ? starttransfer - pretransfer : 0);
+  mse_stage_add(&timings->stages[RB_MSE_STAGE_TRANSFER],total > starttransfer ? total - starttransfer : 0);
+
+#if LIBCURL_VERSION_NUM >= 0x073700 /* 7.55.0 */
+  curl_off_t received = 0;
+  curl_easy_getinfo(hnd,CURLINFO_SIZE_DOWNLOAD_T,&received);
+#else
+  double received = 0;
+  curl_easy_getinfo(hnd,CURLINFO_SIZE_DOWNLOAD,&received);
+#endif
+  timings->bytes_received += received > 0 ? received : 0;
+}
+
+/* Account a processed page */
+static void mse_timings_add_parsed(struct mse_update_timings *timings,uint64_t parse_us,uint64_t insert_us,
+  size_t bytes)
+{
+  mse_stage_add(&timings->stages[RB_MSE_STAGE_PARSE],parse_us);
+  mse_stage_add(&timings->stages[RB_MSE_STAGE_INSERT],insert_us);
+  timings->pages++;
+  timings->bytes_parsed += bytes;
+}
+
 /*
  *                               CURL CALLBACKS
  */
@@ -126,9 +518,16 @@ struct rb_mse_api
 static size_t write_function( char *ptr, size_t size, size_t nmemb, void *userdata)
 {
   assert(userdata);
-  struct rb_mse_api * rb_mse = (struct rb_mse_api *)userdata;
+  struct mse_transfer * transfer = (struct mse_transfer *)userdata;
+
+  if(transfer->page)
+    return 0 == strbuffer_append_bytes(&transfer->page->body,ptr,nmemb*size) ? size*nmemb : 0;
 
-  const int ret = strbuffer_append_bytes(&rb_mse->buffer,ptr,nmemb*size);
+  const uint64_t start = mse_now_us();
+  const int ret = mse_parser_feed(&transfer->parser,ptr,nmemb*size);
+  transfer->feed_us += mse_now_us() - start;
+  if(ret != 0)
+    rdbg("Malformed MSE response near byte %zu",mse_parser_offset(&transfer->parser));
 
   return ret==0 ? size*nmemb : 0;
 }
@@ -168,10 +567,10 @@ static void curl_setopts(CURL * hnd)
   curl_easy_setopt(hnd, CURLOPT_TIMEOUT, 0);
   curl_easy_setopt(hnd, CURLOPT_REFERER, NULL);
   curl_easy_setopt(hnd, CURLOPT_AUTOREFERER, 0);
-  curl_easy_setopt(hnd, CURLOPT_USERAGENT, "curl/7.19.7 (x86_64-redhat-linux-gnu) libcurl/7.23.1 OpenSSL/1.0.1c zlib/1.2.6");
+  curl_easy_setopt(hnd, CURLOPT_USERAGENT, "rb_mse_api libcurl/" LIBCURL_VERSION);
   curl_easy_setopt(hnd, CURLOPT_FTPPORT, NULL);
-  curl_easy_setopt(hnd, CURLOPT_LOW_SPEED_LIMIT, 0);
-  curl_easy_setopt(hnd, CURLOPT_LOW_SPEED_TIME, 0);
+  curl_easy_setopt(hnd, CURLOPT_LOW_SPEED_LIMIT, 1);
+  curl_easy_setopt(hnd, CURLOPT_LOW_SPEED_TIME, MSE_LOW_SPEED_TIME);
   curl_easy_setopt(hnd, CURLOPT_MAX_SEND_SPEED_LARGE, (curl_off_t)0);
   curl_easy_setopt(hnd, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)0);
   curl_easy_setopt(hnd, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
@@ -205,8 +604,9 @@ static void curl_setopts(CURL * hnd)
   curl_easy_setopt(hnd, CURLOPT_TELNETOPTIONS, NULL);
   curl_easy_setopt(hnd, CURLOPT_RANDOM_FILE, NULL);
   curl_easy_setopt(hnd, CURLOPT_EGDSOCKET, NULL);
-  curl_easy_setopt(hnd, CURLOPT_CONNECTTIMEOUT, 0);
-  curl_easy_setopt(hnd, CURLOPT_ENCODING, NULL);
+  curl_easy_setopt(hnd, CURLOPT_CONNECTTIMEOUT, MSE_CONNECT_TIMEOUT);
+  /* Every encoding curl supports. Curl inflates it before write_function */
+  curl_easy_setopt(hnd, CURLOPT_ACCEPT_ENCODING, "");
   curl_easy_setopt(hnd, CURLOPT_FTP_CREATE_MISSING_DIRS, 0);
   curl_easy_setopt(hnd, CURLOPT_IPRESOLVE, 0);
   curl_easy_setopt(hnd, CURLOPT_FTP_ACCOUNT, NULL);
@@ -218,28 +618,281 @@ static void curl_setopts(CURL * hnd)
   /* curl_easy_setopt(hnd, CURLOPT_SOCKOPTFUNCTION, 0x405c90); [REMARK] */
   /* curl_easy_setopt(hnd, CURLOPT_SOCKOPTDATA, 0x7fff57485670); [REMARK] */
   curl_easy_setopt(hnd, CURLOPT_POSTREDIR, 0);
+
+  /* Keep the connections to the MSE alive between updates */
+  curl_easy_setopt(hnd, CURLOPT_FORBID_REUSE, 0);
+  curl_easy_setopt(hnd, CURLOPT_FRESH_CONNECT, 0);
+  curl_easy_setopt(hnd, CURLOPT_TCP_NODELAY, 1);
+  curl_easy_setopt(hnd, CURLOPT_TCP_KEEPALIVE, 1);
+  curl_easy_setopt(hnd, CURLOPT_TCP_KEEPIDLE, MSE_TCP_KEEPIDLE);
+  curl_easy_setopt(hnd, CURLOPT_TCP_KEEPINTVL, MSE_TCP_KEEPINTVL);
+#if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+  /* HTTP/2 if the MSE offers it in the TLS handshake, so all the pages of an
+     update go through the same connection */
+  curl_easy_setopt(hnd, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(hnd, CURLOPT_PIPEWAIT, 1);
+#endif
 }
 
 static void *rb_mse_autoupdate(void *rb_mse); /* FW declaration */
 
-/* Note: this function assumes rb_mse->avl_memctx_rwlock is locked */
-static void rb_mse_clean(struct rb_mse_api * rb_mse)
+/* ======================================================================= *
+ *                              Scheduling
+ * ======================================================================= */
+
+static int64_t mse_now_ms(void)
+{
+  return mse_now_us()/1000;
+}
+
+/* base_ms*2^attempt, up to max_ms, with equal jitter: half of it is random so
+   the clients that failed at the same time do not retry at the same time */
+static int64_t mse_backoff_ms(unsigned int *seed,int64_t base_ms,unsigned int attempt,int64_t max_ms)
+{
+  int64_t delay = base_ms;
+  while(attempt-- > 0 && delay < max_ms)
+    delay *= 2;
+  if(delay > max_ms)
+    delay = max_ms;
+  return delay - delay/2 + rand_r(seed) % (delay/2 + 1);
+}
+
+static bool rb_mse_exiting(const struct rb_mse_api *rb_mse)
+{
+  return rb_mse->exiting || rd_currthread_get()->rdt_state == RD_THREAD_S_EXITING;
+}
+
+/* Sleep ms milliseconds, or until the instance is destroyed */
+static void rb_mse_wait(struct rb_mse_api *rb_mse,int64_t ms)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC,&deadline);
+  deadline.tv_sec += ms/1000;
+  deadline.tv_nsec += (ms%1000)*1000000;
+  if(deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&rb_mse->wait_lock);
+  while(!rb_mse->exiting
+    && ETIMEDOUT != pthread_cond_timedwait(&rb_mse->wait_cond,&rb_mse->wait_lock,&deadline));
+  pthread_mutex_unlock(&rb_mse->wait_lock);
+}
+
+/**
+  Time to wait before the next update.
+  Updates start every interval_ms, but the thread always rests at least as
+  long as the last update took, so a slow MSE is not polled back to back.
+  If nothing changed, the interval grows towards max_update_time, and it
+  goes back to update_time as soon as positions change. Failed updates are
+  retried with exponential backoff.
+  @param rb_mse   rb_mse_api struct that hold all curl information
+  @param ok       Last update was published
+  @param duration Milliseconds the last update took
+*/
+static int64_t rb_mse_next_update_delay(struct rb_mse_api *rb_mse,bool ok,int64_t duration)
+{
+  const int64_t update_ms = rb_mse->update_time > 0 ? rb_mse->update_time*1000 : 1000;
+  const int64_t max_update_ms = rb_mse->max_update_time*1000 > update_ms ? rb_mse->max_update_time*1000 : update_ms;
+
+  if(!ok)
+  {
+    const int64_t max_backoff = MSE_UPDATE_MAX_BACKOFF*1000 > update_ms ? MSE_UPDATE_MAX_BACKOFF*1000 : update_ms;
+    return mse_backoff_ms(&rb_mse->rand_seed,update_ms,rb_mse->failures++,max_backoff);
+  }
+  rb_mse->failures = 0;
+
+  /* Updates built from scratch count their changes against the last update
+     too (mse_generation_sweep), so rebuilds do not reset the interval */
+  const struct mse_generation *generation = rb_mse->generation;
+  const struct rb_mse_stats *stats = &generation->stats;
+  const size_t changes = stats->number_of_macs_added + stats->number_of_macs_changed
+                                                    + stats->number_of_macs_removed;
+  if(rb_mse->interval_ms < update_ms || changes*MSE_IDLE_CHANGE_RATIO >= generation->live + 1)
+    rb_mse->interval_ms = update_ms;
+  else
+    rb_mse->interval_ms = rb_mse->interval_ms*3/2 < max_update_ms ? rb_mse->interval_ms*3/2 : max_update_ms;
+
+  return rb_mse->interval_ms - duration > duration ? rb_mse->interval_ms - duration : duration;
+}
+
+/* ======================================================================= *
+ *                          Generations publication
+ * ======================================================================= */
+
+static void *mse_generation_copy_record(void *record,void *opaque)
+{
+  const struct mse_generation *const *generations = opaque;
+  return record ? mse_records_copy_of(&generations[0]->records,&generations[1]->records,record) : NULL;
+}
+
+/* Start generation with the records, index and stats of previous */
+static int mse_generation_copy(struct mse_generation *generation,const struct mse_generation *previous)
+{
+  const struct mse_generation *generations[] = {generation,previous};
+
+  if(0 != mse_records_copy(&generation->records,&previous->records))
+    return -1;
+  if(0 != mse_index_copy(&generation->index,&previous->index))
+    return -1;
+
+  mse_index_map_values(&generation->index,mse_generation_copy_record,generations);
+  generation->live = previous->live;
+  generation->stats = previous->stats;
+  return 0;
+}
+
+/* New generation, with fields_size bytes after every record. If delta, it
+   starts as a copy of previous (if not NULL). Else it is empty, but sized for
+   the previous number of entries. */
+static struct mse_generation *mse_generation_new(const struct mse_generation *previous,bool delta,
+  size_t fields_size)
+{
+  struct mse_generation *generation = calloc(1,sizeof(*generation));
+  if(NULL == generation)
+    return NULL;
+
+  generation->refcnt = 1;
+  mse_geo_index_init(&generation->geo);
+  mse_occupancy_init(&generation->occupancy);
+  mse_filter_init(&generation->filter);
+  const size_t expected_entries = previous ? previous->live : 0;
+  mse_records_init(&generation->records,expected_entries,fields_size);
+
+  const bool copy = delta && previous && NULL == previous->stale
+    && (previous->records.count - previous->live)*MSE_COMPACT_RATIO <= previous->records.count;
+  const int rc = copy ? mse_generation_copy(generation,previous)
+                      : mse_index_init(&generation->index,expected_entries);
+  generation->delta = copy;
+  if(0 != rc)
+  {
+    mse_index_close(&generation->index);
+    mse_records_close(&generation->records);
+    free(generation);
+    return NULL;
+  }
+
+  generation->stats.number_of_macs_added = 0;
+  generation->stats.number_of_macs_changed = 0;
+  generation->stats.number_of_macs_removed = 0;
+  return generation;
+}
+
+static void mse_generation_destroy(struct mse_generation *generation)
+{
+  if(NULL == generation)
+    return;
+
+  mse_geo_index_close(&generation->geo);
+  mse_occupancy_close(&generation->occupancy);
+  mse_filter_close(&generation->filter);
+  mse_index_close(&generation->index);
+  mse_records_close(&generation->records);
+  if(generation->stale)
+  {
+    mse_location_dict_close(&generation->stale->dict);
+    rd_memctx_freeall(&generation->stale->memctx);
+    rd_memctx_destroy(&generation->stale->memctx);
+    free(generation->stale);
+  }
+  free(generation);
+}
+
+static void mse_generation_get(struct mse_generation *generation)
+{
+  __atomic_add_fetch(&generation->refcnt,1,__ATOMIC_RELAXED);
+}
+
+/* Drop a reference, and free the generation if it was the last one */
+static void mse_generation_put(struct mse_generation *generation)
+{
+  if(generation && 0 == __atomic_sub_fetch(&generation->refcnt,1,__ATOMIC_ACQ_REL))
+    mse_generation_destroy(generation);
+}
+
+static unsigned int mse_reader_slot_next = 0;
+static __thread unsigned int mse_reader_slot_id = UINT_MAX;
+
+/// Read section: the generation read can't be freed until it ends
+struct mse_read_section
+{
+  volatile long *active;
+  const struct mse_generation *generation;
+};
+
+static inline struct mse_reader_slot *mse_reader_slot(const struct rb_mse_api *rb_mse)
+{
+  if(unlikely(mse_reader_slot_id == UINT_MAX))
+    mse_reader_slot_id = __atomic_fetch_add(&mse_reader_slot_next,1,__ATOMIC_RELAXED) % MSE_READER_SLOTS;
+  return &rb_mse->reader_slots[mse_reader_slot_id];
+}
+
+/* Pin the current generation. Readers only write in their own slot */
+static inline void mse_read_lock(const struct rb_mse_api *rb_mse, struct mse_read_section *section)
+{
+  struct mse_reader_slot *slot = mse_reader_slot(rb_mse);
+  const unsigned int epoch = __atomic_load_n(&rb_mse->epoch,__ATOMIC_SEQ_CST);
+
+  section->active = &slot->active[epoch & 1];
+  __atomic_fetch_add(section->active,1,__ATOMIC_SEQ_CST);
+  section->generation = __atomic_load_n(&rb_mse->generation,__ATOMIC_SEQ_CST);
+}
+
+static inline void mse_read_unlock(struct mse_read_section *section)
+{
+  __atomic_fetch_sub(section->active,1,__ATOMIC_RELEASE);
+}
+
+/* Wait for all readers of the given epoch parity to leave their section */
+static void mse_wait_readers(struct rb_mse_api *rb_mse, unsigned int parity)
+{
+  size_t i;
+  for(i=0;i<MSE_READER_SLOTS;++i)
+    while(__atomic_load_n(&rb_mse->reader_slots[i].active[parity],__ATOMIC_SEQ_CST) > 0)
+      sched_yield();
+}
+
+/**
+  Wait until every read section that could have seen the previous generation
+  has ended. A reader could have loaded the epoch just before the last flip
+  and counted itself in the old parity after we checked it, so, like SRCU,
+  we flip and drain twice.
+  */
+static void mse_synchronize_readers(struct rb_mse_api *rb_mse)
+{
+  int i;
+  for(i=0;i<2;++i)
+  {
+    const unsigned int old_epoch = __atomic_fetch_add(&rb_mse->epoch,1,__ATOMIC_SEQ_CST);
+    mse_wait_readers(rb_mse,old_epoch & 1);
+  }
+}
+
+/* Make new generation visible to readers. Return the generation before the
+   last one, that no read section can be using anymore, so its reference
+   can be dropped. Snapshots could still hold it. */
+static struct mse_generation *mse_generation_publish(struct rb_mse_api *rb_mse, struct mse_generation *generation)
 {
-  strbuffer_close(&rb_mse->buffer);
-  rd_memctx_freeall(rb_mse->memctx);
-  // rd_memctx_destroy(&rb_mse->memctx);
-  rd_avl_destroy(rb_mse->avl);
-  rb_mse->avl = rd_avl_init(NULL,mse_positions_cmp, 0);
+  struct mse_generation *old_generation = __atomic_exchange_n(&rb_mse->generation,generation,__ATOMIC_SEQ_CST);
+  mse_synchronize_readers(rb_mse);
+  struct mse_generation *expired = rb_mse->retired;
+  rb_mse->retired = old_generation;
+  return expired;
 }
 
-static bool extract_mac_address(struct mse_positions_list_node *node, json_t *macAddress)
+static bool extract_mac_address(uint64_t *mac, const struct mse_parser_entry *entry)
 {
-  assert(node);
-  assert(macAddress);
-  if(json_is_string(macAddress))
+  assert(mac);
+  assert(entry);
+  if(entry->mac_address)
   {
-    const char * char_macAddress=json_string_value(macAddress);
-    node->mac = mac_from_str(char_macAddress);
+    if(0 != mse_mac_parse(entry->mac_address,mac))
+    {
+      rdbg("Invalid macAddress %s",entry->mac_address);
+      return false;
+    }
     return true;
   }
   else
@@ -249,27 +902,17 @@ static bool extract_mac_address(struct mse_positions_list_node *node, json_t *ma
   }
 }
 
-static bool process_map_info(struct mse_positions_list_node *node, json_t *mapInfo, rd_memctx_t *memctx)
+static bool process_map_info(struct rb_mse_api_pos *position, const struct mse_parser_entry *entry, struct mse_location_dict *locations)
 {
-  if(mapInfo && json_is_object(mapInfo))
+  position->location = &mse_location_none;
+  if(entry->map_info)
   {
-    json_t *mapHierarchyString = json_object_get(mapInfo,"mapHierarchyString");
-    if(mapHierarchyString && json_is_string(mapHierarchyString))
+    if(entry->map_hierarchy)
     {
-      const char *mapHierarchyString_str = json_string_value(mapHierarchyString);
-
-      if(NULL==mapHierarchyString_str)
-        return false;
-
-      char * map_string = rd_memctx_strdup(memctx,mapHierarchyString_str); // Will free() with pos
-      if(map_string)
+      const struct rb_mse_api_location *location = mse_location_dict_get(locations,entry->map_hierarchy);
+      if(location)
       {
-        char * aux;
-        node->position->zone  = strtok_r(map_string,">",&aux);
-        if(node->position->zone)
-          node->position->build = strtok_r(NULL,">",&aux);
-        if(node->position->build)
-          node->position->floor = strtok_r(NULL,">",&aux);
+        position->location = location;
       }
       else
       {
@@ -291,151 +934,231 @@ static bool process_map_info(struct mse_positions_list_node *node, json_t *mapIn
   }
 }
 
-static bool process_geo_coordinate(struct mse_positions_list_node *node, json_t *geoCoordinate, rd_memctx_t *memctx)
+static bool process_geo_coordinate(struct rb_mse_api_pos *position, const struct mse_parser_entry *entry, struct mse_location_dict *locations)
 {
-  assert(node);
-  if(geoCoordinate)
+  assert(position);
+  if(entry->geo)
   {
-    json_t *lattitude = json_object_get(geoCoordinate,"lattitude");
-    json_t *longitude = json_object_get(geoCoordinate,"longitude");
-    json_t *unit = json_object_get(geoCoordinate,"unit");
-
-    node->position->geo.geo_valid = 1;    
-    node->position->geo.lattitude = lattitude ? json_real_value(lattitude) : 0;
-    node->position->geo.longitude = longitude ? json_real_value(longitude) : 0;
-    node->position->geo.unit = unit && json_is_string(unit) ? rd_memctx_strdup(memctx,json_string_value(unit)) : NULL;
+    position->lattitude = entry->lattitude;
+    position->longitude = entry->longitude;
+    position->unit = entry->geo_unit ? mse_location_dict_intern(locations,entry->geo_unit) : NULL;
+    return true;
   }
   else
   {
     // rdbg("Could not locate geoCoordinate element.\n");
-    node->position->geo.geo_valid = 0;
+    position->lattitude = position->longitude = 0;
+    position->unit = NULL;
+    return false;
   }
+}
+
+static void mse_stats_count(struct rb_mse_stats *stats,int flags,int delta)
+{
+  const bool map_info = flags & RB_MSE_POS_F_MAP_VALID;
+  const bool geo_info = flags & RB_MSE_POS_F_GEO_VALID;
+
+  if(map_info && geo_info)
+    stats->number_of_macs_map_and_geo_localized += delta;
+  else if(map_info)
+    stats->number_of_macs_map_localized += delta;
+  else if(geo_info)
+    stats->number_of_macs_geo_localized += delta;
+  else
+    stats->number_of_macs_unlocalizables += delta;
+
+  if(flags & RB_MSE_POS_F_CURRENTLY_TRACKED)
+    stats->number_of_macs_currently_tracked += delta;
+  if(flags & RB_MSE_POS_F_NOT_CURRENTLY_TRACKED)
+    stats->number_of_macs_no_currently_tracked += delta;
+}
+
+/* Tracked pages are the most reliable source, so they win over non-tracked
+   ones of the same update. Between pages of the same kind (of different
+   MSEs), the most recently located position wins */
+static bool mse_entry_loses_precedence(const struct rb_mse_api_pos *old_position,bool tracked_pass,
+  uint32_t last_located)
+{
+  if(NULL == old_position || !(old_position->flags & MSE_POS_F_SEEN))
+    return false;
+
+  const bool old_tracked_pass = old_position->flags & MSE_POS_F_TRACKED_PASS;
+  if(old_tracked_pass != tracked_pass)
+    return old_tracked_pass;
+  return last_located < old_position->last_located;
+}
 
-  return node->position->geo.geo_valid;
+/* lastLocatedTime as stored in the positions */
+static uint32_t mse_last_located(const struct mse_parser_entry *entry)
+{
+  if(entry->last_located <= 0)
+    return 0;
+  return entry->last_located > UINT32_MAX ? UINT32_MAX : entry->last_located;
 }
 
-static void process_mse_entry(rd_avl_t *avl,rd_memctx_t *memctx, json_t *entry,struct rb_mse_stats *stats)
+/* Public content of the positions is the same */
+static bool mse_position_equal(const struct rb_mse_api_pos *p1,const struct rb_mse_api_pos *p2)
 {
-  json_t * macAddress = json_object_get(entry,"macAddress");
+  return (p1->flags & MSE_POS_F_PUBLIC) == (p2->flags & MSE_POS_F_PUBLIC)
+    && p1->location == p2->location && p1->unit == p2->unit && p1->mse == p2->mse
+    && p1->lattitude == p2->lattitude && p1->longitude == p2->longitude;
+}
 
-  if(NULL!=macAddress)
+/* Count the change of an entry that is already in the generation, and mark the
+   candidate if it is not the same as the previous update position. A MAC can
+   be received many times in an update (both passes, many MSEs), so only the
+   last accepted entry counts */
+static void mse_entry_count_change(const struct mse_refresh *refresh,const struct rb_mse_api_pos *position,
+  struct rb_mse_api_pos *candidate)
+{
+  const struct rb_mse_api_pos *previous = position;
+  if(position->flags & MSE_POS_F_SEEN)
   {
-    json_t * mapInfo = json_object_get(entry,"MapInfo");
-    json_t * geoCoordinate = json_object_get(entry,"GeoCoordinate");
+    /* Already overwritten in this update */
+    previous = refresh->previous ? mse_index_find(&refresh->previous->index,position->mac) : NULL;
+    if(position->flags & MSE_POS_F_CHANGED)
+      refresh->stats->number_of_macs_changed--;
+  }
 
-    if(NULL!=mapInfo || NULL!=geoCoordinate)
-    {
-      struct mse_positions_list_node * node = rd_memctx_calloc(memctx,1,sizeof(*node));
-      node->position = rd_memctx_calloc(memctx,1,sizeof(*node->position));
-      #ifdef MSE_POSITION_LIST_MAGIC
-      node->magic = MSE_POSITION_LIST_MAGIC;
-      #endif
-      extract_mac_address(node,macAddress);
-      // printf("DEBUG: macAddr: %12lx\tmacAddr: %s\n",node->mac,macAddress);
-
-      const bool map_info_ret = process_map_info(node,mapInfo,memctx);
-      const bool geo_info_ret = process_geo_coordinate(node,geoCoordinate,memctx);
-
-      if(stats)
-      {
-        if(false==map_info_ret && false==geo_info_ret)
-          rb_mse_stats_number_of_macs_unlocalizables(stats)++;
-        if(false==map_info_ret && true==geo_info_ret)
-          rb_mse_stats_number_of_macs_geo_localized(stats)++;
-        if(true==map_info_ret && false==geo_info_ret)
-          rb_mse_stats_number_of_macs_map_localized(stats)++;
-        if(true==map_info_ret && true==geo_info_ret)
-          rb_mse_stats_number_of_macs_map_and_geo_localized(stats)++;
-
-        json_t *json_currently_tracked = json_object_get(entry,"currentlyTracked");
-        if(json_currently_tracked)
-        {
-          if(json_is_true(json_currently_tracked))
-          {
-            stats->number_of_macs_currently_tracked++;
-            node->position->currently_tracked = 1;
-          }
-          else if(json_is_false(json_currently_tracked))
-          {
-            stats->number_of_macs_no_currently_tracked++;
-            node->position->currently_tracked = 0;
-          }
-          else
-            rdbg("currentlyTracked is neither true nor false");
-        }
-      }
+  if(previous && !mse_position_equal(previous,candidate))
+  {
+    refresh->stats->number_of_macs_changed++;
+    candidate->flags |= MSE_POS_F_CHANGED;
+  }
+}
 
-      // rdbg("Inserting node %lx: %s\n",node->mac,map_string);
-      RD_AVL_INSERT(avl,node,rd_avl_node);
-    }
-    else
-    {
-      rdbg("Could not found neither \"MapInfo\" nor \"GeoCoordinate\"");
-    }
+/* MAC of an entry, if it has a position */
+static bool mse_entry_mac(const struct mse_parser_entry *entry,uint64_t *mac)
+{
+  if(NULL == entry->mac_address)
+    return false;
+  if(!entry->map_info && !entry->geo)
+  {
+    rdbg("Could not found neither \"MapInfo\" nor \"GeoCoordinate\"");
+    return false;
   }
+  return extract_mac_address(mac,entry);
 }
 
-static void process_mse_response(strbuffer_t *buffer,rd_avl_t *avl,rd_memctx_t *memctx,struct rb_mse_stats *stats,json_t **root)
+/* Add an entry to the update, if it wins over the one already received */
+static void mse_refresh_apply_entry(struct mse_refresh *refresh, uint64_t mac,
+  const struct mse_parser_entry *entry, unsigned int server, bool tracked_pass)
 {
-  assert(root);
-  json_error_t error;
-  const char * text = strbuffer_value(buffer);
-  *root = json_loads(text, 0, &error);
-  if(root)
+  struct mse_index *index = refresh->index;
+  struct rb_mse_stats *stats = refresh->stats;
+
+  bool found = false;
+  void **index_slot = mse_index_upsert(index,mac,&found);
+  if(NULL == index_slot)
   {
-    json_t *locations = json_object_get(*root, "Locations");
-    if(locations)
-    {
-      json_t *entries = json_object_get(locations, "entries");
-      if(entries)
-      {
-        if(json_is_array(entries))
-        {
-          unsigned int i;
-          for(i = 0; i < json_array_size(entries); i++)
-          {
-            json_t *entry= json_array_get(entries, i);
-            if(entry && json_is_object(entry))
-            {
-              process_mse_entry(avl,memctx,entry,stats);
-            }
-            else
-            {
-              rdbg("Could not get %d element of %s",i, "entries");
-            }
-          } /* for */
-        }
-        else
-        {
-          rdbg("Entries is not an array");
-        }
-      }
-      else
-      {
-        rdbg("Cannot find entries array");
-      }
-    }
-    else
+    rdbg("Memory error");
+    return;
+  }
+
+  struct rb_mse_api_pos *position = found ? *index_slot : NULL;
+  const uint32_t last_located = mse_last_located(entry);
+  if(mse_entry_loses_precedence(position,tracked_pass,last_located))
+    return;
+
+  struct rb_mse_api_pos candidate = {.mac = mac, .last_located = last_located, .mse = server};
+  unsigned int flags = MSE_POS_F_SEEN | (tracked_pass ? MSE_POS_F_TRACKED_PASS : 0);
+  // printf("DEBUG: macAddr: %12lx\tmacAddr: %s\n",mac,macAddress);
+
+  if(process_map_info(&candidate,entry,refresh->locations))
+    flags |= RB_MSE_POS_F_MAP_VALID;
+  if(process_geo_coordinate(&candidate,entry,refresh->locations))
+    flags |= RB_MSE_POS_F_GEO_VALID;
+
+  if(1 == entry->currently_tracked)
+    flags |= RB_MSE_POS_F_CURRENTLY_TRACKED;
+  else if(0 == entry->currently_tracked)
+    flags |= RB_MSE_POS_F_NOT_CURRENTLY_TRACKED;
+  candidate.flags = flags;
+
+  if(position)
+  {
+    /* Not published yet, so it can be overwritten in place */
+    mse_entry_count_change(refresh,position,&candidate);
+    mse_stats_count(stats,position->flags,-1);
+    candidate.flags |= position->flags & MSE_POS_F_ADDED;
+  }
+  else
+  {
+    position = mse_records_new(refresh->records);
+    if(NULL == position)
     {
-      rdbg("Could not get locations node");
+      rdbg("Memory error");
+      return;
     }
+    *index_slot = position;
+    (*refresh->live)++;
+    stats->number_of_macs_added++;
+    candidate.flags |= MSE_POS_F_ADDED;
   }
-  else
+
+  *position = candidate;
+  mse_fields_write(position,refresh->fields,entry,refresh->locations);
+  mse_stats_count(stats,candidate.flags,1);
+}
+
+static void process_mse_entry(struct mse_refresh *refresh, const struct mse_parser_entry *entry,
+  unsigned int server, bool tracked_pass)
+{
+  uint64_t mac;
+  if(mse_entry_mac(entry,&mac))
+    mse_refresh_apply_entry(refresh,mac,entry,server,tracked_pass);
+}
+
+/* Expect the records of a pass of a MSE, once we know its size. Records of
+   both passes of all MSEs are expected, so we can allocate them in one block */
+static void mse_refresh_expect_pages(struct mse_refresh *refresh, struct mse_server *server, bool tracked_pass,
+  int64_t total_pages, int64_t page_size)
+{
+  if(!server->sized[tracked_pass] && total_pages > 0 && page_size > 0)
   {
-    rdbg("Could not get root node");
+    server->sized[tracked_pass] = true;
+    refresh->expected_records += total_pages * page_size;
+    mse_records_expect(refresh->records,refresh->expected_records);
   }
 }
 
-static CURLcode rb_mse_set_curl_url(struct rb_mse_api *rb_mse, bool currently_tracked, int page)
+/* Parser callback: every entry goes to the new positions as soon as it is read */
+static void mse_transfer_entry_cb(const struct mse_parser_entry *entry, void *opaque)
+{
+  struct mse_transfer *transfer = opaque;
+  struct mse_refresh *refresh = transfer->refresh;
+  const struct mse_parser *parser = &transfer->parser;
+  assert(transfer->req);
+  const bool tracked_pass = transfer->req->currently_tracked;
+
+  mse_refresh_expect_pages(refresh,transfer->server,tracked_pass,parser->total_pages,parser->page_size);
+
+  const uint64_t start = mse_now_us();
+  process_mse_entry(refresh,entry,transfer->req->server,tracked_pass);
+  transfer->insert_us += mse_now_us() - start;
+}
+
+/* Workers parser callback: entries wait in the page until the updater applies it */
+static void mse_page_entry_cb(const struct mse_parser_entry *entry, void *opaque)
+{
+  struct mse_page *page = opaque;
+  uint64_t mac;
+  if(mse_entry_mac(entry,&mac) && 0 != mse_page_add_entry(page,mac,entry))
+    rdbg("Memory error");
+}
+
+static CURLcode rb_mse_set_curl_url(const struct mse_server *server, CURL *hnd, bool currently_tracked, int page)
 {
   CURLcode ret;
-  if(rb_mse->mse_url)
+  if(server->url)
   {
-    const char * url_ts = rd_tsprintf("https://%s/%s?currentlyTracked=%s&page=%d",
-      rb_mse->mse_url,mse_api_call_url,currently_tracked?"true":"false",page);
+    /* HTTPS unless the address brings its own scheme */
+    const char *scheme = strstr(server->url,"://") ? "" : "https://";
+    const char * url_ts = rd_tsprintf("%s%s/%s?currentlyTracked=%s&page=%d",
+      scheme,server->url,mse_api_call_url,currently_tracked?"true":"false",page);
     rdbg("Url generated: %s",url_ts);
     if(url_ts){
-      ret =  curl_easy_setopt(rb_mse->hnd, CURLOPT_URL, url_ts);
+      ret =  curl_easy_setopt(hnd, CURLOPT_URL, url_ts);
     }else{
       ret = CURLE_OUT_OF_MEMORY;
     }
@@ -450,232 +1173,1648 @@ static CURLcode rb_mse_set_curl_url(struct rb_mse_api *rb_mse, bool currently_tr
   return ret;
 }
 
-static bool has_more_pages(json_t *root)
-{
-  const json_t * locations = json_object_get(root, "Locations");
-  if(locations)
-    return NULL!=json_object_get(locations,"nextResourceURI");
-  else
-    rdbg("Cannot get locations");
-  return false;
-}
+/* First page we ask for in every pass. The MSE tell us the pages left in it */
+#define MSE_FIRST_PAGE 0
 
-static void get_and_process_mse_response0(struct rb_mse_api *rb_mse, bool currently_tracked, rd_avl_t *avl, rd_memctx_t *memctx, struct rb_mse_stats *stats)
+static void mse_refresh_queue_page(struct mse_refresh *refresh, unsigned int server, bool currently_tracked, int page)
 {
-  bool more_pages = true;
-  int current_page = 0;
+  struct mse_page_req *req = calloc(1,sizeof(*req));
+  if(NULL == req)
+  {
+    rdbg("Memory error");
+    refresh->failed = true;
+    return;
+  }
+
+  req->server = server;
+  req->currently_tracked = currently_tracked;
+  req->page = page;
+  TAILQ_INSERT_TAIL(&refresh->pending,req,entry);
+}
+
+static void mse_refresh_queue_next_pages(struct mse_refresh *refresh, const struct mse_page_req *req,
+  int64_t total_pages, int64_t current_page, bool next_resource)
+{
+  if(total_pages > 0 && current_page >= 0)
+  {
+    if(req->page == MSE_FIRST_PAGE)
+    {
+      /* MSE could number the pages from 0 or from 1, so we trust in currentPage */
+      int64_t page;
+      for(page = current_page + 1; page < current_page + total_pages; page++)
+        mse_refresh_queue_page(refresh,req->server,req->currently_tracked,page);
+    }
+  }
+  else if(next_resource)
+  {
+    /* We don't know how many pages are there, so we have to walk them one by one */
+    mse_refresh_queue_page(refresh,req->server,req->currently_tracked,req->page + 1);
+  }
+}
+
+static void mse_refresh_clean_pending(struct mse_refresh *refresh)
+{
+  struct mse_page_req *req;
+  while((req = TAILQ_FIRST(&refresh->pending)))
+  {
+    TAILQ_REMOVE(&refresh->pending,req,entry);
+    free(req);
+  }
+}
+
+/* Curl receive buffer limits. A buffer as big as the page lets the parser get
+   it in a few calls, but many curl versions do not accept more than 512KB */
+#define MSE_RECV_BUFFER_MIN CURL_MAX_WRITE_SIZE
+#define MSE_RECV_BUFFER_MAX (512*1024)
+
+static long mse_recv_buffer_size(const struct rb_mse_api *rb_mse)
+{
+  if(rb_mse->largest_page < MSE_RECV_BUFFER_MIN)
+    return MSE_RECV_BUFFER_MIN;
+  if(rb_mse->largest_page > MSE_RECV_BUFFER_MAX)
+    return MSE_RECV_BUFFER_MAX;
+  return rb_mse->largest_page;
+}
+
+static bool mse_transfer_start(struct rb_mse_api *rb_mse, struct mse_refresh *refresh, struct mse_transfer *transfer, struct mse_page_req *req)
+{
+  /* It can only be changed between transfers, so it is sized from the pages
+     already seen instead of from the Content-Length of this one */
+  curl_easy_setopt(transfer->hnd, CURLOPT_BUFFERSIZE, mse_recv_buffer_size(rb_mse));
+
+  struct mse_server *server = &rb_mse->servers[req->server];
+  const CURLcode url_rc = rb_mse_set_curl_url(server,transfer->hnd,req->currently_tracked,req->page);
+  if(url_rc != CURLE_OK)
+  {
+    rdbg("Cannot set curl url: %s",curl_easy_strerror(url_rc));
+    return false;
+  }
+  curl_easy_setopt(transfer->hnd, CURLOPT_USERPWD, server->userpwd);
+
+  if(rb_mse->workers && NULL == (transfer->page = mse_workers_page_get(rb_mse->workers)))
+  {
+    rdbg("Memory error");
+    return false;
+  }
+
+  const CURLMcode add_rc = curl_multi_add_handle(rb_mse->multi,transfer->hnd);
+  if(add_rc != CURLM_OK)
+  {
+    rdbg("Cannot add curl handler: %s",curl_multi_strerror(add_rc));
+    if(transfer->page)
+      mse_workers_page_put(rb_mse->workers,transfer->page);
+    transfer->page = NULL;
+    return false;
+  }
+
+  mse_parser_reset(&transfer->parser);
+  transfer->req = req;
+  transfer->refresh = refresh;
+  transfer->server = server;
+  transfer->feed_us = transfer->insert_us = 0;
+  return true;
+}
+
+/* Retry a page that could not be downloaded or parsed, or give the update up */
+static void mse_refresh_page_failed(struct rb_mse_api *rb_mse, struct mse_refresh *refresh, struct mse_page_req *req)
+{
+  refresh->timings->failed_pages++;
+  if(++req->attempts < MSE_PAGE_MAX_ATTEMPTS)
+  {
+    req->not_before = mse_now_ms() + mse_backoff_ms(&rb_mse->rand_seed,MSE_PAGE_RETRY_BASE_MS,
+                                                        req->attempts-1,MSE_PAGE_RETRY_MAX_MS);
+    TAILQ_INSERT_TAIL(&refresh->pending,req,entry);
+  }
+  else
+  {
+    rdbg("Giving up %stracked page %d of MSE %s",req->currently_tracked?"":"non ",req->page,
+      rb_mse->servers[req->server].url);
+    refresh->failed = true;
+    free(req);
+  }
+}
+
+/* Page is complete: we know which ones follow it */
+static void mse_refresh_page_done(struct rb_mse_api *rb_mse, struct mse_refresh *refresh, struct mse_page_req *req,
+  size_t size, int64_t total_pages, int64_t current_page, bool next_resource)
+{
+  if(size > rb_mse->largest_page)
+    rb_mse->largest_page = size;
+  mse_refresh_queue_next_pages(refresh,req,total_pages,current_page,next_resource);
+  free(req);
+}
+
+static void mse_transfer_done(struct rb_mse_api *rb_mse, struct mse_refresh *refresh, struct mse_transfer *transfer, CURLcode result)
+{
+  struct mse_page_req *req = transfer->req;
+  struct mse_page *page = transfer->page;
+  const struct mse_parser *parser = &transfer->parser;
+  bool downloaded = false;
+  long http_code = 0;
+
+  transfer->req = NULL;
+  transfer->page = NULL;
+  curl_multi_remove_handle(rb_mse->multi,transfer->hnd);
+  curl_easy_getinfo(transfer->hnd,CURLINFO_RESPONSE_CODE,&http_code);
+
+  if(result != CURLE_OK)
+    rdbg("Cannot perform curl request: %s",curl_easy_strerror(result));
+  else if(http_code >= 400)
+    rdbg("MSE %s returned HTTP code %ld",transfer->server->url,http_code);
+  else
+    downloaded = true;
+
+  if(downloaded && page)
+  {
+    /* Workers parse it, and the updater applies it when they are done */
+    mse_timings_add_page(refresh->timings,transfer);
+    page->opaque = req;
+    mse_workers_submit(rb_mse->workers,page);
+    refresh->parsing++;
+    return;
+  }
+
+  if(page)
+    mse_workers_page_put(rb_mse->workers,page);
+
+  if(downloaded && 0 != mse_parser_finish(&transfer->parser))
+  {
+    rdbg("Incomplete MSE response (%zu bytes)",mse_parser_offset(parser));
+    downloaded = false;
+  }
+
+  if(downloaded)
+  {
+    mse_timings_add_page(refresh->timings,transfer);
+    mse_timings_add_parsed(refresh->timings,
+      transfer->feed_us > transfer->insert_us ? transfer->feed_us - transfer->insert_us : 0,
+      transfer->insert_us,mse_parser_offset(parser));
+    mse_refresh_page_done(rb_mse,refresh,req,mse_parser_offset(parser),parser->total_pages,
+      parser->current_page,parser->next_resource);
+  }
+  else
+  {
+    mse_refresh_page_failed(rb_mse,refresh,req);
+  }
+}
+
+/* Add the entries of a page parsed by the workers to the update */
+static void mse_refresh_apply_page(struct rb_mse_api *rb_mse, struct mse_refresh *refresh, struct mse_page *page)
+{
+  struct mse_page_req *req = page->opaque;
+  struct mse_parser_entry entry;
+  size_t i;
+
+  refresh->parsing--;
+  if(!page->ok)
+  {
+    rdbg("Incomplete MSE response (%zu bytes)",page->parsed);
+    mse_refresh_page_failed(rb_mse,refresh,req);
+    return;
+  }
+
+  const uint64_t start = mse_now_us();
+  mse_refresh_expect_pages(refresh,&rb_mse->servers[req->server],req->currently_tracked,page->total_pages,
+    page->page_size);
+  for(i=0;i<page->entries_count;++i)
+  {
+    mse_page_entry_get(page,&page->entries[i],&entry);
+    mse_refresh_apply_entry(refresh,page->entries[i].mac,&entry,req->server,req->currently_tracked);
+  }
+
+  mse_timings_add_parsed(refresh->timings,page->parse_us,mse_now_us() - start,page->parsed);
+  mse_refresh_page_done(rb_mse,refresh,req,page->parsed,page->total_pages,page->current_page,
+    page->next_resource);
+}
+
+/* Apply the pages the workers have parsed. Return the number of them */
+static size_t mse_refresh_read_parsed(struct rb_mse_api *rb_mse, struct mse_refresh *refresh)
+{
+  size_t parsed = 0;
+  struct mse_page *page;
+
+  while(refresh->parsing > 0 && (page = mse_workers_done(rb_mse->workers,false)))
+  {
+    mse_refresh_apply_page(rb_mse,refresh,page);
+    mse_workers_page_put(rb_mse->workers,page);
+    parsed++;
+  }
+  return parsed;
+}
+
+/* Wait for the pages the workers are still parsing, and drop them */
+static void mse_refresh_drop_parsing(struct rb_mse_api *rb_mse, struct mse_refresh *refresh)
+{
+  for(;refresh->parsing > 0;refresh->parsing--)
+  {
+    struct mse_page *page = mse_workers_done(rb_mse->workers,true);
+    free(page->opaque);
+    mse_workers_page_put(rb_mse->workers,page);
+  }
+}
+
+static void mse_transfer_abort(struct rb_mse_api *rb_mse, struct mse_transfer *transfer)
+{
+  curl_multi_remove_handle(rb_mse->multi,transfer->hnd);
+  free(transfer->req);
+  transfer->req = NULL;
+  if(transfer->page)
+    mse_workers_page_put(rb_mse->workers,transfer->page);
+  transfer->page = NULL;
+}
+
+/* Start as many pending pages as idle transfers we have. Pages waiting for a
+   retry stay in the queue. Return the number of transfers started */
+static size_t mse_refresh_start_pending(struct rb_mse_api *rb_mse, struct mse_refresh *refresh, int64_t now)
+{
+  size_t i,started = 0;
+  struct mse_page_req *req = TAILQ_FIRST(&refresh->pending);
+  for(i=0;i<rb_mse->transfers_size && req;++i)
+  {
+    struct mse_transfer *transfer = &rb_mse->transfers[i];
+    if(transfer->req)
+      continue;
+
+    while(req && req->not_before > now)
+      req = TAILQ_NEXT(req,entry);
+    if(NULL == req)
+      break;
+
+    struct mse_page_req *next = TAILQ_NEXT(req,entry);
+    TAILQ_REMOVE(&refresh->pending,req,entry);
+    if(mse_transfer_start(rb_mse,refresh,transfer,req))
+    {
+      started++;
+    }
+    else
+    {
+      free(req);
+      refresh->failed = true;
+    }
+    req = next;
+  }
+  return started;
+}
+
+/* Milliseconds until a pending page can be requested, up to max_ms */
+static int64_t mse_refresh_next_pending_ms(const struct mse_refresh *refresh, int64_t now, int64_t max_ms)
+{
+  const struct mse_page_req *req;
+  int64_t wait_ms = max_ms;
+  TAILQ_FOREACH(req,&refresh->pending,entry)
+    if(req->not_before - now < wait_ms)
+      wait_ms = req->not_before > now ? req->not_before - now : 0;
+  return wait_ms;
+}
+
+/* Read finished transfers. Return the number of them */
+static size_t mse_refresh_read_done(struct rb_mse_api *rb_mse, struct mse_refresh *refresh)
+{
+  size_t done = 0;
+  int msgs_left = 0;
+  CURLMsg *msg;
+
+  while((msg = curl_multi_info_read(rb_mse->multi,&msgs_left)))
+  {
+    if(msg->msg == CURLMSG_DONE)
+    {
+      struct mse_transfer *transfer = NULL;
+      curl_easy_getinfo(msg->easy_handle,CURLINFO_PRIVATE,(char **)&transfer);
+      assert(transfer);
+      mse_transfer_done(rb_mse,refresh,transfer,msg->data.result);
+      done++;
+    }
+  }
+  return done;
+}
+
+/**
+  Download and process both passes (non-tracked and tracked) of the pages of
+  all the MSEs. We only know how many pages there are when we get the first
+  one of each pass, so we ask for all first pages and, as soon as they arrive,
+  we queue all the others. Up to transfers_size pages are downloaded at the
+  same time. With workers, pages are parsed by them while the next ones are
+  downloaded, and they are applied to the update here as they are ready.
+  @return true if all pages could be processed
+  */
+static bool rb_mse_fetch_all_pages(struct rb_mse_api *rb_mse, struct mse_refresh *refresh)
+{
+  size_t i,running = 0;
+
+  for(i=0;i<rb_mse->servers_size;++i)
+  {
+    memset(rb_mse->servers[i].sized,0,sizeof(rb_mse->servers[i].sized));
+    mse_refresh_queue_page(refresh,i,false,MSE_FIRST_PAGE);
+    mse_refresh_queue_page(refresh,i,true,MSE_FIRST_PAGE);
+  }
+
+  while(!refresh->failed && (running > 0 || !TAILQ_EMPTY(&refresh->pending) || refresh->parsing > 0))
+  {
+    int still_running = 0;
+    running += mse_refresh_start_pending(rb_mse,refresh,mse_now_ms());
+
+    const CURLMcode rc = curl_multi_perform(rb_mse->multi,&still_running);
+    if(rc != CURLM_OK)
+    {
+      rdbg("curl_multi_perform error: %s",curl_multi_strerror(rc));
+      refresh->failed = true;
+      break;
+    }
+
+    const size_t done = mse_refresh_read_done(rb_mse,refresh);
+    running -= done;
+    const size_t parsed = mse_refresh_read_parsed(rb_mse,refresh);
+    if(0 == done && 0 == parsed)
+    {
+      const int64_t wait_ms = mse_refresh_next_pending_ms(refresh,mse_now_ms(),1000);
+      if(refresh->parsing > 0)
+      {
+        struct curl_waitfd parsed_fd = {.fd = mse_workers_fd(rb_mse->workers), .events = CURL_WAIT_POLLIN};
+        curl_multi_wait(rb_mse->multi,&parsed_fd,1,wait_ms,NULL);
+      }
+      else if(running > 0)
+        curl_multi_wait(rb_mse->multi,NULL,0,wait_ms,NULL);
+      else if(wait_ms > 0)
+        rb_mse_wait(rb_mse,wait_ms); /* Only pages waiting for a retry */
+    }
+
+    if(rb_mse_exiting(rb_mse))
+      refresh->failed = true;
+  }
+
+  for(i=0;i<rb_mse->transfers_size;++i)
+    if(rb_mse->transfers[i].req)
+      mse_transfer_abort(rb_mse,&rb_mse->transfers[i]);
+  mse_refresh_drop_parsing(rb_mse,refresh);
+  mse_refresh_clean_pending(refresh);
+
+  return !refresh->failed;
+}
+
+static void mse_transfers_destroy(struct rb_mse_api *rb_mse)
+{
+  size_t i;
+  for(i=0;i<rb_mse->transfers_size;++i)
+  {
+    curl_easy_cleanup(rb_mse->transfers[i].hnd);
+    mse_parser_close(&rb_mse->transfers[i].parser);
+  }
+  free(rb_mse->transfers);
+  rb_mse->transfers = NULL;
+  rb_mse->transfers_size = 0;
+}
+
+static bool mse_transfer_init(struct rb_mse_api *rb_mse, struct mse_transfer *transfer)
+{
+  transfer->hnd = curl_easy_init();
+  if(NULL == transfer->hnd)
+    return false;
+
+  if(0 != mse_parser_init(&transfer->parser,mse_transfer_entry_cb,transfer))
+  {
+    curl_easy_cleanup(transfer->hnd);
+    transfer->hnd = NULL;
+    return false;
+  }
+  mse_parser_set_fields(&transfer->parser,rb_mse->fields);
+
+  curl_easy_setopt(transfer->hnd, CURLOPT_WRITEDATA, transfer);               /* void passed to WRITEFUNCTION */
+  curl_easy_setopt(transfer->hnd, CURLOPT_WRITEFUNCTION, write_function);   /* function called for each data received */ 
+  curl_easy_setopt(transfer->hnd, CURLOPT_PRIVATE, transfer);
+  curl_easy_setopt(transfer->hnd, CURLOPT_HTTPHEADER, rb_mse->slist);
+  if(rb_mse->share)
+    curl_easy_setopt(transfer->hnd, CURLOPT_SHARE, rb_mse->share);
+  curl_setopts(transfer->hnd);
+  return true;
+}
+
+/* (Re)create the easy handlers if the user changed the number of connections */
+static bool mse_transfers_update(struct rb_mse_api *rb_mse)
+{
+  const size_t max_connections = rb_mse->max_connections ? rb_mse->max_connections : 1;
+  size_t i;
+
+  if(max_connections == rb_mse->transfers_size)
+    return true;
+
+  mse_transfers_destroy(rb_mse);
+  rb_mse->transfers = calloc(max_connections,sizeof(rb_mse->transfers[0]));
+  if(NULL == rb_mse->transfers)
+    return false;
+
+  for(i=0;i<max_connections;++i)
+  {
+    if(!mse_transfer_init(rb_mse,&rb_mse->transfers[i]))
+    {
+      mse_transfers_destroy(rb_mse);
+      return false;
+    }
+    rb_mse->transfers_size++;
+  }
+
+  return true;
+}
+
+static void mse_workers_destroy(struct rb_mse_api *rb_mse)
+{
+  if(rb_mse->workers)
+  {
+    mse_workers_close(rb_mse->workers);
+    free(rb_mse->workers);
+    rb_mse->workers = NULL;
+  }
+}
+
+/* (Re)start the workers if the user changed the number of parse threads. If
+   they cannot be started, pages are parsed by the updater thread */
+static void mse_workers_update(struct rb_mse_api *rb_mse)
+{
+  const unsigned int parse_threads = rb_mse->parse_threads;
+  if(parse_threads == (rb_mse->workers ? rb_mse->workers->threads : 0))
+    return;
+
+  mse_workers_destroy(rb_mse);
+  if(0 == parse_threads)
+    return;
+
+  rb_mse->workers = calloc(1,sizeof(*rb_mse->workers));
+  if(NULL == rb_mse->workers || 0 != mse_workers_init(rb_mse->workers,parse_threads,mse_page_entry_cb,
+                                                                 rb_mse->fields))
+  {
+    rdbg("Cannot start %u parse threads. Parsing pages in the updater thread",parse_threads);
+    free(rb_mse->workers);
+    rb_mse->workers = NULL;
+  }
+}
+
+/* Generation of rb_mse with the positions of the positions file */
+static struct mse_generation *mse_generation_load(const struct rb_mse_api *rb_mse,const char *path)
+{
+  struct mse_records_chunk *chunk;
+  size_t i;
+
+  struct mse_generation *generation = calloc(1,sizeof(*generation));
+  struct mse_stale_locations *stale = calloc(1,sizeof(*stale));
+  if(NULL == generation || NULL == stale)
+  {
+    free(generation);
+    free(stale);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  generation->stale = stale;
+  generation->refcnt = 1;
+  rd_memctx_init(&stale->memctx,NULL,RD_MEMCTX_F_TRACK);
+  mse_records_init(&generation->records,0,0);
+  if(0 != mse_location_dict_init(&stale->dict,&stale->memctx)
+    || 0 != mse_index_init(&generation->index,0))
+  {
+    mse_generation_destroy(generation);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  const ssize_t loaded = mse_snapshot_load(path,&generation->records,&generation->index,&stale->dict);
+  if(loaded < 0)
+  {
+    const int errno_bak = errno;
+    mse_generation_destroy(generation);
+    errno = errno_bak;
+    return NULL;
+  }
+
+  generation->live = loaded;
+  mse_records_foreach(&generation->records,chunk,i)
+    mse_stats_count(&generation->stats,mse_records_at(chunk,i)->flags,1);
+  if(0 != mse_geo_index_build(&generation->geo,&generation->records))
+    rdbg("Memory error. Positions file will have no geo index");
+  if(0 != mse_occupancy_build(&generation->occupancy,&generation->records))
+    rdbg("Memory error. Positions file will have no level index");
+  if(0 != mse_filter_build(&generation->filter,&generation->records,rb_mse->filter_bits))
+    rdbg("Memory error. Positions file will have no lookup filter");
+  return generation;
+}
+
+/* ======================================================================= *
+ *                                 Events
+ * ======================================================================= */
+
+/// Events handed to the user at a time
+#define MSE_EVENTS_BATCH 1024
+
+/// Diff of an update against the last one
+struct mse_diff
+{
+  /// Last update. NULL if there is none
+  const struct mse_generation *previous;
+  /// Both updates use the rb_mse_api dictionary, so their location IDs can be compared
+  bool same_ids;
+  /// Collect the events. If not, the diff only counts the changes of updates built from scratch
+  bool collect;
+  double geo_move_m;
+
+  struct rb_mse_event *events;
+  size_t count;
+  size_t size;
+};
+
+static bool mse_location_name_equal(const char *name1,const char *name2)
+{
+  return name1 == name2 || (name1 && name2 && 0 == strcmp(name1,name2));
+}
+
+/* Like mse_position_equal, for positions of different dictionaries (positions
+   file). Stale flag is not a change */
+static bool mse_position_same(const struct mse_diff *diff,const struct rb_mse_api_pos *p1,
+  const struct rb_mse_api_pos *p2)
+{
+  if(diff->same_ids)
+    return mse_position_equal(p1,p2);
+
+  const unsigned int flags_mask = MSE_POS_F_PUBLIC & ~RB_MSE_POS_F_STALE;
+  return (p1->flags & flags_mask) == (p2->flags & flags_mask) && p1->mse == p2->mse
+    && p1->lattitude == p2->lattitude && p1->longitude == p2->longitude
+    && mse_location_name_equal(p1->unit,p2->unit)
+    && mse_location_name_equal(p1->location->zone,p2->location->zone)
+    && mse_location_name_equal(p1->location->build,p2->location->build)
+    && mse_location_name_equal(p1->location->floor,p2->location->floor);
+}
+
+static unsigned int mse_event_location(const struct rb_mse_api_location *location1,
+  const struct rb_mse_api_location *location2,bool same_ids)
+{
+  bool zone,build,floor;
+  if(same_ids)
+  {
+    /* IDs are unique per level, from the zone down */
+    zone = location1->zone_id != location2->zone_id;
+    build = location1->build_id != location2->build_id;
+    floor = location1->floor_id != location2->floor_id;
+  }
+  else
+  {
+    zone = !mse_location_name_equal(location1->zone,location2->zone);
+    build = zone || !mse_location_name_equal(location1->build,location2->build);
+    floor = build || !mse_location_name_equal(location1->floor,location2->floor);
+  }
+
+  return (zone ? RB_MSE_EVENT_ZONE_CHANGED : 0) | (build ? RB_MSE_EVENT_BUILD_CHANGED : 0)
+                                               | (floor ? RB_MSE_EVENT_FLOOR_CHANGED : 0);
+}
+
+static unsigned int mse_event_type(const struct mse_diff *diff,const struct rb_mse_api_pos *old_pos,
+  const struct rb_mse_api_pos *new_pos)
+{
+  if(NULL == old_pos)
+    return RB_MSE_EVENT_APPEARED;
+  if(NULL == new_pos)
+    return RB_MSE_EVENT_DISAPPEARED;
+
+  unsigned int type = mse_event_location(old_pos->location,new_pos->location,diff->same_ids);
+
+  const bool old_tracked = rb_mse_pos_currently_tracked(old_pos);
+  const bool new_tracked = rb_mse_pos_currently_tracked(new_pos);
+  if(!old_tracked && new_tracked)
+    type |= RB_MSE_EVENT_TRACKING_STARTED;
+  else if(old_tracked && !new_tracked)
+    type |= RB_MSE_EVENT_TRACKING_STOPPED;
+
+  const bool old_geo = rb_mse_pos_geo_valid(old_pos), new_geo = rb_mse_pos_geo_valid(new_pos);
+  if(old_geo != new_geo)
+  {
+    type |= RB_MSE_EVENT_GEO_MOVED;
+  }
+  else if(new_geo && (old_pos->lattitude != new_pos->lattitude || old_pos->longitude != new_pos->longitude))
+  {
+    if(diff->geo_move_m <= 0 || mse_geo_distance_m(old_pos->lattitude,old_pos->longitude,
+                                     new_pos->lattitude,new_pos->longitude) > diff->geo_move_m)
+      type |= RB_MSE_EVENT_GEO_MOVED;
+  }
+
+  return type;
+}
+
+/* Add the event of a MAC, if it changed something events report */
+static void mse_diff_add(struct mse_diff *diff,const struct rb_mse_api_pos *old_pos,
+  const struct rb_mse_api_pos *new_pos)
+{
+  if(!diff->collect)
+    return;
+
+  const unsigned int type = mse_event_type(diff,old_pos,new_pos);
+  if(0 == type)
+    return;
+
+  if(diff->count == diff->size)
+  {
+    const size_t size = diff->size ? diff->size*2 : MSE_EVENTS_BATCH;
+    struct rb_mse_event *events = realloc(diff->events,size*sizeof(events[0]));
+    if(NULL == events)
+    {
+      rdbg("Memory error. Event lost");
+      return;
+    }
+    diff->events = events;
+    diff->size = size;
+  }
+
+  struct rb_mse_event *event = &diff->events[diff->count++];
+  event->mac = new_pos ? rb_mse_pos_mac(new_pos) : rb_mse_pos_mac(old_pos);
+  event->type = type;
+  event->old_pos = old_pos;
+  event->new_pos = new_pos;
+}
+
+/* Event of a position received in the update. Delta updates flagged the
+   positions that are not the same as the last update while they were built.
+   Updates built from scratch counted all of them as added, so they are
+   counted here against the last update */
+static void mse_diff_position(struct mse_diff *diff,struct mse_generation *generation,
+  const struct rb_mse_api_pos *position)
+{
+  const struct rb_mse_api_pos *old_pos = NULL;
+  if(generation->delta && (position->flags & MSE_POS_F_ADDED))
+    old_pos = NULL;
+  else if(generation->delta && !(position->flags & MSE_POS_F_CHANGED))
+    return;
+  else if(diff->previous)
+    old_pos = mse_index_find(&diff->previous->index,position->mac);
+
+  if(!generation->delta && diff->previous)
+  {
+    if(NULL == old_pos)
+      generation->stats.number_of_macs_added++;
+    else if(!mse_position_same(diff,old_pos,position))
+      generation->stats.number_of_macs_changed++;
+  }
+
+  mse_diff_add(diff,old_pos,position);
+}
+
+/* MACs of the last update missing in an update built from scratch */
+static void mse_diff_removed(struct mse_diff *diff,struct mse_generation *generation)
+{
+  const struct mse_records_chunk *chunk;
+  size_t i;
+
+  mse_records_foreach(&diff->previous->records,chunk,i)
+  {
+    const struct rb_mse_api_pos *old_pos = mse_records_at(chunk,i);
+    if(!(old_pos->flags & MSE_POS_F_REMOVED) && NULL == mse_index_find(&generation->index,old_pos->mac))
+    {
+      generation->stats.number_of_macs_removed++;
+      mse_diff_add(diff,old_pos,NULL);
+    }
+  }
+}
+
+static void mse_diff_close(struct mse_diff *diff)
+{
+  free(diff->events);
+}
+
+static void rb_mse_send_events(struct rb_mse_api *rb_mse,rb_mse_events_cb_fn *events_cb,void *opaque,
+  const struct mse_diff *diff)
+{
+  size_t i;
+  for(i=0;i<diff->count;i+=MSE_EVENTS_BATCH)
+    events_cb(rb_mse,&diff->events[i],diff->count - i < MSE_EVENTS_BATCH ? diff->count - i : MSE_EVENTS_BATCH,opaque);
+}
+
+/* Remove the records not seen in the update, and prepare the rest for the
+   next. Changes of the update are counted against diff->previous, and the
+   events added to diff if it collects them. If history is not NULL, the
+   positions that changed are added to it */
+static void mse_generation_sweep(struct mse_generation *generation,struct mse_diff *diff,
+  struct mse_history *history,uint32_t now)
+{
+  struct mse_records_chunk *chunk;
+  size_t i;
+
+  if(!generation->delta && diff->previous)
+  {
+    /* Built from scratch: every entry was counted as added */
+    generation->stats.number_of_macs_added = 0;
+    generation->stats.number_of_macs_changed = 0;
+  }
+
+  mse_records_foreach(&generation->records,chunk,i)
+  {
+    struct rb_mse_api_pos *position = mse_records_at(chunk,i);
+    if(position->flags & MSE_POS_F_REMOVED)
+      continue;
+
+    if(position->flags & MSE_POS_F_SEEN)
+    {
+      mse_diff_position(diff,generation,position);
+      if(history && (!generation->delta || (position->flags & (MSE_POS_F_ADDED | MSE_POS_F_CHANGED))))
+        mse_history_add(history,position,now);
+      position->flags &= ~(MSE_POS_F_SEEN | MSE_POS_F_CHANGED | MSE_POS_F_ADDED);
+      continue;
+    }
+
+    /* Only delta updates have positions they did not receive */
+    if(diff->previous)
+      mse_diff_add(diff,mse_index_find(&diff->previous->index,position->mac),NULL);
+
+    bool found = false;
+    void **index_slot = mse_index_upsert(&generation->index,position->mac,&found);
+    assert(found);
+    if(index_slot)
+      *index_slot = NULL;
+
+    mse_stats_count(&generation->stats,position->flags,-1);
+    generation->stats.number_of_macs_removed++;
+    generation->live--;
+    position->flags = MSE_POS_F_REMOVED;
+  }
+
+  if(diff->previous && !generation->delta)
+    mse_diff_removed(diff,generation);
+}
+
+/**
+  Update all macs pos in the MSE
+  Note: we expect the message like:
+  {
+    "Locations":{
+        "totalPages":1,
+        "currentPage":1,
+        "pageSize":1882,
+        "entries":[
+            {
+                "macAddress":"ab:ca:dd:fe:10:10",
+                "currentlyTracked":true,
+                "confidenceFactor":824.0,
+                "band":"UNKNOWN",
+                "isGuestUser":false,
+                "dot11Status":"PROBING",
+                "MapInfo":{
+                    "mapHierarchyString":"Area>Build>Floor",
+                    "floorRefId":4698041219291283488,
+                    "Dimension":{
+                        "length":5000.0,
+                        "width":6900.0,
+                        "height":30.0,
+                        "offsetX":21360.9,
+                        "offsetY":19891.6,
+                        "unit":"FEET"
+                    },
+                    "Image":{
+                        "imageName":"domain_5_1350620105694.jpg"
+                    }
+                },
+                "MapCoordinate":{
+                    "x":5275.3,
+                    "y":2420.19,
+                    "unit":"FEET"
+                },
+                "Statistics":{
+                    "currentServerTime":"2013-12-11T10:00:26.650-0800",
+                    "firstLocatedTime":"2013-12-10T11:47:43.172-0800",
+                    "lastLocatedTime":"2013-12-11T08:54:04.312-0800"
+                },
+                "GeoCoordinate":{
+                    "lattitude":10.1,
+                    "longitude":-12.25,
+                    "unit":"DEGREES"
+                }
+            },
+          ]
+    }
+ */
+static bool rb_mse_update_macs_pos(struct rb_mse_api *rb_mse)
+{
+  assert(rb_mse);
+  struct mse_update_timings timings;
+  memset(&timings,0,sizeof(timings));
+  const uint64_t update_start = mse_now_us();
+
+  struct mse_generation *new_generation = mse_generation_new(rb_mse->generation,rb_mse->delta_updates,
+                                                             mse_fields_size(rb_mse->fields));
+  if(NULL == new_generation)
+  {
+    rdbg("Memory error");
+    return false;
+  }
+
+  struct mse_refresh refresh = {
+    .timings = &timings,
+    .previous = new_generation->delta ? rb_mse->generation : NULL,
+    .index = &new_generation->index,
+    .locations = &rb_mse->locations,
+    .fields = rb_mse->fields,
+    .records = &new_generation->records,
+    .live = &new_generation->live,
+    .stats = &new_generation->stats,
+  };
+  TAILQ_INIT(&refresh.pending);
+
+  // Note: If we found the same mac, tracked value will overwrite nontracked value
+  uint64_t stage_start = mse_now_us();
+  mse_workers_update(rb_mse);
+  const bool fetched = mse_transfers_update(rb_mse) && rb_mse_fetch_all_pages(rb_mse,&refresh);
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_FETCH],mse_now_us() - stage_start);
+  if(!fetched)
+  {
+    rdbg("Could not get all MSE pages. Keeping the last positions.");
+    mse_generation_destroy(new_generation);
+    mse_timings_add_update(&rb_mse->timings,&timings,false);
+    return false;
+  }
+
+  /* Read once, so the events go to the callback that asked for them */
+  pthread_mutex_lock(&rb_mse->stats_lock);
+  rb_mse_events_cb_fn *events_cb = rb_mse->events_cb;
+  void *events_cb_opaque = rb_mse->events_cb_opaque;
+  const double events_geo_move_m = rb_mse->events_geo_move_m;
+  pthread_mutex_unlock(&rb_mse->stats_lock);
+
+  struct mse_diff diff = {
+    .previous = rb_mse->generation,
+    .same_ids = rb_mse->generation && NULL == rb_mse->generation->stale,
+    .collect = NULL != events_cb,
+    .geo_move_m = events_geo_move_m,
+  };
+
+  struct mse_history *history = __atomic_load_n(&rb_mse->history,__ATOMIC_ACQUIRE);
+  if(history)
+    mse_history_begin_update(history);
+
+  stage_start = mse_now_us();
+  mse_generation_sweep(new_generation,&diff,history,time(NULL));
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_SWEEP],mse_now_us() - stage_start);
+
+  stage_start = mse_now_us();
+  if(0 != mse_geo_index_build(&new_generation->geo,&new_generation->records))
+    rdbg("Memory error. This update will have no geo index");
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_GEO_INDEX],mse_now_us() - stage_start);
+
+  stage_start = mse_now_us();
+  if(0 != mse_occupancy_build(&new_generation->occupancy,&new_generation->records))
+    rdbg("Memory error. This update will have no level index");
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_LEVEL_INDEX],mse_now_us() - stage_start);
+
+  stage_start = mse_now_us();
+  if(0 != mse_filter_build(&new_generation->filter,&new_generation->records,rb_mse->filter_bits))
+    rdbg("Memory error. This update will have no lookup filter");
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_FILTER],mse_now_us() - stage_start);
+
+  stage_start = mse_now_us();
+  struct mse_generation *expired = mse_generation_publish(rb_mse,new_generation);
+  pthread_mutex_lock(&rb_mse->stats_lock);
+  rb_mse->stats = new_generation->stats;
+  pthread_mutex_unlock(&rb_mse->stats_lock);
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_PUBLISH],mse_now_us() - stage_start);
+
+  stage_start = mse_now_us();
+  mse_generation_put(expired);
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_FREE],mse_now_us() - stage_start);
+
+  stage_start = mse_now_us();
+  pthread_mutex_lock(&rb_mse->snapshot_lock);
+  if(rb_mse->snapshot_path && 0 != mse_snapshot_save(rb_mse->snapshot_path,&new_generation->records))
+    rdbg("Could not write positions file %s: %s",rb_mse->snapshot_path,strerror(errno));
+  pthread_mutex_unlock(&rb_mse->snapshot_lock);
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_SNAPSHOT],mse_now_us() - stage_start);
+
+  mse_stage_add(&timings.stages[RB_MSE_STAGE_UPDATE],mse_now_us() - update_start);
+  mse_timings_add_update(&rb_mse->timings,&timings,true);
+
+  /* Last update is retired now, so both positions of the events are alive */
+  if(events_cb)
+    rb_mse_send_events(rb_mse,events_cb,events_cb_opaque,&diff);
+  mse_diff_close(&diff);
+
+  if(rb_mse->stats_cb)
+    rb_mse->stats_cb(rb_mse,&new_generation->stats,rb_mse->stats_cb_opaque);
+
+  rdbg("Updated");
+  return true;
+}
+
+
+static void *rb_mse_autoupdate(void *_rb_mse)
+{
+  assert(_rb_mse);
+  struct rb_mse_api * rb_mse = _rb_mse;
+  while(!rb_mse_exiting(rb_mse))
+  {
+    rdbg("Updating\n");
+    const int64_t start = mse_now_ms();
+    const bool ok = rb_mse_update_macs_pos(rb_mse);
+    const int64_t delay = rb_mse_next_update_delay(rb_mse,ok,mse_now_ms() - start);
+    rdbg("Next update in %"PRId64" ms",delay);
+    rb_mse_wait(rb_mse,delay);
+  }
+  rd_thread_cleanup();
+  return NULL;
+}
+
+static void rb_mse_servers_destroy(struct rb_mse_api *rb_mse)
+{
+  size_t i;
+  for(i=0;i<rb_mse->servers_size;++i)
+  {
+    free(rb_mse->servers[i].url);
+    free(rb_mse->servers[i].userpwd);
+  }
+  free(rb_mse->servers);
+  rb_mse->servers = NULL;
+  rb_mse->servers_size = 0;
+}
+
+static bool rb_mse_set_servers(struct rb_mse_api *rb_mse, const char * const *addrs,
+  const char * const *userpwds, size_t n)
+{
+  size_t i;
+
+  rb_mse->servers = calloc(n,sizeof(rb_mse->servers[0]));
+  if(NULL == rb_mse->servers)
+    return false;
+  rb_mse->servers_size = n;
+
+  for(i=0;i<n;++i)
+  {
+    struct mse_server *server = &rb_mse->servers[i];
+    const char *userpwd = userpwds ? userpwds[i] : NULL;
+
+    server->url = addrs[i] ? strdup(addrs[i]) : NULL;
+    server->userpwd = userpwd ? strdup(userpwd) : NULL;
+    if((addrs[i] && NULL == server->url) || (userpwd && NULL == server->userpwd))
+      return false;
+  }
+
+  return true;
+}
+
+/* Public API */
+
+struct rb_mse_api * rb_mse_api_new(time_t update_time, const char *addr, const char * userpwd)
+{
+  return rb_mse_api_new_multi(update_time,&addr,&userpwd,1);
+}
+
+struct rb_mse_api * rb_mse_api_new_multi(time_t update_time, const char * const *addrs,
+  const char * const *userpwds, size_t n)
+{
+  return rb_mse_api_new_fields(update_time,addrs,userpwds,n,0);
+}
+
+struct rb_mse_api * rb_mse_api_new_fields(time_t update_time, const char * const *addrs,
+  const char * const *userpwds, size_t n, unsigned int fields)
+{
+  if(0 == n || n > UINT16_MAX || (fields & ~RB_MSE_FIELD_ALL))
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct rb_mse_api * rb_mse = calloc(1,sizeof(struct rb_mse_api));
+  if(rb_mse)
+  {
+    rb_mse->slist = curl_slist_append(NULL, "Accept: application/json");
+
+    pthread_mutex_lock(&curl_global_mutex);
+    curl_global_init(CURL_GLOBAL_SSL);
+    rb_mse->share = curl_share_get();
+    pthread_mutex_unlock(&curl_global_mutex);
+
+    const bool servers_ok = rb_mse_set_servers(rb_mse, addrs, userpwds, n);
+    rb_mse->fields = fields;
+    rb_mse->max_connections = MSE_DEFAULT_MAX_CONNECTIONS;
+    rb_mse->filter_bits = MSE_FILTER_DEFAULT_BITS;
+    rb_mse->delta_updates = 1;
+    pthread_mutex_init(&rb_mse->snapshot_lock,NULL);
+    pthread_mutex_init(&rb_mse->stats_lock,NULL);
+    pthread_mutex_init(&rb_mse->timings.lock,NULL);
+    pthread_mutex_init(&rb_mse->wait_lock,NULL);
+    {
+      pthread_condattr_t wait_cond_attr;
+      pthread_condattr_init(&wait_cond_attr);
+      pthread_condattr_setclock(&wait_cond_attr,CLOCK_MONOTONIC);
+      pthread_cond_init(&rb_mse->wait_cond,&wait_cond_attr);
+      pthread_condattr_destroy(&wait_cond_attr);
+    }
+    rb_mse->rand_seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)rb_mse;
+    rd_memctx_init(&rb_mse->locations_memctx,NULL,RD_MEMCTX_F_TRACK);
+    const int locations_rc = mse_location_dict_init(&rb_mse->locations,&rb_mse->locations_memctx);
+    rb_mse->multi = curl_multi_init();
+#ifdef CURLPIPE_MULTIPLEX
+    if(rb_mse->multi)
+      curl_multi_setopt(rb_mse->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+    if(0 != posix_memalign((void **)&rb_mse->reader_slots,MSE_CACHE_LINE_SIZE,
+                                        MSE_READER_SLOTS*sizeof(rb_mse->reader_slots[0])))
+      rb_mse->reader_slots = NULL;
+    else
+      memset(rb_mse->reader_slots,0,MSE_READER_SLOTS*sizeof(rb_mse->reader_slots[0]));
+
+    if(!servers_ok || 0 != locations_rc || NULL == rb_mse->multi || NULL == rb_mse->reader_slots
+                                              || !mse_transfers_update(rb_mse)) // init error
+    {
+      mse_transfers_destroy(rb_mse);
+      mse_location_dict_close(&rb_mse->locations);
+      rd_memctx_freeall(&rb_mse->locations_memctx);
+      rd_memctx_destroy(&rb_mse->locations_memctx);
+      pthread_mutex_destroy(&rb_mse->snapshot_lock);
+      pthread_mutex_destroy(&rb_mse->stats_lock);
+      pthread_mutex_destroy(&rb_mse->timings.lock);
+      pthread_mutex_destroy(&rb_mse->wait_lock);
+      pthread_cond_destroy(&rb_mse->wait_cond);
+      if(rb_mse->multi)
+        curl_multi_cleanup(rb_mse->multi);
+      pthread_mutex_lock(&curl_global_mutex);
+      curl_share_put(rb_mse->share);
+      pthread_mutex_unlock(&curl_global_mutex);
+      free(rb_mse->reader_slots);
+      curl_slist_free_all(rb_mse->slist);
+      rb_mse_servers_destroy(rb_mse);
+      free(rb_mse);
+      rb_mse=NULL;
+      errno = ENOMEM;
+    }
+
+    if(rb_mse)
+    {
+      rb_mse->update_time = update_time;
+      rb_mse->max_update_time = update_time;
+      rd_thread_create(&rb_mse->rdt,"MSE updater",0,rb_mse_autoupdate,rb_mse);
+
+    }
+  }
+
+  return rb_mse;
+}
+
+const char * rb_mse_addr(struct rb_mse_api *rb_mse)
+{
+  return rb_mse->servers[0].url;
+}
+
+size_t rb_mse_mse_count(const struct rb_mse_api *rb_mse)
+{
+  return rb_mse->servers_size;
+}
+
+const char * rb_mse_mse_addr(const struct rb_mse_api *rb_mse,size_t i)
+{
+  return i < rb_mse->servers_size ? rb_mse->servers[i].url : NULL;
+}
+
+unsigned int rb_mse_pos_fields(const struct rb_mse_api_pos *pos)
+{
+  return mse_fields_present(pos);
+}
+
+int rb_mse_pos_map_coordinate(const struct rb_mse_api_pos *pos,double *x,double *y,const char **unit)
+{
+  const struct mse_fields_map_coordinate *map = mse_fields_get(pos,RB_MSE_FIELD_MAP_COORDINATE);
+  if(NULL == map)
+    return -1;
+
+  if(x)
+    *x = map->x;
+  if(y)
+    *y = map->y;
+  if(unit)
+    *unit = map->unit;
+  return 0;
+}
+
+int rb_mse_pos_confidence(const struct rb_mse_api_pos *pos,double *confidence)
+{
+  const double *field = mse_fields_get(pos,RB_MSE_FIELD_CONFIDENCE);
+  if(NULL == field)
+    return -1;
+  *confidence = *field;
+  return 0;
+}
+
+static const char *mse_pos_string_field(const struct rb_mse_api_pos *pos,unsigned int field)
+{
+  const char * const *str = mse_fields_get(pos,field);
+  return str ? *str : NULL;
+}
+
+const char *rb_mse_pos_band(const struct rb_mse_api_pos *pos)
+{
+  return mse_pos_string_field(pos,RB_MSE_FIELD_BAND);
+}
+
+const char *rb_mse_pos_dot11_status(const struct rb_mse_api_pos *pos)
+{
+  return mse_pos_string_field(pos,RB_MSE_FIELD_DOT11_STATUS);
+}
+
+const char *rb_mse_pos_ip_address(const struct rb_mse_api_pos *pos)
+{
+  /* Stored inline */
+  return mse_fields_get(pos,RB_MSE_FIELD_IP_ADDRESS);
+}
 
-  while(more_pages)
+int rb_mse_isempty(const struct rb_mse_api *rb_mse)
+{
+  struct mse_read_section section;
+  mse_read_lock(rb_mse,&section);
+  const int empty = section.generation ? section.generation->live == 0 : true;
+  mse_read_unlock(&section);
+  return empty;
+}
+
+
+/* Add the lookups of a reader to the counters of its slot */
+static void mse_filter_count(const struct rb_mse_api *rb_mse,const struct mse_filter_counters *lookups)
+{
+  struct mse_filter_counters *counters = &mse_reader_slot(rb_mse)->filter;
+  if(lookups->rejected)
+    __atomic_add_fetch(&counters->rejected,lookups->rejected,__ATOMIC_RELAXED);
+  if(lookups->passed)
+    __atomic_add_fetch(&counters->passed,lookups->passed,__ATOMIC_RELAXED);
+  if(lookups->false_positives)
+    __atomic_add_fetch(&counters->false_positives,lookups->false_positives,__ATOMIC_RELAXED);
+}
+
+/* Look up a MAC in an already pinned generation, adding the filter checks to
+   lookups */
+static const struct rb_mse_api_pos *mse_generation_find_mac(const struct mse_generation *generation,uint64_t mac,
+  struct mse_filter_counters *lookups)
+{
+  if(NULL == generation)
+    return NULL;
+
+  mac &= MSE_MAC_MASK;
+  if(NULL == generation->filter.blocks)
+    return mse_index_find(&generation->index,mac);
+
+  const struct rb_mse_api_pos *position = NULL;
+  if(!mse_filter_may_contain(&generation->filter,mac))
   {
-    rb_mse_set_curl_url(rb_mse,currently_tracked,current_page);
-    const CURLcode ret = curl_easy_perform(rb_mse->hnd);
-    if(ret==CURLE_OK)
-    {
-      json_t *root;
-      process_mse_response(&rb_mse->buffer,avl,memctx,stats,&root);
-      more_pages = has_more_pages(root);
-      current_page++;
-      json_decref(root);
-      root = NULL;
-      strbuffer_close(&rb_mse->buffer);
-      strbuffer_init(&rb_mse->buffer);
-    }
-    else
+    lookups->rejected++;
+  }
+  else
+  {
+    position = mse_index_find(&generation->index,mac);
+    lookups->passed++;
+    if(NULL == position)
+      lookups->false_positives++;
+  }
+
+  return position;
+}
+
+const struct rb_mse_api_pos * rb_mse_req_for_mac(struct rb_mse_api *rb_mse,const char *mac)
+{
+  uint64_t mac_i;
+  if(0 != mse_mac_parse(mac,&mac_i))
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  return rb_mse_req_for_mac_i(rb_mse,mac_i);
+}
+
+const struct rb_mse_api_pos * rb_mse_req_for_mac_i(struct rb_mse_api *rb_mse,uint64_t mac)
+{
+  struct mse_filter_counters lookups = {0,0,0};
+  struct mse_read_section section;
+  mse_read_lock(rb_mse,&section);
+  const struct rb_mse_api_pos * position = mse_generation_find_mac(section.generation,mac,&lookups);
+  mse_filter_count(rb_mse,&lookups);
+  mse_read_unlock(&section);
+  return position;
+}
+
+/// Keys prefetched ahead of the one being looked up in batch lookups
+#define MSE_BATCH_PREFETCH_DISTANCE 8
+/// MACs converted from strings, or checked against the filter, at a time in
+/// batch lookups
+#define MSE_BATCH_CHUNK 64
+
+/* Look up a batch of MACs in the index of a generation */
+static size_t mse_index_find_batch(const struct mse_index *index,const uint64_t *macs,size_t n,
+  const struct rb_mse_api_pos **positions)
+{
+  size_t i,found=0;
+
+  for(i=0;i<n && i<MSE_BATCH_PREFETCH_DISTANCE;++i)
+    mse_index_prefetch(index,macs[i] & MSE_MAC_MASK);
+
+  for(i=0;i<n;++i)
+  {
+    if(i + MSE_BATCH_PREFETCH_DISTANCE < n)
+      mse_index_prefetch(index,macs[i + MSE_BATCH_PREFETCH_DISTANCE] & MSE_MAC_MASK);
+
+    if(unlikely(macs[i] == MSE_MAC_INVALID))
     {
-      rdbg("Cannot perform curl request: %s\n",curl_easy_strerror(ret));
+      positions[i] = NULL;
+      continue;
     }
+
+    positions[i] = mse_index_find(index,macs[i] & MSE_MAC_MASK);
+    if(positions[i])
+      found++;
   }
+
+  return found;
 }
 
-#define get_and_process_mse_tracked(rb_mse,avl,memctx,stats) \
-  get_and_process_mse_response0(rb_mse, true,avl,memctx,stats)
+/* Look up a batch of MACs in an already pinned generation. MACs are checked
+   against the filter first, a chunk at a time, so only the ones that pass it
+   are prefetched and looked up in the index. The checks are added to lookups */
+static size_t mse_generation_find_macs(const struct mse_generation *generation,
+  const uint64_t *macs,size_t n,const struct rb_mse_api_pos **positions,
+  struct mse_filter_counters *lookups)
+{
+  uint64_t passed_macs[MSE_BATCH_CHUNK];
+  size_t passed_at[MSE_BATCH_CHUNK];
+  const struct rb_mse_api_pos *passed_positions[MSE_BATCH_CHUNK];
+  size_t i,j,found=0;
+
+  if(NULL == generation)
+  {
+    for(i=0;i<n;++i)
+      positions[i] = NULL;
+    return 0;
+  }
 
-#define get_and_process_mse_nontracked(rb_mse,avl,memctx,stats) \
-  get_and_process_mse_response0(rb_mse, false,avl,memctx,stats)
+  const struct mse_filter *filter = &generation->filter;
+  if(NULL == filter->blocks)
+    return mse_index_find_batch(&generation->index,macs,n,positions);
 
-/**
-  Update all macs pos in the MSE
-  Note: we expect the message like:
+  for(i=0;i<n;i+=MSE_BATCH_CHUNK)
   {
-    "Locations":{
-        "totalPages":1,
-        "currentPage":1,
-        "pageSize":1882,
-        "entries":[
-            {
-                "macAddress":"ab:ca:dd:fe:10:10",
-                "currentlyTracked":true,
-                "confidenceFactor":824.0,
-                "band":"UNKNOWN",
-                "isGuestUser":false,
-                "dot11Status":"PROBING",
-                "MapInfo":{
-                    "mapHierarchyString":"Area>Build>Floor",
-                    "floorRefId":4698041219291283488,
-                    "Dimension":{
-                        "length":5000.0,
-                        "width":6900.0,
-                        "height":30.0,
-                        "offsetX":21360.9,
-                        "offsetY":19891.6,
-                        "unit":"FEET"
-                    },
-                    "Image":{
-                        "imageName":"domain_5_1350620105694.jpg"
-                    }
-                },
-                "MapCoordinate":{
-                    "x":5275.3,
-                    "y":2420.19,
-                    "unit":"FEET"
-                },
-                "Statistics":{
-                    "currentServerTime":"2013-12-11T10:00:26.650-0800",
-                    "firstLocatedTime":"2013-12-10T11:47:43.172-0800",
-                    "lastLocatedTime":"2013-12-11T08:54:04.312-0800"
-                },
-                "GeoCoordinate":{
-                    "lattitude":10.1,
-                    "longitude":-12.25,
-                    "unit":"DEGREES"
-                }
-            },
-          ]
+    const size_t chunk = n-i < MSE_BATCH_CHUNK ? n-i : MSE_BATCH_CHUNK;
+    size_t passed = 0;
+
+    for(j=0;j<chunk && j<MSE_BATCH_PREFETCH_DISTANCE;++j)
+      mse_filter_prefetch(filter,macs[i+j] & MSE_MAC_MASK);
+
+    for(j=0;j<chunk;++j)
+    {
+      if(j + MSE_BATCH_PREFETCH_DISTANCE < chunk)
+        mse_filter_prefetch(filter,macs[i + j + MSE_BATCH_PREFETCH_DISTANCE] & MSE_MAC_MASK);
+
+      positions[i+j] = NULL;
+      if(unlikely(macs[i+j] == MSE_MAC_INVALID))
+        continue;
+
+      if(mse_filter_may_contain(filter,macs[i+j] & MSE_MAC_MASK))
+      {
+        passed_macs[passed] = macs[i+j];
+        passed_at[passed++] = i+j;
+      }
+      else
+      {
+        lookups->rejected++;
+      }
     }
- */
-static void rb_mse_update_macs_pos(struct rb_mse_api *rb_mse)
+
+    const size_t chunk_found = mse_index_find_batch(&generation->index,passed_macs,passed,passed_positions);
+    for(j=0;j<passed;++j)
+      positions[passed_at[j]] = passed_positions[j];
+    lookups->passed += passed;
+    lookups->false_positives += passed - chunk_found;
+    found += chunk_found;
+  }
+
+  return found;
+}
+
+/* Same, with MACs as strings */
+static size_t mse_generation_find_mac_strs(const struct mse_generation *generation,
+  const char * const *macs,size_t n,const struct rb_mse_api_pos **positions,
+  struct mse_filter_counters *lookups)
 {
-  assert(rb_mse);
-  rd_memctx_t *new_memctx = calloc(1,sizeof(rd_memctx_t));
-  rd_memctx_init(new_memctx,NULL,RD_MEMCTX_F_TRACK);
-  rd_avl_t *new_avl = rd_memctx_calloc(new_memctx,1,sizeof(rd_avl_t));
-  rd_avl_init(new_avl,mse_positions_cmp,0);
-  struct rb_mse_stats stats;
-  memset(&stats,0,sizeof(stats));
+  uint64_t macs_i[MSE_BATCH_CHUNK];
+  size_t i,found=0;
 
+  for(i=0;i<n;i+=MSE_BATCH_CHUNK)
+  {
+    const size_t chunk = n-i < MSE_BATCH_CHUNK ? n-i : MSE_BATCH_CHUNK;
+    mse_mac_parse_batch(&macs[i],chunk,macs_i);
+    found += mse_generation_find_macs(generation,macs_i,chunk,&positions[i],lookups);
+  }
 
-  get_and_process_mse_nontracked(rb_mse,new_avl,new_memctx,&stats);
-  // Note: If we found the same mac, tracked value will overwrite nontracked value
-  get_and_process_mse_tracked(rb_mse,new_avl,new_memctx,&stats);
+  return found;
+}
 
-  rd_rwlock_wrlock(&rb_mse->avl_memctx_rwlock);
-  rd_memctx_t *old_memctx = rb_mse->memctx;
-  rb_mse->memctx = new_memctx;
-  rb_mse->avl = new_avl;
-  rb_mse->stats = stats;
-  if(rb_mse->stats_cb)
-    rb_mse->stats_cb(rb_mse,&rb_mse->stats,rb_mse->stats_cb_opaque);
-  rd_rwlock_unlock(&rb_mse->avl_memctx_rwlock);
+size_t rb_mse_req_for_macs_i(struct rb_mse_api *rb_mse,const uint64_t *macs,size_t n,
+  const struct rb_mse_api_pos **positions)
+{
+  struct mse_filter_counters lookups = {0,0,0};
+  struct mse_read_section section;
+  mse_read_lock(rb_mse,&section);
+  const size_t found = mse_generation_find_macs(section.generation,macs,n,positions,&lookups);
+  mse_filter_count(rb_mse,&lookups);
+  mse_read_unlock(&section);
+
+  return found;
+}
 
-  rdbg("Updated");
-  if(old_memctx)
+size_t rb_mse_req_for_macs(struct rb_mse_api *rb_mse,const char * const *macs,size_t n,
+  const struct rb_mse_api_pos **positions)
+{
+  struct mse_filter_counters lookups = {0,0,0};
+  struct mse_read_section section;
+  mse_read_lock(rb_mse,&section);
+  const size_t found = mse_generation_find_mac_strs(section.generation,macs,n,positions,&lookups);
+  mse_filter_count(rb_mse,&lookups);
+  mse_read_unlock(&section);
+
+  return found;
+}
+
+/* ======================================================================= *
+ *                               Snapshots
+ * ======================================================================= */
+
+/* A snapshot is a reference to a generation */
+static inline const struct mse_generation *mse_snapshot_generation(const struct rb_mse_snapshot *snapshot)
+{
+  return (const struct mse_generation *)snapshot;
+}
+
+struct rb_mse_snapshot * rb_mse_snapshot_acquire(struct rb_mse_api *rb_mse)
+{
+  /* The rb_mse_api drops its reference two publications after the generation
+     stops being current, and every publication waits for the read sections,
+     so the generation can't be freed before we take ours */
+  struct mse_read_section section;
+  mse_read_lock(rb_mse,&section);
+  struct mse_generation *generation = (struct mse_generation *)section.generation;
+  if(generation)
+    mse_generation_get(generation);
+  mse_read_unlock(&section);
+
+  return (struct rb_mse_snapshot *)generation;
+}
+
+void rb_mse_snapshot_release(struct rb_mse_snapshot *snapshot)
+{
+  mse_generation_put((struct mse_generation *)snapshot);
+}
+
+const struct rb_mse_api_pos * rb_mse_snapshot_req_for_mac(const struct rb_mse_snapshot *snapshot,const char *mac)
+{
+  uint64_t mac_i;
+  if(0 != mse_mac_parse(mac,&mac_i))
   {
-    rd_memctx_freeall(old_memctx);
-    free(old_memctx);
+    errno = EINVAL;
+    return NULL;
   }
+  return rb_mse_snapshot_req_for_mac_i(snapshot,mac_i);
 }
 
+const struct rb_mse_api_pos * rb_mse_snapshot_req_for_mac_i(const struct rb_mse_snapshot *snapshot,uint64_t mac)
+{
+  /* Not counted, the counters are shared with other threads */
+  struct mse_filter_counters lookups = {0,0,0};
+  return mse_generation_find_mac(mse_snapshot_generation(snapshot),mac,&lookups);
+}
 
-static void *rb_mse_autoupdate(void *_rb_mse)
+size_t rb_mse_snapshot_req_for_macs(const struct rb_mse_snapshot *snapshot,const char * const *macs,
+  size_t n,const struct rb_mse_api_pos **positions)
 {
-  assert(_rb_mse);
-  struct rb_mse_api * rb_mse = _rb_mse;
-  while(rd_currthread_get()->rdt_state != RD_THREAD_S_EXITING)
+  struct mse_filter_counters lookups = {0,0,0};
+  return mse_generation_find_mac_strs(mse_snapshot_generation(snapshot),macs,n,positions,&lookups);
+}
+
+size_t rb_mse_snapshot_req_for_macs_i(const struct rb_mse_snapshot *snapshot,const uint64_t *macs,
+  size_t n,const struct rb_mse_api_pos **positions)
+{
+  struct mse_filter_counters lookups = {0,0,0};
+  return mse_generation_find_macs(mse_snapshot_generation(snapshot),macs,n,positions,&lookups);
+}
+
+size_t rb_mse_snapshot_count(const struct rb_mse_snapshot *snapshot)
+{
+  const struct mse_generation *generation = mse_snapshot_generation(snapshot);
+  return generation ? generation->live : 0;
+}
+
+size_t rb_mse_snapshot_foreach(const struct rb_mse_snapshot *snapshot,rb_mse_pos_cb_fn *cb,void *opaque)
+{
+  const struct mse_generation *generation = mse_snapshot_generation(snapshot);
+  const struct mse_records_chunk *chunk;
+  size_t i,visited=0;
+
+  if(NULL == generation)
+    return 0;
+
+  mse_records_foreach(&generation->records,chunk,i)
   {
-    rdbg("Updating\n");
-    rb_mse_update_macs_pos(rb_mse);
-    // rdbg("Updated. Buffer: %s\n",strbuffer_value(&rb_mse->buffer));
-    sleep(rb_mse->update_time);
+    const struct rb_mse_api_pos *position = mse_records_at(chunk,i);
+    if(position->flags & MSE_POS_F_REMOVED)
+      continue;
+
+    visited++;
+    if(0 != cb(position,opaque))
+      break;
   }
-  rd_thread_cleanup();
-  return NULL;
+
+  return visited;
 }
 
-static CURLcode rb_mse_set_userpwd(struct rb_mse_api *rb_mse, const char *userpwd)
+const struct rb_mse_stats * rb_mse_snapshot_stats(const struct rb_mse_snapshot *snapshot)
 {
-  return curl_easy_setopt(rb_mse->hnd, CURLOPT_USERPWD, userpwd);;
+  const struct mse_generation *generation = mse_snapshot_generation(snapshot);
+  return generation ? &generation->stats : NULL;
 }
 
+int rb_mse_snapshot_is_stale(const struct rb_mse_snapshot *snapshot)
+{
+  const struct mse_generation *generation = mse_snapshot_generation(snapshot);
+  return generation && generation->stale;
+}
 
-static bool rb_mse_set_mse_addr(struct rb_mse_api *rb_mse, const char *addr)
+size_t rb_mse_snapshot_geo_radius(const struct rb_mse_snapshot *snapshot,double lattitude,double longitude,
+  double radius_m,rb_mse_pos_cb_fn *cb,void *opaque)
 {
-  rb_mse->mse_url = strdup(addr);
-  return rb_mse->mse_url != NULL;
+  const struct mse_generation *generation = mse_snapshot_generation(snapshot);
+  return generation ? mse_geo_index_radius(&generation->geo,lattitude,longitude,radius_m,cb,opaque) : 0;
 }
 
-/* Public API */
+size_t rb_mse_snapshot_geo_box(const struct rb_mse_snapshot *snapshot,double min_lattitude,
+  double min_longitude,double max_lattitude,double max_longitude,rb_mse_pos_cb_fn *cb,void *opaque)
+{
+  const struct mse_generation *generation = mse_snapshot_generation(snapshot);
+  return generation ? mse_geo_index_box(&generation->geo,min_lattitude,min_longitude,
+                                                   max_lattitude,max_longitude,cb,opaque) : 0;
+}
 
-struct rb_mse_api * rb_mse_api_new(time_t update_time, const char *addr, const char * userpwd)
+/* Level index of a snapshot. NULL if there is none */
+static const struct mse_level_index *mse_snapshot_level(const struct rb_mse_snapshot *snapshot,
+  enum rb_mse_level level)
 {
-  struct rb_mse_api * rb_mse = calloc(1,sizeof(struct rb_mse_api));
-  if(rb_mse)
+  const struct mse_generation *generation = mse_snapshot_generation(snapshot);
+  if(NULL == generation || (unsigned int)level >= RB_MSE_LEVELS || 0 == generation->occupancy.levels[level].ids)
+    return NULL;
+  return &generation->occupancy.levels[level];
+}
+
+const struct rb_mse_occupancy * rb_mse_snapshot_occupancy(const struct rb_mse_snapshot *snapshot,
+  enum rb_mse_level level,size_t *ids)
+{
+  const struct mse_level_index *index = mse_snapshot_level(snapshot,level);
+  *ids = index ? index->ids : 0;
+  return index ? index->occupancy : NULL;
+}
+
+size_t rb_mse_snapshot_level_positions(const struct rb_mse_snapshot *snapshot,enum rb_mse_level level,
+  uint32_t id,const struct rb_mse_api_pos * const **positions)
+{
+  const struct mse_level_index *index = mse_snapshot_level(snapshot,level);
+  if(NULL == index || id >= index->ids)
   {
-    rb_mse->slist = curl_slist_append(NULL, "Accept: application/json");
+    *positions = NULL;
+    return 0;
+  }
 
-    pthread_mutex_lock(&curl_global_mutex);
-    curl_global_init(CURL_GLOBAL_SSL);
-    pthread_mutex_unlock(&curl_global_mutex);
+  *positions = &index->positions[index->members[id]];
+  return index->members[id + 1] - index->members[id];
+}
 
-    rb_mse->hnd = curl_easy_init();
-    if(rb_mse->hnd)
-    {
-      rb_mse_set_mse_addr(rb_mse, addr);
-      rb_mse_set_userpwd(rb_mse, userpwd);
-      curl_easy_setopt(rb_mse->hnd, CURLOPT_WRITEDATA, rb_mse);               /* void passed to WRITEFUNCTION */
-      curl_easy_setopt(rb_mse->hnd, CURLOPT_WRITEFUNCTION, write_function);   /* function called for each data received */ 
-      curl_easy_setopt(rb_mse->hnd, CURLOPT_HTTPHEADER, rb_mse->slist);
-      curl_setopts(rb_mse->hnd);
-    }
-    else // curl_easy_init error
+const char * rb_mse_snapshot_level_name(const struct rb_mse_snapshot *snapshot,enum rb_mse_level level,
+  uint32_t id)
+{
+  const struct mse_generation *generation = mse_snapshot_generation(snapshot);
+  return generation ? mse_occupancy_name(&generation->occupancy,level,id) : NULL;
+}
+
+void rb_mse_set_max_connections(struct rb_mse_api *rb_mse, unsigned int max_connections)
+{
+  rb_mse->max_connections = max_connections;
+}
+
+void rb_mse_set_parse_threads(struct rb_mse_api *rb_mse, unsigned int threads)
+{
+  rb_mse->parse_threads = threads;
+}
+
+void rb_mse_set_filter_bits(struct rb_mse_api *rb_mse, unsigned int bits_per_mac)
+{
+  rb_mse->filter_bits = bits_per_mac;
+}
+
+void rb_mse_set_delta_updates(struct rb_mse_api *rb_mse, int onoff)
+{
+  rb_mse->delta_updates = onoff;
+}
+
+void rb_mse_set_max_update_time(struct rb_mse_api *rb_mse, time_t max_update_time)
+{
+  rb_mse->max_update_time = max_update_time;
+}
+
+int rb_mse_set_snapshot_file(struct rb_mse_api *rb_mse, const char *path)
+{
+  char *path_copy = NULL;
+  if(path && NULL == (path_copy = strdup(path)))
+    return -1;
+
+  pthread_mutex_lock(&rb_mse->snapshot_lock);
+  char *old_path = rb_mse->snapshot_path;
+  rb_mse->snapshot_path = path_copy;
+  pthread_mutex_unlock(&rb_mse->snapshot_lock);
+  free(old_path);
+
+  if(path && NULL == rb_mse->generation)
+  {
+    struct mse_generation *generation = mse_generation_load(rb_mse,path);
+    if(NULL == generation)
     {
-      free(rb_mse);
-      rb_mse=NULL;
+      rdbg("Could not load positions file %s: %s",path,strerror(errno));
     }
-
-    if(rb_mse)
+    else
     {
-      strbuffer_init(&rb_mse->buffer);
-      rd_rwlock_init(&rb_mse->avl_memctx_rwlock);
-      rb_mse->update_time = update_time;
-      rd_thread_create(&rb_mse->rdt,"MSE updater",0,rb_mse_autoupdate,rb_mse);
-
+      /* Nobody can be reading a generation yet, so no need to wait readers.
+         The stats lock keeps an update published meanwhile from having its
+         stats overwritten by these ones */
+      struct mse_generation *expected = NULL;
+      pthread_mutex_lock(&rb_mse->stats_lock);
+      const bool loaded = __atomic_compare_exchange_n(&rb_mse->generation,&expected,generation,false,
+                                                   __ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+      if(loaded)
+        rb_mse->stats = generation->stats;
+      pthread_mutex_unlock(&rb_mse->stats_lock);
+      if(!loaded)
+        mse_generation_destroy(generation); /* First update won the race */
     }
   }
 
-  return rb_mse;
+  return 0;
 }
 
-const char * rb_mse_addr(struct rb_mse_api *rb_mse)
+int rb_mse_is_stale(const struct rb_mse_api *rb_mse)
 {
-  return rb_mse->mse_url;
+  struct mse_read_section section;
+  mse_read_lock(rb_mse,&section);
+  const int stale = section.generation && section.generation->stale;
+  mse_read_unlock(&section);
+  return stale;
 }
 
-int rb_mse_isempty(const struct rb_mse_api *rb_mse)
+void rb_mse_get_update_stats(struct rb_mse_api *rb_mse, struct rb_mse_update_stats *stats)
 {
-  return rb_mse->memctx?rb_mse->memctx->rmc_out==0:true;
-}
+  struct mse_timings *timings = &rb_mse->timings;
+  size_t i;
 
+  pthread_mutex_lock(&timings->lock);
+  *stats = timings->totals;
+  for(i=0;i<RB_MSE_STAGES;++i)
+  {
+    mse_stage_merge(&stats->stages[i],&timings->windows[0][i]);
+    mse_stage_merge(&stats->stages[i],&timings->windows[1][i]);
+  }
+  pthread_mutex_unlock(&timings->lock);
+}
 
-const struct rb_mse_api_pos * rb_mse_req_for_mac(struct rb_mse_api *rb_mse,const char *mac)
+void rb_mse_get_filter_stats(struct rb_mse_api *rb_mse, struct rb_mse_filter_stats *stats)
 {
-  return rb_mse_req_for_mac_i(rb_mse,mac_from_str(mac));
+  size_t i;
+
+  memset(stats,0,sizeof(*stats));
+  for(i=0;i<MSE_READER_SLOTS;++i)
+  {
+    const struct mse_filter_counters *counters = &rb_mse->reader_slots[i].filter;
+    stats->rejected += __atomic_load_n(&counters->rejected,__ATOMIC_RELAXED);
+    stats->passed += __atomic_load_n(&counters->passed,__ATOMIC_RELAXED);
+    stats->false_positives += __atomic_load_n(&counters->false_positives,__ATOMIC_RELAXED);
+  }
+
+  struct mse_read_section section;
+  mse_read_lock(rb_mse,&section);
+  if(section.generation)
+  {
+    stats->bytes = mse_filter_size(&section.generation->filter);
+    stats->macs = section.generation->filter.keys;
+  }
+  mse_read_unlock(&section);
 }
 
-const struct rb_mse_api_pos * rb_mse_req_for_mac_i(struct rb_mse_api *rb_mse,uint64_t mac)
+const char * rb_mse_stage_name(enum rb_mse_stage stage)
 {
-  const struct mse_positions_list_node search_node = {
-    #ifdef MSE_POSITION_LIST_MAGIC
-    .magic = MSE_POSITION_LIST_MAGIC,
-    #endif
-    .mac = mac
+  static const char *names[RB_MSE_STAGES] = {
+    [RB_MSE_STAGE_DNS]        = "dns",
+    [RB_MSE_STAGE_CONNECT]    = "connect",
+    [RB_MSE_STAGE_TLS]        = "tls",
+    [RB_MSE_STAGE_FIRST_BYTE] = "first_byte",
+    [RB_MSE_STAGE_TRANSFER]   = "transfer",
+    [RB_MSE_STAGE_PARSE]      = "parse",
+    [RB_MSE_STAGE_INSERT]     = "insert",
+    [RB_MSE_STAGE_FETCH]      = "fetch",
+    [RB_MSE_STAGE_SWEEP]      = "sweep",
+    [RB_MSE_STAGE_GEO_INDEX]  = "geo_index",
+    [RB_MSE_STAGE_LEVEL_INDEX]= "level_index",
+    [RB_MSE_STAGE_FILTER]     = "filter",
+    [RB_MSE_STAGE_PUBLISH]    = "publish",
+    [RB_MSE_STAGE_FREE]       = "free",
+    [RB_MSE_STAGE_SNAPSHOT]   = "snapshot",
+    [RB_MSE_STAGE_UPDATE]     = "update",
   };
-
-  rd_rwlock_rdlock(&rb_mse->avl_memctx_rwlock);
-  const struct mse_positions_list_node * ret_node
-    =rb_mse->avl?rd_avl_find(rb_mse->avl,&search_node,1 /* rlock */):NULL;
-  rd_rwlock_unlock(&rb_mse->avl_memctx_rwlock);
-
-  return ret_node ? ret_node->position : NULL;
+  return (unsigned int)stage < RB_MSE_STAGES ? names[stage] : NULL;
 }
 
 void rb_mse_set_stats_cb(struct rb_mse_api *rb_mse ,stats_cb_fn *stats_cb,void *opaque)
@@ -684,6 +2823,72 @@ void rb_mse_set_stats_cb(struct rb_mse_api *rb_mse ,stats_cb_fn *stats_cb,void *
   rb_mse->stats_cb_opaque = opaque;
 }
 
+void rb_mse_set_events_cb(struct rb_mse_api *rb_mse,rb_mse_events_cb_fn *events_cb,double geo_move_m,
+  void *opaque)
+{
+  pthread_mutex_lock(&rb_mse->stats_lock);
+  rb_mse->events_geo_move_m = geo_move_m;
+  rb_mse->events_cb_opaque = opaque;
+  rb_mse->events_cb = events_cb;
+  pthread_mutex_unlock(&rb_mse->stats_lock);
+}
+
+int rb_mse_set_history(struct rb_mse_api *rb_mse,size_t macs,unsigned int points)
+{
+  if(0 == macs || 0 == points)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  if(__atomic_load_n(&rb_mse->history,__ATOMIC_ACQUIRE))
+  {
+    errno = EBUSY;
+    return -1;
+  }
+
+  struct mse_history *history = calloc(1,sizeof(*history));
+  if(NULL == history || 0 != mse_history_init(history,macs,points))
+  {
+    rdbg("Memory error");
+    free(history);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  /* The updater may be sweeping: it takes the history in the next update */
+  struct mse_history *expected = NULL;
+  if(!__atomic_compare_exchange_n(&rb_mse->history,&expected,history,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED))
+  {
+    mse_history_close(history);
+    free(history);
+    errno = EBUSY;
+    return -1;
+  }
+  return 0;
+}
+
+size_t rb_mse_history_for_mac(struct rb_mse_api *rb_mse,const char *mac,struct rb_mse_history_point *points,
+  size_t max)
+{
+  uint64_t mac_i;
+  if(0 != mse_mac_parse(mac,&mac_i))
+  {
+    errno = EINVAL;
+    return 0;
+  }
+  return rb_mse_history_for_mac_i(rb_mse,mac_i,points,max);
+}
+
+size_t rb_mse_history_for_mac_i(struct rb_mse_api *rb_mse,uint64_t mac,struct rb_mse_history_point *points,
+  size_t max)
+{
+  /* History is never freed before rb_mse, so no read section is needed */
+  const struct mse_history *history = __atomic_load_n(&rb_mse->history,__ATOMIC_ACQUIRE);
+  if(NULL == history || 0 == max)
+    return 0;
+  return mse_history_get(history,mac,points,max);
+}
+
 void stdout_stats_cb(struct rb_mse_api *rb_mse RB_UNUSED, struct rb_mse_stats *stats, void *opaque RB_UNUSED)
 {
   printf("number of macs only map-localized: %d\n",rb_mse_stats_number_of_macs_map_localized(stats));
@@ -695,25 +2900,53 @@ void stdout_stats_cb(struct rb_mse_api *rb_mse RB_UNUSED, struct rb_mse_stats *s
 const struct rb_mse_stats *rb_mse_get_stats(struct rb_mse_api *rb_mse)
 {
   assert(rb_mse);
-  rd_rwlock_rdlock(&rb_mse->avl_memctx_rwlock);
-  const struct rb_mse_stats *stats = &rb_mse->stats;
-  rd_rwlock_unlock(&rb_mse->avl_memctx_rwlock);
-  return stats;
+  return &rb_mse->stats;
+}
+
+void rb_mse_copy_stats(struct rb_mse_api *rb_mse,struct rb_mse_stats *stats)
+{
+  assert(rb_mse);
+  pthread_mutex_lock(&rb_mse->stats_lock);
+  *stats = rb_mse->stats;
+  pthread_mutex_unlock(&rb_mse->stats_lock);
 }
 
 void rb_mse_api_destroy(struct rb_mse_api * rb_mse)
 {
   void * void_val;
+
+  pthread_mutex_lock(&rb_mse->wait_lock);
+  rb_mse->exiting = 1;
+  pthread_cond_signal(&rb_mse->wait_cond);
+  pthread_mutex_unlock(&rb_mse->wait_lock);
+
   rd_thread_kill_join(rb_mse->rdt,&void_val);
-  rb_mse_clean(rb_mse);
-  free(rb_mse->memctx);
-  rd_avl_destroy(rb_mse->avl);
+  mse_generation_put(rb_mse->generation);
+  mse_generation_put(rb_mse->retired);
+  if(rb_mse->history)
+  {
+    mse_history_close(rb_mse->history);
+    free(rb_mse->history);
+  }
+  mse_location_dict_close(&rb_mse->locations);
+  rd_memctx_freeall(&rb_mse->locations_memctx);
+  rd_memctx_destroy(&rb_mse->locations_memctx);
+  pthread_mutex_destroy(&rb_mse->snapshot_lock);
+  pthread_mutex_destroy(&rb_mse->stats_lock);
+  pthread_mutex_destroy(&rb_mse->timings.lock);
+  pthread_mutex_destroy(&rb_mse->wait_lock);
+  pthread_cond_destroy(&rb_mse->wait_cond);
+  free(rb_mse->snapshot_path);
+  free(rb_mse->reader_slots);
   curl_slist_free_all(rb_mse->slist); /* free the list again */
-  free(rb_mse->mse_url);
-  curl_easy_cleanup(rb_mse->hnd);
-  free(rb_mse);
+  rb_mse_servers_destroy(rb_mse);
+  mse_transfers_destroy(rb_mse);
+  mse_workers_destroy(rb_mse);
+  curl_multi_cleanup(rb_mse->multi);
 
   pthread_mutex_lock(&curl_global_mutex);
+  curl_share_put(rb_mse->share);
+  free(rb_mse);
   curl_global_cleanup();
   pthread_mutex_unlock(&curl_global_mutex);
 }
@@ -25,33 +25,111 @@
 
 #include "librd/rdlog.h"
 
-/// Struct that holds the position of the MAC
+/// Zone, building and floor. Shared by all the positions in the same place.
 /// Private: Do not use it directly.
-struct rb_mse_api_pos{
-  int currently_tracked;
-
+struct rb_mse_api_location{
   const char * floor;
   const char * build;
   const char * zone;
 
-  struct {
-    int geo_valid;
-    double lattitude;
-    double longitude;
-    const char * unit;
-  }geo;
+  /* IDs of zone, build and floor, unique per level. 0 if not present */
+  uint32_t floor_id;
+  uint32_t build_id;
+  uint32_t zone_id;
+};
+
+/* rb_mse_api_pos flags */
+#define RB_MSE_POS_F_CURRENTLY_TRACKED     0x01
+#define RB_MSE_POS_F_NOT_CURRENTLY_TRACKED 0x02
+#define RB_MSE_POS_F_MAP_VALID             0x04
+#define RB_MSE_POS_F_GEO_VALID             0x08
+#define RB_MSE_POS_F_STALE                 0x10
+
+/// Struct that holds the position of the MAC
+/// Private: Do not use it directly.
+struct rb_mse_api_pos{
+  uint64_t mac:48;
+  uint64_t flags:16;
+
+  /// Never NULL, even if the MSE did not send the MapInfo
+  const struct rb_mse_api_location * location;
+
+  double lattitude;
+  double longitude;
+  const char * unit;
+
+  /// Statistics.lastLocatedTime, in seconds since the epoch. 0 if unknown
+  uint32_t last_located;
+  /// MSE the position comes from
+  uint16_t mse;
 };
 
-#define rb_mse_pos_currently_tracked(pos) pos->currently_tracked
+#define rb_mse_pos_mac(pos) ((uint64_t)(pos)->mac)
+
+#define rb_mse_pos_currently_tracked(pos) (((pos)->flags & RB_MSE_POS_F_CURRENTLY_TRACKED) != 0)
+/// Position comes from the positions file, not from the MSE
+#define rb_mse_pos_stale(pos) (((pos)->flags & RB_MSE_POS_F_STALE) != 0)
+
+#define rb_mse_pos_floor(pos) (pos)->location->floor
+#define rb_mse_pos_build(pos) (pos)->location->build
+#define rb_mse_pos_zone(pos) (pos)->location->zone
+
+#define rb_mse_pos_floor_id(pos) (pos)->location->floor_id
+#define rb_mse_pos_build_id(pos) (pos)->location->build_id
+#define rb_mse_pos_zone_id(pos) (pos)->location->zone_id
+
+#define rb_mse_pos_geo_valid(pos) (((pos)->flags & RB_MSE_POS_F_GEO_VALID) != 0)
+#define rb_mse_pos_geo_lattitude(pos) (pos)->lattitude
+#define rb_mse_pos_geo_longitude(pos) (pos)->longitude
+#define rb_mse_pos_geo_unit(pos) (pos)->unit
+
+#define rb_mse_pos_last_located(pos) ((time_t)(pos)->last_located)
+/// Index of the MSE the position comes from, in the list given to rb_mse_api_new_multi
+#define rb_mse_pos_mse(pos) ((unsigned int)(pos)->mse)
+
+/* Optional fields of the positions, for rb_mse_api_new_fields() */
+#define RB_MSE_FIELD_MAP_COORDINATE 0x01 /* MapCoordinate x, y and unit */
+#define RB_MSE_FIELD_CONFIDENCE     0x02 /* confidenceFactor */
+#define RB_MSE_FIELD_BAND           0x04 /* band */
+#define RB_MSE_FIELD_DOT11_STATUS   0x08 /* dot11Status */
+#define RB_MSE_FIELD_IP_ADDRESS     0x10 /* First ipAddress */
+#define RB_MSE_FIELD_ALL            0x1f
+
+/*
+  Optional fields of a position. They only work on the positions the library
+  returns, not on copies of them.
+*/
+
+/* RB_MSE_FIELD_* fields the MSE sent for the position */
+unsigned int rb_mse_pos_fields(const struct rb_mse_api_pos *pos);
 
-#define rb_mse_pos_floor(pos) pos->floor
-#define rb_mse_pos_build(pos) pos->build
-#define rb_mse_pos_zone(pos) pos->zone
+/* MapCoordinate. unit can be NULL. Return 0 on success, -1 if not present */
+int rb_mse_pos_map_coordinate(const struct rb_mse_api_pos *pos,double *x,double *y,const char **unit);
 
-#define rb_mse_pos_geo_valid(pos) pos->geo.geo_valid
-#define rb_mse_pos_geo_lattitude(pos) pos->geo.lattitude
-#define rb_mse_pos_geo_longitude(pos) pos->geo.longitude
-#define rb_mse_pos_geo_unit(pos) pos->geo.unit
+/* confidenceFactor. Return 0 on success, -1 if not present */
+int rb_mse_pos_confidence(const struct rb_mse_api_pos *pos,double *confidence);
+
+/* band, dot11Status and first ipAddress. NULL if not present */
+const char *rb_mse_pos_band(const struct rb_mse_api_pos *pos);
+const char *rb_mse_pos_dot11_status(const struct rb_mse_api_pos *pos);
+const char *rb_mse_pos_ip_address(const struct rb_mse_api_pos *pos);
+
+/// One of the last positions of a MAC. rb_mse_pos_* location, geo and
+/// tracking macros work on it too.
+struct rb_mse_history_point
+{
+  /// Never NULL. Valid until rb_mse_api_destroy()
+  const struct rb_mse_api_location * location;
+
+  double lattitude;
+  double longitude;
+
+  /// lastLocatedTime of the position, or the time of the update that
+  /// received it if the MSE did not send it
+  uint32_t time;
+  /// RB_MSE_POS_F_* flags
+  uint16_t flags;
+};
 
 struct rb_mse_stats
 {
@@ -62,6 +140,12 @@ struct rb_mse_stats
 
   unsigned int number_of_macs_currently_tracked;
   unsigned int number_of_macs_no_currently_tracked;
+
+  /* Changes made by the last update, against the one before it, whether it
+     was copied from it or built from scratch */
+  unsigned int number_of_macs_added;
+  unsigned int number_of_macs_changed;
+  unsigned int number_of_macs_removed;
 };
 
 #define rb_mse_stats_number_of_macs_map_localized(stats) \
@@ -72,15 +156,133 @@ struct rb_mse_stats
   stats->number_of_macs_map_and_geo_localized
 #define rb_mse_stats_number_of_macs_unlocalizables(stats) \
   stats->number_of_macs_unlocalizables
+#define rb_mse_stats_number_of_macs_added(stats) \
+  stats->number_of_macs_added
+#define rb_mse_stats_number_of_macs_changed(stats) \
+  stats->number_of_macs_changed
+#define rb_mse_stats_number_of_macs_removed(stats) \
+  stats->number_of_macs_removed
+
+/* Stages of an update. Page ones are sampled once per downloaded page */
+enum rb_mse_stage
+{
+  /* Pages */
+  RB_MSE_STAGE_DNS,        /* Name resolution. Only new connections */
+  RB_MSE_STAGE_CONNECT,    /* TCP connection. Only new connections */
+  RB_MSE_STAGE_TLS,        /* TLS handshake. Only new connections */
+  RB_MSE_STAGE_FIRST_BYTE, /* From the request sent to the first byte of the response */
+  RB_MSE_STAGE_TRANSFER,   /* From the first byte to the last one */
+  RB_MSE_STAGE_PARSE,      /* JSON parsing, without inserting the entries */
+  RB_MSE_STAGE_INSERT,     /* Inserting the entries in the new positions */
+
+  /* Updates */
+  RB_MSE_STAGE_FETCH,      /* Downloading and processing all the pages */
+  RB_MSE_STAGE_SWEEP,      /* Removing the MACs that are not in the MSE anymore */
+  RB_MSE_STAGE_GEO_INDEX,  /* Indexing the geo coordinates */
+  RB_MSE_STAGE_LEVEL_INDEX,/* Indexing and counting the positions by zone, building and floor */
+  RB_MSE_STAGE_FILTER,     /* Building the negative lookup filter */
+  RB_MSE_STAGE_PUBLISH,    /* Publishing, and waiting for the readers of the old positions */
+  RB_MSE_STAGE_FREE,       /* Freeing the positions of the update before the last */
+  RB_MSE_STAGE_SNAPSHOT,   /* Writing the positions file */
+  RB_MSE_STAGE_UPDATE,     /* Whole update */
+
+  RB_MSE_STAGES
+};
+
+#define RB_MSE_HISTOGRAM_BUCKETS 32
+
+/// Timing of a stage. All times are in microseconds.
+struct rb_mse_stage_stats
+{
+  /// Time spent in the stage by the last update, summed over its pages
+  uint64_t last_us;
+
+  /* Samples of the last 64 to 128 updates */
+  uint64_t count;
+  uint64_t total_us;
+  uint64_t max_us;
+  /// histogram[0]: samples under 1us. histogram[i]: samples in
+  /// [2^(i-1),2^i) us. The last bucket has all the bigger ones.
+  uint64_t histogram[RB_MSE_HISTOGRAM_BUCKETS];
+};
+
+struct rb_mse_update_stats
+{
+  struct rb_mse_stage_stats stages[RB_MSE_STAGES];
+
+  /* Since the creation of the rb_mse_api */
+  uint64_t updates;
+  uint64_t failed_updates;
+  uint64_t pages;
+  /// Page requests that failed. They may have succeeded later
+  uint64_t failed_pages;
+  /// Response bodies as received, maybe compressed
+  uint64_t bytes_received;
+  /// Response bodies as parsed
+  uint64_t bytes_parsed;
+
+  /* Last update, published or not */
+  uint64_t last_pages;
+  uint64_t last_failed_pages;
+  uint64_t last_bytes_received;
+  uint64_t last_bytes_parsed;
+};
+
+/// Lookups through the negative lookup filter
+struct rb_mse_filter_stats
+{
+  /* Since the creation of the rb_mse_api */
+  /// Lookups answered by the filter alone: the MAC is not in the MSE
+  uint64_t rejected;
+  /// Lookups that went on to the positions
+  uint64_t passed;
+  /// Passed lookups whose MAC was not in the positions either
+  uint64_t false_positives;
+
+  /* Filter of the current positions. 0 if there is none */
+  size_t bytes;
+  size_t macs;
+};
 
 struct rb_mse_api;
 typedef void stats_cb_fn(struct rb_mse_api *rb_mse,struct rb_mse_stats *stats,void *opaque);
 
 void stdout_stats_cb(struct rb_mse_api *rb_mse, struct rb_mse_stats *stats, void *opaque);
 
+/* rb_mse_event types. An event can have many of them */
+#define RB_MSE_EVENT_APPEARED         0x01 /* MAC was not in the last update */
+#define RB_MSE_EVENT_DISAPPEARED      0x02 /* MAC is not in the MSE anymore */
+#define RB_MSE_EVENT_ZONE_CHANGED     0x04 /* Left a zone and entered another one */
+#define RB_MSE_EVENT_BUILD_CHANGED    0x08 /* Left a building and entered another one */
+#define RB_MSE_EVENT_FLOOR_CHANGED    0x10 /* Left a floor and entered another one */
+#define RB_MSE_EVENT_TRACKING_STARTED 0x20 /* currentlyTracked became true */
+#define RB_MSE_EVENT_TRACKING_STOPPED 0x40 /* currentlyTracked stopped being true */
+#define RB_MSE_EVENT_GEO_MOVED        0x80 /* Geo coordinates moved more than the threshold,
+                                              or appeared or disappeared */
+
+/// Change of a MAC between two updates
+struct rb_mse_event
+{
+  uint64_t mac;
+  /// RB_MSE_EVENT_* flags
+  unsigned int type;
+  /// Position in the last update. NULL if the MAC appeared
+  const struct rb_mse_api_pos *old_pos;
+  /// Position in the new update. NULL if the MAC disappeared
+  const struct rb_mse_api_pos *new_pos;
+};
+
+/// Called with a batch of events. Positions are valid until the callback returns.
+typedef void rb_mse_events_cb_fn(struct rb_mse_api *rb_mse,const struct rb_mse_event *events,size_t n,
+  void *opaque);
+
 /** 
   Return a new rb_mse_api struct
 
+  @param update_time Seconds between updates
+  @param addr        MSE host[:port]. It is requested over HTTPS, unless it
+                     starts with another scheme, like http://host:port
+  @param userpwd     user:password, or NULL
   @return new rb_mse_api
  
   @note after this call, errno can be:
@@ -88,18 +290,172 @@ void stdout_stats_cb(struct rb_mse_api *rb_mse, struct rb_mse_stats *stats, void
 */
 struct rb_mse_api * rb_mse_api_new(time_t update_time,const char * addr,const char *userpwd);
 
+/**
+  Return a new rb_mse_api struct that merges the positions of many MSEs
+
+  @param update_time Seconds between updates
+  @param addrs       Addresses of the MSEs, like rb_mse_api_new() addr
+  @param userpwds    user:password of every MSE. It can be NULL, and so can
+                     be its elements, for MSEs without authentication
+  @param n           Number of MSEs, up to UINT16_MAX
+  @return new rb_mse_api
+
+  @note All MSEs are polled at the same time, and an update is only published
+        if all of them answered. If a MAC is in many MSEs, the currently
+        tracked position wins, and then the one with the latest
+        lastLocatedTime.
+  @note after this call, errno can be:
+     ENOMEM: malloc error
+     EINVAL: no MSEs or too many of them
+  @see rb_mse_pos_mse
+*/
+struct rb_mse_api * rb_mse_api_new_multi(time_t update_time,const char * const *addrs,
+  const char * const *userpwds,size_t n);
+
+/**
+  Like rb_mse_api_new_multi(), but the positions also hold optional fields.
+
+  @param fields RB_MSE_FIELD_* fields to keep. Only these are parsed, and
+                only these make the positions bigger
+  @note after this call, errno can be:
+     ENOMEM: malloc error
+     EINVAL: no MSEs, too many of them, or unknown fields
+  @see rb_mse_pos_fields
+*/
+struct rb_mse_api * rb_mse_api_new_fields(time_t update_time,const char * const *addrs,
+  const char * const *userpwds,size_t n,unsigned int fields);
+
+/* Address of the first MSE */
 const char * rb_mse_addr(struct rb_mse_api *rb_mse);
 
+/* Number of MSEs and address of the i-th one. NULL if i is out of range */
+size_t rb_mse_mse_count(const struct rb_mse_api *rb_mse);
+const char * rb_mse_mse_addr(const struct rb_mse_api *rb_mse,size_t i);
+
 void rb_mse_set_stats_cb(struct rb_mse_api *rb_mse ,stats_cb_fn *stats_cb,void *opaque);
 
+/**
+  Stats of the current positions.
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @return       Stats, valid until rb_mse_api_destroy(). The updater thread
+                overwrites them on every update, so use rb_mse_copy_stats()
+                to read them all from the same update.
+*/
+const struct rb_mse_stats *rb_mse_get_stats(struct rb_mse_api *rb_mse);
+
+/* Copy the stats of the current positions */
+void rb_mse_copy_stats(struct rb_mse_api *rb_mse,struct rb_mse_stats *stats);
+
+/**
+  Get the changes of every update.
+  @param rb_mse     rb_mse_api struct that hold all curl information
+  @param events_cb  Called from the updater thread, in batches, after an update
+                    is published and before stats_cb. NULL to stop the events
+  @param geo_move_m Metres geo coordinates have to move for a
+                    RB_MSE_EVENT_GEO_MOVED event. 0 reports any move
+  @param opaque     events_cb opaque
+  @note The first update reports every MAC as appeared. Updates are diffed
+        while they are swept, so the cost follows the changes, except for
+        updates built from scratch (see rb_mse_set_delta_updates()), that
+        compare every MAC with the last update.
+*/
+void rb_mse_set_events_cb(struct rb_mse_api *rb_mse,rb_mse_events_cb_fn *events_cb,double geo_move_m,
+  void *opaque);
+
+/**
+  Keep the last positions of every MAC.
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @param macs   MACs to keep the history of. When there are more, the ones
+                updated the longest ago are forgotten
+  @param points Positions kept of every MAC
+  @return 0 on success, -1 and errno on error:
+     EINVAL: macs or points is 0
+     EBUSY:  history was already enabled
+     ENOMEM: malloc error
+  @note All the memory, from 4/3 to 8/3 times macs*(points*32 + 24) bytes,
+        is allocated here. A position is added when the MAC is at another place or geo
+        coordinates than its last one, starting from the next update.
+*/
+int rb_mse_set_history(struct rb_mse_api *rb_mse,size_t macs,unsigned int points);
+
+/**
+  Set the maximum number of MSE pages requested at the same time.
+  @param rb_mse          rb_mse_api struct that hold all curl information
+  @param max_connections Simultaneous connections. 0 means 1.
+  @note The new value is applied at the beginning of the next update.
+*/
+void rb_mse_set_max_connections(struct rb_mse_api *rb_mse, unsigned int max_connections);
+
+/**
+  Set the number of threads that parse the MSE pages.
+  @param rb_mse  rb_mse_api struct that hold all curl information
+  @param threads Parse threads. 0, the default, parses every page in the
+                 updater thread as it arrives.
+  @note With threads, pages are parsed in parallel while the next ones are
+        downloaded, and the updater thread only adds the decoded entries to
+        the update, with the same precedence rules. The new value is applied
+        at the beginning of the next update.
+*/
+void rb_mse_set_parse_threads(struct rb_mse_api *rb_mse, unsigned int threads);
+
+/**
+  Size the negative lookup filter, that answers the lookups of MACs that are
+  not in the MSE without searching the positions.
+  @param rb_mse       rb_mse_api struct that hold all curl information
+  @param bits_per_mac Filter bits per MAC. Every bit more makes the filter
+                      pass about a quarter fewer unknown MACs. 0 disables it.
+                      Default is 10, that passes about 1% of them.
+  @note The filter costs one more cache line to the lookups of known MACs, so
+        disable it if almost all lookups find their MAC. The new value is
+        applied to the next update.
+  @see rb_mse_get_filter_stats
+*/
+void rb_mse_set_filter_bits(struct rb_mse_api *rb_mse, unsigned int bits_per_mac);
+
+/**
+  Choose how updates are built.
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @param onoff  If true (the default), every update starts from a copy of the
+                last one and only stores the MACs that changed. If false,
+                every update is built from scratch.
+  @note The new value is applied at the beginning of the next update. Stats,
+        events and rb_mse_set_max_update_time() see the same changes in
+        both modes.
+*/
+void rb_mse_set_delta_updates(struct rb_mse_api *rb_mse, int onoff);
+
+/**
+  Let the updates slow down while the positions do not change.
+  @param rb_mse          rb_mse_api struct that hold all curl information
+  @param max_update_time Seconds. While an update changes less than 0.1% of
+                         the positions, the time between updates grows from
+                         update_time up to this. Values lower than
+                         update_time (the default) keep it fixed.
+  @note Updates start every update_time seconds, but never sooner than the
+        last update took. Failed updates are retried with exponential
+        backoff, up to 5 minutes.
+  @note Changes are the ones of rb_mse_stats, counted against the last
+        update whether rb_mse_set_delta_updates() copies it or builds the
+        update from scratch, so both modes slow down alike. The positions
+        loaded by rb_mse_set_snapshot_file() count as the last update too.
+*/
+void rb_mse_set_max_update_time(struct rb_mse_api *rb_mse, time_t max_update_time);
+
 /**
 	Get the position of a mac from MSE
 	@param rb_mse rb_mse_api struct that hold all curl information
 	@param pos    pointer to a pointer to position. If *pos=NULL, 
-	@param mac    MAC address you want to know the position
-	@return       position of the mac
+	@param mac    MAC address you want to know the position, as aa:bb:cc:dd:ee:ff,
+	              aa-bb-cc-dd-ee-ff, aabb.ccdd.eeff or aabbccddeeff
+	@return       position of the mac. NULL if it is unknown or, with errno
+	              EINVAL, if mac is malformed
+	@note         Lookups never block, even while an update is being published.
+	              The returned position is valid until the second update after
+	              this call, so at least update_time seconds.
+	              Use a snapshot to keep it longer.
 	@see struct rb_mse_api_pos
 	@see rb_mse_pos_destroy
+	@see rb_mse_snapshot_acquire
 */
 const struct rb_mse_api_pos * rb_mse_req_for_mac(struct rb_mse_api *rb_mse,const char *mac);
 
@@ -109,13 +465,248 @@ const struct rb_mse_api_pos * rb_mse_req_for_mac(struct rb_mse_api *rb_mse,const
   @param pos    pointer to a pointer to position. If *pos=NULL, 
   @param mac    MAC address you want to know the position
   @return       position of the mac
+  @note         Same lifetime as rb_mse_req_for_mac() result
   @see struct rb_mse_api_pos
   @see rb_mse_pos_destroy
 */
 const struct rb_mse_api_pos * rb_mse_req_for_mac_i(struct rb_mse_api *rb_mse,uint64_t mac);
 
+/**
+  Get the last positions of a mac
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @param mac    MAC address, like rb_mse_req_for_mac() mac
+  @param points Where to copy the positions, the oldest first
+  @param max    Size of points. The most recent ones are copied
+  @return       Number of positions copied. 0 if the MAC is unknown, history
+                is not enabled or, with errno EINVAL, if mac is malformed
+  @note         The positions are copied, so this never blocks the updater and
+                the points do not expire.
+  @see rb_mse_set_history
+*/
+size_t rb_mse_history_for_mac(struct rb_mse_api *rb_mse,const char *mac,struct rb_mse_history_point *points,
+  size_t max);
+
+/**
+  Get the last positions of a mac
+  @see rb_mse_history_for_mac
+*/
+size_t rb_mse_history_for_mac_i(struct rb_mse_api *rb_mse,uint64_t mac,struct rb_mse_history_point *points,
+  size_t max);
+
+/**
+  Get the positions of a batch of MACs
+  @param rb_mse    rb_mse_api struct that hold all curl information
+  @param macs      MAC addresses you want to know the position of
+  @param n         Number of MACs
+  @param positions Output array of n elements. positions[i] will be the
+                   position of macs[i], or NULL if it is unknown or malformed
+  @return          Number of MACs found
+  @note            All the batch is resolved against the same update, and it is
+                   cheaper than n calls to rb_mse_req_for_mac(). Positions have
+                   the same lifetime as rb_mse_req_for_mac() result
+*/
+size_t rb_mse_req_for_macs(struct rb_mse_api *rb_mse,const char * const *macs,size_t n,
+  const struct rb_mse_api_pos **positions);
+
+/**
+  Get the positions of a batch of MACs
+  @see rb_mse_req_for_macs
+*/
+size_t rb_mse_req_for_macs_i(struct rb_mse_api *rb_mse,const uint64_t *macs,size_t n,
+  const struct rb_mse_api_pos **positions);
+
+/**
+  Positions of one update, that stay valid until released. Lookups and
+  iteration through a snapshot never block and don't touch memory shared
+  with other threads, and its positions can be kept without copying them.
+  Snapshots must be released before rb_mse_api_destroy().
+*/
+struct rb_mse_snapshot;
+
+/**
+  Take a snapshot of the current positions
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @return       Snapshot, or NULL if there are no positions yet
+  @note         A snapshot keeps all its positions in memory, so do not hold
+                it for many updates.
+  @see rb_mse_snapshot_release
+*/
+struct rb_mse_snapshot * rb_mse_snapshot_acquire(struct rb_mse_api *rb_mse);
+
+/**
+  Release a snapshot. Its positions can't be used after this call.
+  @param snapshot Snapshot, or NULL
+*/
+void rb_mse_snapshot_release(struct rb_mse_snapshot *snapshot);
+
+/**
+  Get the position of a mac in a snapshot
+  @param snapshot Snapshot. NULL is like an empty one
+  @param mac      MAC address, like in rb_mse_req_for_mac()
+  @return         position of the mac, valid until the snapshot is released.
+                  NULL if it is unknown or, with errno EINVAL, if mac is
+                  malformed
+*/
+const struct rb_mse_api_pos * rb_mse_snapshot_req_for_mac(const struct rb_mse_snapshot *snapshot,
+  const char *mac);
+
+/**
+  Get the position of a mac in a snapshot
+  @see rb_mse_snapshot_req_for_mac
+*/
+const struct rb_mse_api_pos * rb_mse_snapshot_req_for_mac_i(const struct rb_mse_snapshot *snapshot,
+  uint64_t mac);
+
+/**
+  Get the positions of a batch of MACs in a snapshot
+  @see rb_mse_req_for_macs
+*/
+size_t rb_mse_snapshot_req_for_macs(const struct rb_mse_snapshot *snapshot,const char * const *macs,
+  size_t n,const struct rb_mse_api_pos **positions);
+
+/**
+  Get the positions of a batch of MACs in a snapshot
+  @see rb_mse_req_for_macs
+*/
+size_t rb_mse_snapshot_req_for_macs_i(const struct rb_mse_snapshot *snapshot,const uint64_t *macs,
+  size_t n,const struct rb_mse_api_pos **positions);
+
+/* Number of positions of a snapshot */
+size_t rb_mse_snapshot_count(const struct rb_mse_snapshot *snapshot);
+
+/// Called for every position of a snapshot. Return non-zero to stop.
+typedef int rb_mse_pos_cb_fn(const struct rb_mse_api_pos *pos,void *opaque);
+
+/**
+  Call cb for every position of a snapshot, in no particular order
+  @param snapshot Snapshot. NULL is like an empty one
+  @param cb       Callback
+  @param opaque   cb opaque
+  @return         Number of positions cb was called for
+*/
+size_t rb_mse_snapshot_foreach(const struct rb_mse_snapshot *snapshot,rb_mse_pos_cb_fn *cb,void *opaque);
+
+/* Stats of the update of a snapshot. NULL if snapshot is NULL */
+const struct rb_mse_stats * rb_mse_snapshot_stats(const struct rb_mse_snapshot *snapshot);
+
+/* 1 if the positions of a snapshot come from the positions file, 0 otherwise */
+int rb_mse_snapshot_is_stale(const struct rb_mse_snapshot *snapshot);
+
+/**
+  Call cb for every geo localized position within a distance of a point.
+  Cost depends on the positions around the point, not on all of them.
+  @param snapshot   Snapshot. NULL is like an empty one
+  @param lattitude  Point lattitude, in degrees
+  @param longitude  Point longitude, in degrees
+  @param radius_m   Great circle distance, in metres
+  @param cb         Callback. Return non-zero to stop
+  @param opaque     cb opaque
+  @return           Number of positions cb was called for
+*/
+size_t rb_mse_snapshot_geo_radius(const struct rb_mse_snapshot *snapshot,double lattitude,double longitude,
+  double radius_m,rb_mse_pos_cb_fn *cb,void *opaque);
+
+/**
+  Call cb for every geo localized position inside a box, borders included.
+  If min_longitude > max_longitude, the box crosses the antimeridian.
+  @see rb_mse_snapshot_geo_radius
+*/
+size_t rb_mse_snapshot_geo_box(const struct rb_mse_snapshot *snapshot,double min_lattitude,
+  double min_longitude,double max_lattitude,double max_longitude,rb_mse_pos_cb_fn *cb,void *opaque);
+
+/* Levels of the MSE mapHierarchyString */
+enum rb_mse_level
+{
+  RB_MSE_LEVEL_ZONE,
+  RB_MSE_LEVEL_BUILD,
+  RB_MSE_LEVEL_FLOOR,
+
+  RB_MSE_LEVELS
+};
+
+/// Positions in a zone, building or floor
+struct rb_mse_occupancy
+{
+  unsigned int positions;
+  unsigned int currently_tracked;
+  unsigned int not_currently_tracked;
+  unsigned int geo_valid;
+};
+
+/**
+  Occupancy of all the zones, buildings or floors of a snapshot. It is
+  counted when the update is built, so this is just an array read.
+  @param snapshot Snapshot. NULL is like an empty one
+  @param level    Level
+  @param ids      Size of the returned array
+  @return         Occupancy of every ID of the level, like rb_mse_pos_floor_id().
+                  Element 0 counts the positions without that level. NULL,
+                  with *ids 0, if there are no positions
+*/
+const struct rb_mse_occupancy * rb_mse_snapshot_occupancy(const struct rb_mse_snapshot *snapshot,
+  enum rb_mse_level level,size_t *ids);
+
+/**
+  Positions in a zone, building or floor of a snapshot
+  @param snapshot  Snapshot. NULL is like an empty one
+  @param level     Level
+  @param id        ID of the level, or 0 for the positions without it
+  @param positions The positions, in no particular order. They are valid
+                   until the snapshot is released
+  @return          Number of positions
+*/
+size_t rb_mse_snapshot_level_positions(const struct rb_mse_snapshot *snapshot,enum rb_mse_level level,
+  uint32_t id,const struct rb_mse_api_pos * const **positions);
+
+/* Name of a zone, building or floor ID of a snapshot. NULL if it has no positions */
+const char * rb_mse_snapshot_level_name(const struct rb_mse_snapshot *snapshot,enum rb_mse_level level,
+  uint32_t id);
+
 int rb_mse_isempty(const struct rb_mse_api * rb_mse);
 
+/**
+  Get the timings of the updates.
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @param stats  Where to copy them
+  @see enum rb_mse_stage
+*/
+void rb_mse_get_update_stats(struct rb_mse_api *rb_mse, struct rb_mse_update_stats *stats);
+
+/**
+  Get the counters of the negative lookup filter.
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @param stats  Where to copy them
+  @note Lookups through snapshots are not counted.
+  @see rb_mse_set_filter_bits
+*/
+void rb_mse_get_filter_stats(struct rb_mse_api *rb_mse, struct rb_mse_filter_stats *stats);
+
+/* Name of a stage, like "first_byte". NULL if stage is not valid */
+const char * rb_mse_stage_name(enum rb_mse_stage stage);
+
+/**
+  Keep the positions in a file, so a restarted process can use them before
+  its first update finishes.
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @param path   Positions file. Every update will be written to it. If there
+                are no positions yet, the ones in the file are served right
+                away, marked as stale, until the first update. NULL to stop
+                writing it.
+  @return       0 on success, -1 on memory error
+  @note         Zone, building and floor IDs of stale positions are not the
+                same ones of the positions of the updates.
+  @see rb_mse_is_stale
+*/
+int rb_mse_set_snapshot_file(struct rb_mse_api *rb_mse, const char *path);
+
+/**
+  Check if the positions come from the positions file.
+  @param rb_mse rb_mse_api struct that hold all curl information
+  @return       1 if served positions are stale, 0 otherwise
+  @see rb_mse_set_snapshot_file
+*/
+int rb_mse_is_stale(const struct rb_mse_api *rb_mse);
+
 #define rb_mse_debug_set(rb_mse,onoff) rd_dbg_set (onoff)
 
 /* call curl_easy_setopt in rb_mse_api */